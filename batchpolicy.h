@@ -0,0 +1,215 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// BatchPolicy
+//
+// Decides how large a batch of frames a SocketChannel sends and how long it may hold frames back,
+// based on what the client last reported about its frame buffer.  When the client's buffer is
+// running low, frames go out one at a time as soon as they are rendered; as the buffer fills
+// up, batches grow in frames, bytes and delay, which saves packets and wakeups when there is
+// plenty of lead to spare.
+//
+// It also does credit-based flow control: the client can hold bufferSize frames, it last said it
+// was holding bufferPos, and everything we've sent after the frame that response acknowledged is
+// assumed to still be on its way.  Whatever is left is how many frames we may send before hearing
+// back.  The feature's ClientBufferCount is the lead we aim for, so batches are sized against that
+// rather than against the whole device buffer.
+//
+// Until a client has responded, or once its last response is older than kResponseTimeout, we
+// have nothing to go on and fall back to fixed batches with no credit limit.
+//
+// The largest batch, in frames, bytes and delay, defaults to the kMaxBatch constants but can be
+// changed with SetCeilings (see TransportProfile).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include "json.hpp"
+
+struct BatchLimits
+{
+    size_t       maxFrames;         // Send once this many frames are queued...
+    size_t       maxBytes;          // ...or this many bytes...
+    milliseconds maxDelay;          // ...or this long after the previous send, whichever comes first
+    size_t       credits;           // Frames the client has room for; 0 means wait for it to respond
+    bool         flowControlled;    // False while we have no fresh client response to go on
+
+    friend void to_json(nlohmann::json& j, const BatchLimits& limits)
+    {
+        j = {
+            {"maxFrames",      limits.maxFrames},
+            {"maxBytes",       limits.maxBytes},
+            {"maxDelayMs",     limits.maxDelay.count()},
+            {"flowControlled", limits.flowControlled}
+        };
+
+        if (limits.flowControlled)
+            j["credits"] = limits.credits;
+        else
+            j["credits"] = nullptr;
+    }
+};
+
+class BatchPolicy
+{
+public:
+    static constexpr size_t       kMinBatchFrames  = 1;
+    static constexpr size_t       kMaxBatchFrames  = 20;
+    static constexpr size_t       kMinBatchBytes   = 16 * 1024;
+    static constexpr size_t       kMaxBatchBytes   = 256 * 1024;
+    static constexpr milliseconds kMaxBatchDelay   = 1000ms;
+    static constexpr milliseconds kResponseTimeout = 2000ms;
+    static constexpr double       kLowWaterMark    = 0.25;     // Below this fraction of the target, send right away
+    static constexpr uint32_t     kDefaultFps      = 30;       // For clients that don't report fpsDrawing
+
+private:
+    uint32_t _targetFrames;
+
+    // Batch ceilings, only touched on the channel's strand
+
+    size_t       _maxBatchFrames = kMaxBatchFrames;
+    size_t       _maxBatchBytes  = kMaxBatchBytes;
+    milliseconds _maxBatchDelay  = kMaxBatchDelay;
+
+    // Client state, only touched on the channel's strand
+
+    bool     _hasResponse = false;
+    uint32_t _clientBufferPos = 0;
+    uint32_t _clientBufferSize = 0;
+    uint32_t _clientFps = 0;
+    size_t   _inFlight = 0;              // Frames sent that the client hasn't acknowledged yet
+    steady_clock::time_point _lastResponseTime;
+
+    // The most recent limits, published for readers on other threads
+
+    atomic<size_t>  _maxFrames{kMaxBatchFrames};
+    atomic<size_t>  _maxBytes{kMaxBatchBytes};
+    atomic<int64_t> _maxDelayMs{kMaxBatchDelay.count()};
+    atomic<size_t>  _credits{numeric_limits<size_t>::max()};
+    atomic<bool>    _flowControlled{false};
+
+    BatchLimits Compute(steady_clock::time_point now) const
+    {
+        if (!_hasResponse || _clientBufferSize == 0 || now - _lastResponseTime > kResponseTimeout)
+            return { _maxBatchFrames, _maxBatchBytes, _maxBatchDelay, numeric_limits<size_t>::max(), false };
+
+        size_t capacity = _clientBufferSize;
+        size_t target = clamp<size_t>(_targetFrames, 1, capacity);
+        size_t committed = _clientBufferPos + _inFlight;
+        size_t credits = committed >= capacity ? 0 : capacity - committed;
+        double fill = min(1.0, static_cast<double>(committed) / target);
+
+        size_t minBytes = min(kMinBatchBytes, _maxBatchBytes);
+
+        if (fill < kLowWaterMark)
+            return { kMinBatchFrames, minBytes, 0ms, credits, true };
+
+        // Grow linearly from the smallest batch at the low water mark to the largest at the target
+
+        double scale = (fill - kLowWaterMark) / (1.0 - kLowWaterMark);
+        size_t maxFrames = kMinBatchFrames + static_cast<size_t>(scale * (_maxBatchFrames - kMinBatchFrames) + 0.5);
+        size_t maxBytes = minBytes + static_cast<size_t>(scale * (_maxBatchBytes - minBytes));
+
+        // Never hold frames back for more than half of the time the client has buffered
+
+        uint32_t fps = _clientFps ? _clientFps : kDefaultFps;
+        auto buffered = milliseconds(_clientBufferPos * 1000 / fps);
+        auto maxDelay = min({ duration_cast<milliseconds>(_maxBatchDelay * scale), buffered / 2, _maxBatchDelay });
+
+        return { maxFrames, maxBytes, maxDelay, credits, true };
+    }
+
+public:
+    explicit BatchPolicy(uint32_t targetFrames) : _targetFrames(targetFrames)
+    {
+    }
+
+    // Strand only: changes the largest batch the policy will allow from now on
+
+    void SetCeilings(size_t maxFrames, size_t maxBytes, milliseconds maxDelay)
+    {
+        _maxBatchFrames = max(maxFrames, kMinBatchFrames);
+        _maxBatchBytes = max<size_t>(maxBytes, 1);
+        _maxBatchDelay = max(maxDelay, 0ms);
+    }
+
+    // Strand only: recomputes the limits for right now and publishes them
+
+    BatchLimits Update(steady_clock::time_point now)
+    {
+        BatchLimits limits = Compute(now);
+
+        _maxFrames.store(limits.maxFrames, memory_order_relaxed);
+        _maxBytes.store(limits.maxBytes, memory_order_relaxed);
+        _maxDelayMs.store(limits.maxDelay.count(), memory_order_relaxed);
+        _credits.store(limits.credits, memory_order_relaxed);
+        _flowControlled.store(limits.flowControlled, memory_order_relaxed);
+
+        return limits;
+    }
+
+    // Any thread: the limits as of the last Update
+
+    BatchLimits Current() const
+    {
+        return {
+            _maxFrames.load(memory_order_relaxed),
+            _maxBytes.load(memory_order_relaxed),
+            milliseconds(_maxDelayMs.load(memory_order_relaxed)),
+            _credits.load(memory_order_relaxed),
+            _flowControlled.load(memory_order_relaxed)
+        };
+    }
+
+    // Strand only: how much of the lead we aim for the client holds, counting what's on its way
+    // to it, from 0 to 1.  Without a fresh response we can't tell, and call it full.
+
+    double Lead(steady_clock::time_point now) const
+    {
+        if (!_hasResponse || _clientBufferSize == 0 || now - _lastResponseTime > kResponseTimeout)
+            return 1.0;
+
+        size_t target = clamp<size_t>(_targetFrames, 1, _clientBufferSize);
+        return min(1.0, static_cast<double>(_clientBufferPos + _inFlight) / target);
+    }
+
+    void OnFramesSent(size_t frames)
+    {
+        _inFlight += frames;
+    }
+
+    // Clients answer every frame with the sequence number of the latest one they've received, so
+    // whatever we sent after that one is still on its way, however many responses arrive for a
+    // batch.  framesSent is the sequence number of the last frame we sent.  Old clients don't
+    // number their responses; for them the best we can do is to assume each response covers
+    // everything sent so far.
+
+    void OnResponse(uint32_t bufferPos, uint32_t bufferSize, uint32_t fpsDrawing, uint64_t sequence, uint64_t framesSent,
+                    steady_clock::time_point now)
+    {
+        _hasResponse = true;
+        _clientBufferPos = bufferPos;
+        _clientBufferSize = bufferSize;
+        _clientFps = fpsDrawing;
+        _inFlight = sequence && sequence <= framesSent ? framesSent - sequence : 0;
+        _lastResponseTime = now;
+    }
+
+    // A new connection means a client that may well have restarted, so forget what it told us
+
+    void Reset()
+    {
+        _hasResponse = false;
+        _inFlight = 0;
+    }
+
+    // When we run out of credits and the client goes quiet, this is when we stop waiting for it
+
+    steady_clock::time_point ResponseDeadline() const
+    {
+        return _lastResponseTime + kResponseTimeout;
+    }
+};
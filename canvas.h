@@ -108,7 +108,7 @@ public:
         {
             if (_features[i]->Id() == featureId)
             {
-                _features[i]->Socket()->Stop();
+                _features[i]->Sink()->Stop();
                 _features.erase(_features.begin() + i);
                 return true;
             }
@@ -32,6 +32,8 @@ class Controller : public IController
 
     vector<shared_ptr<ICanvas>> _canvases;
     uint16_t                    _port;
+    UplinkLimits                _uplinkLimits;
+    size_t                      _queueBudget = 0;
     mutable mutex               _canvasMutex;
 
   public:
@@ -86,6 +88,33 @@ class Controller : public IController
         _port = port;
     }
 
+    UplinkLimits GetUplinkLimits() const override
+    {
+        return _uplinkLimits;
+    }
+
+    void SetUplinkLimits(const UplinkLimits& limits) override
+    {
+        _uplinkLimits = limits;
+        SocketReactor::Instance().Uplink().SetLimits(limits);
+    }
+
+    size_t GetQueueBudget() const override
+    {
+        return _queueBudget;
+    }
+
+    void SetQueueBudget(size_t budgetBytes) override
+    {
+        _queueBudget = budgetBytes;
+        SocketReactor::Instance().Budget().SetBudget(budgetBytes);
+    }
+
+    QueueBudgetUsage GetQueueBudgetUsage() const override
+    {
+        return SocketReactor::Instance().Budget().GetUsage();
+    }
+
     bool AddFeatureToCanvas(uint16_t canvasId, shared_ptr<ILEDFeature> feature) override
     {
         lock_guard lock(_canvasMutex);
@@ -370,7 +399,7 @@ class Controller : public IController
 
         for (const auto &canvas : _canvases)
             for (const auto &feature : canvas->Features())
-                feature->Socket()->Start();
+                feature->Sink()->Start();
     }
 
     void Disconnect() override
@@ -380,7 +409,7 @@ class Controller : public IController
 
         for (const auto &canvas : _canvases)
             for (const auto &feature : canvas->Features())
-                feature->Socket()->Stop();
+                feature->Sink()->Stop();
     }
 
     void Start(bool respectWantsToRun) override
@@ -438,7 +467,7 @@ class Controller : public IController
             auto canvas = GetCanvasById(id);
             canvas->Effects().Stop();
             for (auto &feature : canvas->Features())
-                feature->Socket()->Stop();
+                feature->Sink()->Stop();
             
             // Erase the canvas from _canvases
             _canvases.erase(
@@ -496,7 +525,8 @@ class Controller : public IController
         vector<shared_ptr<ISocketChannel>> sockets;
         for (const auto &canvas : _canvases)
             for (const auto &feature : canvas->Features())
-                sockets.push_back(feature->Socket());
+                if (feature->Socket())
+                    sockets.push_back(feature->Socket());
         return sockets;
     }
 
@@ -505,7 +535,7 @@ class Controller : public IController
         lock_guard lock(_canvasMutex);
         for (const auto &canvas : _canvases)
             for (const auto &feature : canvas->Features())
-                if (feature->Id() == id)
+                if (feature->Id() == id && feature->Socket())
                     return feature->Socket();
         throw out_of_range("Socket not found: " + to_string(id));
     }
@@ -518,6 +548,8 @@ inline void to_json(nlohmann::json &j, const IController &controller)
     try
     {
         j["port"] = controller.GetPort();
+        j["uplink"] = controller.GetUplinkLimits();
+        j["queueBudgetBytes"] = controller.GetQueueBudget();
         for (const auto &canvas : controller.Canvases())
             j["canvases"].push_back(*canvas);
     }
@@ -539,6 +571,10 @@ inline void from_json(const nlohmann::json &j, unique_ptr<Controller> & ptrContr
         // Create controller
         ptrController = make_unique<Controller>(port);
 
+        // The uplink limits and queue budget are optional
+        ptrController->SetUplinkLimits(j.value("uplink", UplinkLimits()));
+        ptrController->SetQueueBudget(j.value("queueBudgetBytes", size_t(0)));
+
         // Extract canvases
         for (const auto &canvasJson : j.at("canvases"))
             ptrController->AddCanvas(canvasJson.get<shared_ptr<ICanvas>>());
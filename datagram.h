@@ -0,0 +1,162 @@
+#pragma once
+using namespace std;
+
+// Datagram transport
+//
+// A feature can have its channel send frames over UDP instead of TCP.  Frames go stale within a
+// few milliseconds, so on a lossy WiFi link it's often better to lose one than to have TCP hold
+// up every frame behind it while it retransmits.  Each frame travels in a datagram of its own,
+// exactly as it would have been written to the TCP stream, behind a small header:
+//
+//   uint32_t tag         kHeaderTag ("NDSU"), little-endian like the rest of the protocol
+//   uint32_t sequence    The frame's number on this connection, counting up by one per datagram
+//                        from 1, so the client can tell loss from reordering
+//
+// The client sends its ClientResponse packets back to the port the datagrams came from, one
+// response per datagram with the sequence number it answers, and the channel reads them on the
+// same socket.
+
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include <asio.hpp>
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "json.hpp"
+#include "utilities.h"
+
+enum class ChannelProtocol : uint8_t
+{
+    Tcp,
+    Udp
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(ChannelProtocol, {
+    { ChannelProtocol::Tcp, "tcp" },
+    { ChannelProtocol::Udp, "udp" }
+})
+
+// DatagramBatch
+//
+// One batch of frames on its way out as datagrams.  On Linux the whole batch is handed to the
+// kernel with a single sendmmsg(); elsewhere we fall back to a sendmsg() per datagram.  Either
+// way the frames themselves are never copied: each datagram is a two-entry iovec of its header
+// and the frame where it sits in the FrameRing.
+
+class DatagramBatch
+{
+public:
+    static constexpr uint32_t kHeaderTag = 0x4E445355;                   // "NDSU", like the "DAVE" tag on compressed frames
+    static constexpr size_t   kHeaderSize = 2 * sizeof(uint32_t);
+
+private:
+    vector<array<uint8_t, kHeaderSize>> _headers;
+    vector<iovec>                       _iovecs;
+#ifdef __linux__
+    vector<mmsghdr>                     _messages;
+#else
+    vector<msghdr>                      _messages;
+#endif
+    size_t _count = 0;
+    size_t _next = 0;
+
+public:
+    explicit DatagramBatch(size_t maxDatagrams)
+        : _headers(maxDatagrams), _iovecs(2 * maxDatagrams), _messages(maxDatagrams)
+    {
+    }
+
+    // Assign
+    //
+    // Starts a new batch with one datagram per frame, numbering them from sequence onwards.  Grows
+    // if the batch is bigger than any before it.
+
+    void Assign(span<const asio::const_buffer> frames, uint32_t sequence)
+    {
+        if (frames.size() > _messages.size())
+        {
+            _headers.resize(frames.size());
+            _iovecs.resize(2 * frames.size());
+            _messages.resize(frames.size());
+        }
+
+        _count = frames.size();
+        _next = 0;
+
+        for (size_t i = 0; i < _count; i++)
+        {
+            auto tag = Utilities::DWORDToBytes(kHeaderTag);
+            auto number = Utilities::DWORDToBytes(sequence++);
+            copy(tag.begin(), tag.end(), _headers[i].begin());
+            copy(number.begin(), number.end(), _headers[i].begin() + tag.size());
+
+            _iovecs[2 * i]     = { _headers[i].data(), kHeaderSize };
+            _iovecs[2 * i + 1] = { const_cast<void *>(frames[i].data()), frames[i].size() };
+
+            msghdr message {};
+            message.msg_iov = &_iovecs[2 * i];
+            message.msg_iovlen = 2;
+#ifdef __linux__
+            _messages[i] = { message, 0 };
+#else
+            _messages[i] = message;
+#endif
+        }
+    }
+
+    size_t Remaining() const
+    {
+        return _count - _next;
+    }
+
+    // Skip
+    //
+    // Gives up on the next datagram, for one the kernel has refused outright
+
+    void Skip()
+    {
+        if (_next < _count)
+            _next++;
+    }
+
+    // Send
+    //
+    // Sends as many of the remaining datagrams as the socket will take without blocking.  Returns
+    // how many went out, adding their size to bytesSent, or -1 with errno set if the very next
+    // datagram couldn't be sent.
+
+    int Send(int socketFd, size_t & bytesSent)
+    {
+#ifdef __linux__
+        int sent = sendmmsg(socketFd, &_messages[_next], Remaining(), MSG_DONTWAIT);
+        if (sent < 0)
+            return -1;
+
+        for (int i = 0; i < sent; i++)
+            bytesSent += _messages[_next + i].msg_len;
+#else
+        int sent = 0;
+        while (_next + sent < _count)
+        {
+            ssize_t result = sendmsg(socketFd, &_messages[_next + sent], MSG_DONTWAIT);
+            if (result < 0)
+            {
+                if (sent == 0)
+                    return -1;
+                break;
+            }
+
+            bytesSent += result;
+            sent++;
+        }
+#endif
+        _next += sent;
+        return sent;
+    }
+};
@@ -0,0 +1,360 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// DmxIngestEffect
+//
+// Shows what show-control software sends us as E1.31 (sACN) or Art-Net, so ndscpp only has to
+// fan it out, buffer it and deliver it in time to its clients.  The canvas is filled row by row
+// from pixelsPerUniverse RGB pixels per universe, 170 by default, starting at universe.  With
+// multicast set, an sACN listener joins the groups of the universes the canvas needs instead of
+// waiting for unicast packets.
+//
+// Packets are read on the SocketReactor, up to kReceiveBatch at a time with recvmmsg() on Linux,
+// into a copy of the canvas that only the receiver touches.  After each batch it publishes that
+// copy through a triple buffer, and the render tick picks up the newest one without either side
+// ever waiting on the other.  Universes that stop coming keep their last pixels.
+
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include <asio.hpp>
+
+#include "../interfaces.h"
+#include "../ledeffectbase.h"
+#include "../pixeltypes.h"
+#include "../socketreactor.h"
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+enum class IngestProtocol : uint8_t
+{
+    Sacn,
+    ArtNet
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(IngestProtocol, {
+    { IngestProtocol::Sacn,   "sacn"   },
+    { IngestProtocol::ArtNet, "artnet" }
+})
+
+class DmxIngestEffect : public LEDEffectBase, public enable_shared_from_this<DmxIngestEffect>
+{
+public:
+    static constexpr uint16_t kSacnPort = 5568;
+    static constexpr uint16_t kArtNetPort = 6454;
+    static constexpr uint32_t kMaxPixelsPerUniverse = 170;
+    static constexpr size_t   kReceiveBatch = 64;           // Datagrams per recvmmsg()
+
+private:
+    static constexpr size_t  kMaxPacketSize = 1500;
+    static constexpr uint8_t kFresh = 0x04;                 // Set on the middle buffer's index once it's been published
+
+    IngestProtocol _protocol;
+    uint16_t       _port;
+    uint16_t       _universe;
+    uint32_t       _pixelsPerUniverse;
+    bool           _multicast;
+
+    // Receiver side, guarded by _receiveMutex.  The render thread only takes it to (re)start.
+
+    mutex                   _receiveMutex;
+    asio::ip::udp::socket   _socket;
+    uint32_t                _width = 0;
+    vector<CRGB>            _received;
+    uint8_t                 _back = 0;
+    vector<array<uint8_t, kMaxPacketSize>> _packetBuffers;
+    vector<iovec>           _iovecs;
+#ifdef __linux__
+    vector<mmsghdr>         _messages;
+#else
+    vector<msghdr>          _messages;
+#endif
+
+    // The triple buffer: the receiver owns _back, the render thread _front, and whichever one
+    // publishes or picks up swaps its own with _middle
+
+    array<vector<CRGB>, 3>  _buffers;
+    atomic<uint8_t>         _middle{1};
+    uint8_t                 _front = 2;
+
+    static uint16_t GetWord(const uint8_t * source)
+    {
+        return static_cast<uint16_t>((source[0] << 8) | source[1]);
+    }
+
+    // ParsePacket
+    //
+    // Finds the universe and channel data in an sACN or Art-Net DMX packet, or returns false for
+    // anything else, such as sync or discovery packets or alternate start codes
+
+    bool ParsePacket(span<const uint8_t> packet, uint16_t & universe, span<const uint8_t> & channels) const
+    {
+        if (_protocol == IngestProtocol::Sacn)
+        {
+            constexpr size_t kHeaderSize = 126;
+            static constexpr char kAcnIdentifier[12] = { 'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0 };
+
+            if (packet.size() < kHeaderSize || memcmp(packet.data() + 4, kAcnIdentifier, sizeof(kAcnIdentifier)) != 0)
+                return false;
+
+            // Root vector E131_DATA, framing vector DATA_PACKET, DMP set property with start code 0
+
+            if (GetWord(packet.data() + 20) != 0x0004 || GetWord(packet.data() + 42) != 0x0002 || packet[117] != 0x02 || packet[125] != 0)
+                return false;
+
+            size_t count = GetWord(packet.data() + 123);
+            if (count < 1 || kHeaderSize + count - 1 > packet.size())
+                return false;
+
+            universe = GetWord(packet.data() + 113);
+            channels = packet.subspan(kHeaderSize, count - 1);
+            return true;
+        }
+
+        constexpr size_t kHeaderSize = 18;
+        static constexpr char kArtNetId[8] = { 'A', 'r', 't', '-', 'N', 'e', 't', 0 };
+
+        if (packet.size() < kHeaderSize || memcmp(packet.data(), kArtNetId, sizeof(kArtNetId)) != 0)
+            return false;
+
+        if (packet[8] != 0x00 || packet[9] != 0x50)     // OpDmx
+            return false;
+
+        size_t count = GetWord(packet.data() + 16);
+        if (kHeaderSize + count > packet.size())
+            return false;
+
+        universe = static_cast<uint16_t>(packet[14] | ((packet[15] & 0x7F) << 8));
+        channels = packet.subspan(kHeaderSize, count);
+        return true;
+    }
+
+    // Copies a packet's pixels into _received.  Returns whether it was one of ours.
+
+    bool ApplyPacket(span<const uint8_t> packet)
+    {
+        uint16_t universe;
+        span<const uint8_t> channels;
+        if (!ParsePacket(packet, universe, channels) || universe < _universe)
+            return false;
+
+        size_t first = static_cast<size_t>(universe - _universe) * _pixelsPerUniverse;
+        if (first >= _received.size())
+            return false;
+
+        size_t count = min({ channels.size() / sizeof(CRGB), static_cast<size_t>(_pixelsPerUniverse), _received.size() - first });
+        for (size_t i = 0; i < count; i++)
+            _received[first + i] = CRGB(channels[3 * i], channels[3 * i + 1], channels[3 * i + 2]);
+        return true;
+    }
+
+    void Publish()
+    {
+        _buffers[_back] = _received;
+        _back = _middle.exchange(_back | kFresh, memory_order_acq_rel) & ~kFresh;
+    }
+
+    // Called with _receiveMutex held
+
+    void WaitForPackets()
+    {
+        _socket.async_wait(asio::socket_base::wait_read, [weakSelf = weak_from_this()](const asio::error_code& error)
+        {
+            if (error)
+                return;
+            if (auto self = weakSelf.lock())
+                self->ReceivePackets();
+        });
+    }
+
+    // ReceivePackets
+    //
+    // Reads everything the socket has for us, a batch at a time, then publishes the result once
+
+    void ReceivePackets()
+    {
+        lock_guard lock(_receiveMutex);
+        if (!_socket.is_open())
+            return;
+
+        bool updated = false;
+        int socketFd = _socket.native_handle();
+
+        for (;;)
+        {
+#ifdef __linux__
+            int received = recvmmsg(socketFd, _messages.data(), _messages.size(), MSG_DONTWAIT, nullptr);
+            if (received <= 0)
+                break;
+
+            for (int i = 0; i < received; i++)
+                updated |= ApplyPacket(span<const uint8_t>(_packetBuffers[i].data(), _messages[i].msg_len));
+
+            if (static_cast<size_t>(received) < _messages.size())
+                break;
+#else
+            ssize_t received = recvmsg(socketFd, &_messages[0], MSG_DONTWAIT);
+            if (received < 0)
+                break;
+
+            updated |= ApplyPacket(span<const uint8_t>(_packetBuffers[0].data(), received));
+#endif
+        }
+
+        if (updated)
+            Publish();
+
+        WaitForPackets();
+    }
+
+    // Called with _receiveMutex held
+
+    void Listen(size_t universeCount)
+    {
+        asio::error_code error;
+        _socket.close(error);
+
+        asio::ip::udp::endpoint endpoint(asio::ip::udp::v4(), _port);
+        _socket.open(endpoint.protocol(), error);
+        if (!error)
+            _socket.set_option(asio::socket_base::reuse_address(true), error);
+        if (!error)
+            _socket.bind(endpoint, error);
+        if (error)
+        {
+            logger->error("Can't listen on port {} for {}: {}", _port, Name(), error.message());
+            _socket.close(error);
+            return;
+        }
+
+        if (_multicast && _protocol == IngestProtocol::Sacn)
+        {
+            for (size_t i = 0; i < universeCount; i++)
+            {
+                auto universe = static_cast<uint16_t>(_universe + i);
+                asio::ip::address_v4 group({ 239, 255, static_cast<uint8_t>(universe >> 8), static_cast<uint8_t>(universe) });
+                _socket.set_option(asio::ip::multicast::join_group(group), error);
+                if (error)
+                    logger->warn("Can't join the group for universe {} for {}: {}", universe, Name(), error.message());
+            }
+        }
+
+        logger->info("{} listening for {} universes {}-{} on port {}", Name(), nlohmann::json(_protocol).get<string>(),
+                     _universe, _universe + universeCount - 1, _port);
+        WaitForPackets();
+    }
+
+public:
+    DmxIngestEffect(const string& name,
+                    IngestProtocol protocol = IngestProtocol::Sacn,
+                    uint16_t port = 0,
+                    uint16_t universe = 1,
+                    uint32_t pixelsPerUniverse = kMaxPixelsPerUniverse,
+                    bool multicast = false)
+        : LEDEffectBase(name),
+          _protocol(protocol),
+          _port(port ? port : (protocol == IngestProtocol::Sacn ? kSacnPort : kArtNetPort)),
+          _universe(universe),
+          _pixelsPerUniverse(clamp(pixelsPerUniverse, 1u, kMaxPixelsPerUniverse)),
+          _multicast(multicast),
+          _socket(SocketReactor::Instance().Context()),
+          _packetBuffers(kReceiveBatch),
+          _iovecs(kReceiveBatch),
+          _messages(kReceiveBatch)
+    {
+        for (size_t i = 0; i < kReceiveBatch; i++)
+        {
+            _iovecs[i] = { _packetBuffers[i].data(), kMaxPacketSize };
+
+            msghdr message {};
+            message.msg_iov = &_iovecs[i];
+            message.msg_iovlen = 1;
+#ifdef __linux__
+            _messages[i] = { message, 0 };
+#else
+            _messages[i] = message;
+#endif
+        }
+    }
+
+    ~DmxIngestEffect() override
+    {
+        lock_guard lock(_receiveMutex);
+        asio::error_code error;
+        _socket.close(error);
+    }
+
+    // Start
+    //
+    // Sizes the buffers to the canvas, which starts out black, and (re)opens the socket
+
+    void Start(ICanvas& canvas) override
+    {
+        auto& graphics = canvas.Graphics();
+        size_t pixels = graphics.Width() * graphics.Height();
+
+        lock_guard lock(_receiveMutex);
+
+        _width = graphics.Width();
+        _received.assign(pixels, CRGB(0, 0, 0));
+        for (auto& buffer : _buffers)
+            buffer.assign(pixels, CRGB(0, 0, 0));
+
+        _back = 0;
+        _middle.store(1, memory_order_relaxed);
+        _front = 2;
+
+        Listen((pixels + _pixelsPerUniverse - 1) / _pixelsPerUniverse);
+    }
+
+    void Update(ICanvas& canvas, milliseconds deltaTime) override
+    {
+        if (_middle.load(memory_order_relaxed) & kFresh)
+            _front = _middle.exchange(_front, memory_order_acq_rel) & ~kFresh;
+
+        const auto& pixels = _buffers[_front];
+        if (pixels.empty())
+            return;
+
+        auto& graphics = canvas.Graphics();
+        for (uint32_t y = 0; y < graphics.Height(); y++)
+            for (uint32_t x = 0; x < graphics.Width(); x++)
+                if (size_t index = y * _width + x; index < pixels.size())
+                    graphics.SetPixel(x, y, pixels[index]);
+    }
+
+    friend inline void to_json(nlohmann::json& j, const DmxIngestEffect & effect);
+    friend inline void from_json(const nlohmann::json& j, shared_ptr<DmxIngestEffect>& effect);
+};
+
+inline void to_json(nlohmann::json& j, const DmxIngestEffect & effect)
+{
+    j = {
+        {"name",              effect.Name()},
+        {"protocol",          effect._protocol},
+        {"port",              effect._port},
+        {"universe",          effect._universe},
+        {"pixelsPerUniverse", effect._pixelsPerUniverse},
+        {"multicast",         effect._multicast}
+    };
+}
+
+inline void from_json(const nlohmann::json& j, shared_ptr<DmxIngestEffect>& effect)
+{
+    effect = make_shared<DmxIngestEffect>(
+        j.at("name").get<string>(),
+        j.value("protocol", IngestProtocol::Sacn),
+        j.value("port", uint16_t(0)),
+        j.value("universe", uint16_t(1)),
+        j.value("pixelsPerUniverse", DmxIngestEffect::kMaxPixelsPerUniverse),
+        j.value("multicast", false)
+    );
+}
@@ -9,6 +9,7 @@ using namespace std::chrono;
 #include "effects/starfield.h"
 #include "effects/videoeffect.h"
 #include "effects/bouncingballeffect.h"
+#include "effects/dmxingesteffect.h"
 
 // EffectsManager
 //
@@ -17,11 +18,28 @@ using namespace std::chrono;
 // can also be used to clear all effects.
 
 #include "interfaces.h"
+#include "utilities.h"
 #include <vector>
+#include <deque>
 #include <mutex>
 
 class EffectsManager : public IEffectsManager
 {
+    static constexpr double kMinRePrimeLead = 0.5;                      // Seconds; clients with less buffered refill soon enough on their own
+    static constexpr size_t kMaxFrameHistoryBytes = 8 * 1024 * 1024;    // Per feature group
+    static constexpr auto   kProbeInterval = 100ms;                     // How often a canvas with no features online looks again
+
+    // FrameHistory
+    //
+    // The frames a feature group has been sent that are still to be shown, kept so that a client
+    // that reconnects can be re-primed with them (see SocketChannel::RePrime)
+
+    struct FrameHistory
+    {
+        deque<RenderedFrame> frames;
+        size_t               bytes = 0;
+    };
+
     uint16_t      _fps;
     int           _currentEffectIndex; // Index of the current effect
     atomic<bool>  _running;
@@ -30,6 +48,12 @@ class EffectsManager : public IEffectsManager
     vector<shared_ptr<ILEDEffect>> _effects;
     thread        _workerThread;
 
+    // Worker thread only: the canvas features as of the last frame, grouped by identical output
+
+    vector<shared_ptr<ILEDFeature>>          _groupedFeatures;
+    vector<vector<shared_ptr<ILEDFeature>>>  _featureGroups;
+    vector<FrameHistory>                     _frameHistories;   // One per group
+
 public:
     EffectsManager(uint16_t fps = 30) : _fps(fps), _currentEffectIndex(-1), _wantsToRun(true), _running(false) // No effect selected initially
     {
@@ -188,7 +212,7 @@ public:
         {
             auto frameDuration = 1000ms / _fps; // Target duration per frame
             auto nextFrameTime = steady_clock::now();
-            constexpr auto bUseCompression = true;
+            bool probing = false;
 
             // Starting the canvas should start the effect at least one time, as many effects
             // have one-time setup in their Start() method
@@ -200,21 +224,21 @@ public:
                 {
                     lock_guard lock(_effectsMutex);
 
-                    // Update the effects and enqueue frames
-                    UpdateCurrentEffect(canvas, frameDuration);
-                    for (const auto &feature : canvas.Features())
+                    // While none of the canvas's features can take frames we don't render at all,
+                    // and just look again every kProbeInterval to see if one of them is back
+
+                    bool offline = IsOffline(canvas);
+                    if (offline != probing)
                     {
-                        auto frame = feature->GetDataFrame();
-                        if (bUseCompression)
-                        {
-                            auto compressedFrame = feature->Socket()->CompressFrame(frame);
-                            feature->Socket()->EnqueueFrame(std::move(compressedFrame));
-                        }
+                        probing = offline;
+                        if (probing)
+                            logger->info("No features of canvas {} are online, pausing rendering", canvas.Name());
                         else
-                        {
-                            feature->Socket()->EnqueueFrame(std::move(frame));
-                        }
+                            logger->info("Canvas {} has features online again, resuming rendering", canvas.Name());
                     }
+
+                    if (!probing)
+                        RenderFrame(canvas, frameDuration);
                 }
                 
                 // We wait here while periodically checking _running
@@ -226,8 +250,12 @@ public:
                 }
 
                 // Set the next frame target
-                nextFrameTime += frameDuration;
-            } });
+                nextFrameTime = probing ? now + kProbeInterval : nextFrameTime + frameDuration;
+            }
+
+            _groupedFeatures.clear();
+            _featureGroups.clear();
+            _frameHistories.clear(); });
     }
 
     // Stop the worker thread
@@ -253,6 +281,143 @@ public:
     }
 
 private:
+    // IsOffline
+    //
+    // Whether the canvas has features and none of them can take frames right now
+
+    static bool IsOffline(ICanvas &canvas)
+    {
+        auto features = canvas.Features();
+        return !features.empty() && ranges::none_of(features, [](const auto &feature)
+        {
+            return feature->Sink()->AcceptsFrames();
+        });
+    }
+
+    // RenderFrame
+    //
+    // Updates the effects and enqueues frames.  A feature on its own has its frame compressed
+    // straight into its channel's queue; features that share their output get it built and
+    // compressed once and copied to each of them.  So do features whose clients buffer enough
+    // for us to keep their frames around for re-priming, and any of their channels whose client
+    // has reconnected gets those first.  Features whose clients are unreachable are left out, and
+    // a group with none online isn't built at all.
+
+    void RenderFrame(ICanvas &canvas, milliseconds frameDuration)
+    {
+        constexpr auto bUseCompression = true;
+        auto acceptsFrames = [](const shared_ptr<ILEDFeature> &feature) { return feature->Sink()->AcceptsFrames(); };
+
+        UpdateCurrentEffect(canvas, frameDuration);
+        const auto &groups = FeatureGroups(canvas.Features());
+        for (size_t i = 0; i < groups.size(); i++)
+        {
+            const auto &group = groups[i];
+            if (ranges::none_of(group, acceptsFrames))
+                continue;
+
+            auto &history = _frameHistories[i];
+            bool keepsHistory = group.front()->TimeOffset() >= kMinRePrimeLead;
+
+            if (!keepsHistory)
+                history = {};
+
+            for (const auto &feature : group)
+                if (acceptsFrames(feature) && feature->Sink()->WantsRePrime())
+                    feature->Sink()->RePrime(history.frames);
+
+            bool compress = bUseCompression && group.front()->Sink()->TakesCompressedFrames();
+            auto frame = group.front()->GetDataFrame();
+            if (group.size() == 1 && compress && !keepsHistory)
+            {
+                group.front()->Sink()->CompressAndEnqueueFrame(frame);
+                continue;
+            }
+
+            auto presentAt = Utilities::DataFramePresentationTime(frame);
+            if (compress)
+                frame = group.front()->Sink()->CompressFrame(frame);
+
+            for (const auto &feature : group)
+                if (acceptsFrames(feature))
+                    feature->Sink()->EnqueueFrame(frame, presentAt);
+
+            if (keepsHistory)
+                Remember(history, std::move(frame), presentAt, group.front()->ClientBufferCount());
+        }
+    }
+
+    // SameOutput
+    //
+    // Whether two features produce byte-for-byte the same data frame: the same rectangle of the
+    // canvas, reversed or not alike, with the same color order, the same channel and (since it
+    // follows from the client buffer count) the same time offset, and whether their sinks want it
+    // compressed.  Ten candles all showing the start of one canvas, say.
+
+    static bool SameOutput(const ILEDFeature &a, const ILEDFeature &b)
+    {
+        return a.Width() == b.Width() && a.Height() == b.Height() &&
+               a.OffsetX() == b.OffsetX() && a.OffsetY() == b.OffsetY() &&
+               a.Reversed() == b.Reversed() && a.RedGreenSwap() == b.RedGreenSwap() &&
+               a.Channel() == b.Channel() && a.ClientBufferCount() == b.ClientBufferCount() &&
+               a.Sink()->TakesCompressedFrames() == b.Sink()->TakesCompressedFrames();
+    }
+
+    // FeatureGroups
+    //
+    // The canvas features grouped by SameOutput, in the order they first appear.  Features are
+    // only ever added or removed, never changed, so the grouping is only redone when the list is
+    // different from last frame's.
+
+    const vector<vector<shared_ptr<ILEDFeature>>> & FeatureGroups(const vector<shared_ptr<ILEDFeature>> &features)
+    {
+        if (features == _groupedFeatures)
+            return _featureGroups;
+
+        _groupedFeatures = features;
+        _featureGroups.clear();
+        _frameHistories.clear();
+
+        for (const auto &feature : features)
+        {
+            auto group = find_if(_featureGroups.begin(), _featureGroups.end(), [&](const auto &group)
+            {
+                return SameOutput(*group.front(), *feature);
+            });
+
+            if (group != _featureGroups.end())
+                group->push_back(feature);
+            else
+                _featureGroups.push_back({ feature });
+        }
+
+        _frameHistories.resize(_featureGroups.size());
+        return _featureGroups;
+    }
+
+    // Remember
+    //
+    // Adds a group's latest frame to its history, and forgets the frames that have been shown by
+    // now, along with the oldest ones beyond what its clients can buffer or kMaxFrameHistoryBytes
+
+    static void Remember(FrameHistory &history, vector<uint8_t> frame, system_clock::time_point presentAt, size_t maxFrames)
+    {
+        history.bytes += frame.size();
+        history.frames.push_back({ presentAt, std::move(frame) });
+
+        auto now = system_clock::now();
+        while (history.frames.front().presentAt <= now ||
+               history.frames.size() > maxFrames ||
+               history.bytes > kMaxFrameHistoryBytes)
+        {
+            history.bytes -= history.frames.front().data.size();
+            history.frames.pop_front();
+
+            if (history.frames.empty())
+                break;
+        }
+    }
+
     bool IsEffectSelected() const
     {
         return _currentEffectIndex >= 0 && _currentEffectIndex < static_cast<int>(_effects.size());
@@ -293,7 +458,8 @@ static const map<string, pair<EffectSerializer, EffectDeserializer>> to_from_jso
         jsonPair<SolidColorFill>(),
         jsonPair<PaletteEffect>(),
         jsonPair<StarfieldEffect>(),
-        jsonPair<MP4PlaybackEffect>()
+        jsonPair<MP4PlaybackEffect>(),
+        jsonPair<DmxIngestEffect>()
 };
 
 // Dynamically serialize an effect to JSON based on its actual type
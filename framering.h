@@ -0,0 +1,481 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// FrameRing
+//
+// A single-producer/single-consumer queue of variable-sized frames stored back to back in one
+// contiguous byte buffer.  The producer (a canvas render thread) reserves space, writes a frame
+// directly into the ring and commits it; the consumer (the channel's strand) walks committed
+// frames in place and releases them once it is done with them.  Neither side takes a lock or
+// allocates per frame: the only shared state is a pair of ever-increasing byte positions plus
+// the frame and byte counters, all of them atomics.
+//
+// Each frame is preceded by a small header, which also records when the frame was queued and
+// when the client is meant to show it, and padded so that the next header is aligned.  A frame
+// never straddles the end of the buffer; if it won't fit, the producer leaves a wrap marker and
+// starts over at the front.
+//
+// The consumer can also drop frames it hasn't released yet, from anywhere in the queue.  A dropped
+// frame stops being counted right away and is skipped from then on; its space comes back once the
+// read position moves past it.
+//
+// The buffer is an anonymous mapping of the full capacity, but the producer only uses as much of
+// it as the queue needs: it wraps as soon as it is twice as far into the buffer as the queue got
+// long during its last time round, and only goes further when the front is still taken.  Nor does
+// it ever go past the wrap limit, which the owner may raise and lower as it goes.  Pages are only
+// committed once they are written to, and whenever the producer wraps, it gives the ones past the
+// point where it wrapped back to the system, as far as nothing queued is in them anymore.  So the
+// ring takes up memory in line with how long its queue actually gets, however large its capacity.
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <optional>
+#include <span>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+class FrameRing
+{
+    // Headers are as long as the alignment, so that any aligned position has room for one and a
+    // wrap marker always fits in whatever the last frame leaves at the end of the buffer
+
+    struct alignas(32) RecordHeader
+    {
+        uint32_t size;      // Payload bytes following the header
+        uint32_t flags;
+        int64_t  enqueued;  // steady_clock ticks at CommitWrite
+        int64_t  presentAt; // system_clock ticks, or zero if the producer didn't say
+    };
+
+    static constexpr uint32_t kWrapFlag = 1;
+    static constexpr uint32_t kDroppedFlag = 2;
+    static constexpr size_t kAlignment = sizeof(RecordHeader);
+    static_assert((kAlignment & (kAlignment - 1)) == 0, "kAlignment must be a power of two");
+
+    static constexpr size_t RecordSize(size_t payloadSize)
+    {
+        return (sizeof(RecordHeader) + payloadSize + kAlignment - 1) & ~(kAlignment - 1);
+    }
+
+#ifdef __linux__
+    static constexpr int kDiscardPages = MADV_DONTNEED;
+#else
+    static constexpr int kDiscardPages = MADV_FREE;
+#endif
+
+    struct Unmapper
+    {
+        size_t size;
+
+        void operator()(uint8_t * buffer) const
+        {
+            munmap(buffer, size);
+        }
+    };
+
+    static uint8_t * Map(size_t size)
+    {
+        void * buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+            throw bad_alloc();
+        return static_cast<uint8_t *>(buffer);
+    }
+
+    const size_t _capacity;
+    const size_t _pageSize;
+    unique_ptr<uint8_t, Unmapper> _buffer;          // Pages only get committed once they're written to
+    atomic<size_t> _wrapLimit;                      // See SetWrapLimit
+
+    alignas(64) atomic<uint64_t> _head{0};          // Written by the consumer only
+    alignas(64) atomic<uint64_t> _tail{0};          // Written by the producer only
+    alignas(64) atomic<size_t>   _frameCount{0};
+    atomic<size_t>               _queuedBytes{0};   // Payload bytes, not counting headers and padding
+    atomic<size_t>               _skippedBytes{0};  // Skipped at wraps between the head and the tail
+
+    // Producer-side state
+
+    size_t _reservedSize = 0;
+    size_t _reservedPadding = 0;
+    bool   _hasReservation = false;
+    size_t _wrapAt = 0;                             // Where the producer wraps this time round
+    size_t _peakUsed = 0;                           // The most UsedBytes this time round
+    size_t _touchedEnd = 0;                         // Nothing past this offset has been written since it was given back
+
+    RecordHeader ReadHeader(uint64_t position) const
+    {
+        RecordHeader header;
+        memcpy(&header, _buffer.get() + position % _capacity, sizeof(header));
+        return header;
+    }
+
+    void WriteHeader(uint64_t position, uint32_t size, uint32_t flags, int64_t enqueued = 0, int64_t presentAt = 0)
+    {
+        RecordHeader header { size, flags, enqueued, presentAt };
+        memcpy(_buffer.get() + position % _capacity, &header, sizeof(header));
+    }
+
+    // Called by the producer as it wraps at tail, once the wrap marker is written.  Whatever lies
+    // between the marker and the end of the buffer isn't queued, unless the consumer hasn't got
+    // past the last wrap yet, in which case the frames from its head onwards still are.
+
+    void GiveBackPages(uint64_t tail)
+    {
+        size_t offset = tail % _capacity;
+        uint64_t head = _head.load(memory_order_acquire);
+        size_t end = head < tail - offset ? head % _capacity : _capacity;
+
+        size_t first = max(offset + sizeof(RecordHeader), _wrapAt);
+        first = (first + _pageSize - 1) / _pageSize * _pageSize;
+        size_t last = min(end, _touchedEnd + _pageSize - 1) / _pageSize * _pageSize;
+        if (first >= last)
+            return;
+
+        madvise(_buffer.get() + first, last - first, kDiscardPages);
+        if (end >= _touchedEnd)
+            _touchedEnd = first;
+    }
+
+public:
+    // Frame
+    //
+    // A queued frame as the consumer sees it: the payload, in place in the ring, when it was queued
+    // and its presentation time, which is the epoch if it has none
+
+    struct Frame
+    {
+        span<const uint8_t>       data;
+        steady_clock::time_point  enqueued;
+        system_clock::time_point  presentAt;
+    };
+
+private:
+    Frame FrameAt(size_t offset, const RecordHeader& header) const
+    {
+        return { span<const uint8_t>(_buffer.get() + offset + sizeof(RecordHeader), header.size),
+                 steady_clock::time_point(steady_clock::duration(header.enqueued)),
+                 system_clock::time_point(system_clock::duration(header.presentAt)) };
+    }
+
+public:
+    explicit FrameRing(size_t capacity)
+        : _capacity((capacity + kAlignment - 1) & ~(kAlignment - 1)),
+          _pageSize(static_cast<size_t>(sysconf(_SC_PAGESIZE))),
+          _buffer(Map(_capacity), Unmapper { _capacity }),
+          _wrapLimit(_capacity)
+    {
+        if (_capacity < RecordSize(0))
+            throw invalid_argument("FrameRing capacity is too small");
+    }
+
+    FrameRing(const FrameRing&) = delete;
+    FrameRing& operator=(const FrameRing&) = delete;
+
+    size_t Capacity() const
+    {
+        return _capacity;
+    }
+
+    // Cheap, lock-free reads that are safe from any thread.  They are snapshots, so a reader on a
+    // third thread may briefly see a frame counted that the consumer cannot see yet.
+
+    size_t FrameCount() const
+    {
+        return _frameCount.load(memory_order_relaxed);
+    }
+
+    size_t QueuedBytes() const
+    {
+        return _queuedBytes.load(memory_order_relaxed);
+    }
+
+    // Ring space in use, including headers, alignment padding and dropped frames that haven't been
+    // reclaimed yet, but not what was skipped at a wrap
+
+    size_t UsedBytes() const
+    {
+        uint64_t head = _head.load(memory_order_relaxed);
+        size_t skipped = _skippedBytes.load(memory_order_relaxed);
+        uint64_t used = _tail.load(memory_order_relaxed) - head;
+        return used > skipped ? used - skipped : 0;
+    }
+
+    // How much of the buffer is in memory right now.  Costs a system call and a byte per page, so
+    // it's meant for reporting.
+
+    size_t ResidentBytes() const
+    {
+#ifdef __APPLE__
+        vector<char> resident((_capacity + _pageSize - 1) / _pageSize);
+#else
+        vector<unsigned char> resident((_capacity + _pageSize - 1) / _pageSize);
+#endif
+        if (mincore(_buffer.get(), _capacity, resident.data()) != 0)
+            return 0;
+        return ranges::count_if(resident, [](auto page) { return page & 1; }) * _pageSize;
+    }
+
+    // SetWrapLimit
+    //
+    // Keeps the producer from going more than limit bytes into the buffer, so the queue holds no
+    // more than that.  A frame that is larger still gets room for itself.  The pages past a
+    // lowered limit are given back as the producer wraps.
+
+    void SetWrapLimit(size_t limit)
+    {
+        limit = (limit + kAlignment - 1) & ~(kAlignment - 1);
+        _wrapLimit.store(clamp(limit, RecordSize(0), _capacity), memory_order_relaxed);
+    }
+
+    // Producer: WritePosition
+    //
+    // Where the next frame will go.  Everything committed so far lies before it.
+
+    uint64_t WritePosition() const
+    {
+        return _tail.load(memory_order_relaxed);
+    }
+
+    // Producer: BeginWrite
+    //
+    // Reserves contiguous room for a frame of up to size bytes and returns where to write it, or
+    // nullptr if the ring doesn't have that much free space right now
+
+    uint8_t * BeginWrite(size_t size)
+    {
+        assert(!_hasReservation);
+
+        uint64_t tail = _tail.load(memory_order_relaxed);
+        uint64_t head = _head.load(memory_order_acquire);
+        size_t offset = tail % _capacity;
+        size_t recordSize = RecordSize(size);
+        size_t limit = min(max(_wrapLimit.load(memory_order_relaxed), recordSize), _capacity);
+        size_t padding = (offset + recordSize > min(max(_wrapAt, recordSize), limit)) ? _capacity - offset : 0;
+
+        if (size > numeric_limits<uint32_t>::max() || recordSize > _capacity)
+            return nullptr;
+
+        // If the front is still taken, the queue needs more room, so we go further this time
+        // round, up to the limit.  A frame too large to ever fit in front of where we are goes
+        // further in any case, rather than holding up the queue for good.
+
+        if (padding && offset + recordSize <= _capacity && (tail - head) + padding + recordSize > _capacity &&
+            (offset + recordSize <= limit || recordSize > offset))
+            padding = 0;
+
+        if ((tail - head) + padding + recordSize > _capacity)
+            return nullptr;
+
+        _reservedSize = size;
+        _reservedPadding = padding;
+        _hasReservation = true;
+
+        return _buffer.get() + (padding ? 0 : offset) + sizeof(RecordHeader);
+    }
+
+    // Producer: CommitWrite
+    //
+    // Publishes the reserved frame to the consumer, stamped with the current time and the time the
+    // client should show it, if there is one.  The frame may turn out smaller than what was
+    // reserved (compressed output, for example), but never larger.
+
+    void CommitWrite(size_t size, system_clock::time_point presentAt = {})
+    {
+        assert(_hasReservation && size <= _reservedSize);
+
+        uint64_t tail = _tail.load(memory_order_relaxed);
+        if (_reservedPadding)
+        {
+            // Next time round we go twice as far as the queue got long this time
+
+            _wrapAt = min(2 * _peakUsed, _wrapLimit.load(memory_order_relaxed));
+            _peakUsed = 0;
+
+            WriteHeader(tail, 0, kWrapFlag);
+            GiveBackPages(tail);
+            _skippedBytes.fetch_add(_reservedPadding, memory_order_relaxed);
+            tail += _reservedPadding;
+        }
+
+        WriteHeader(tail, static_cast<uint32_t>(size), 0,
+                    steady_clock::now().time_since_epoch().count(),
+                    presentAt.time_since_epoch().count());
+        tail += RecordSize(size);
+
+        size_t end = (tail - 1) % _capacity + 1;
+        _wrapAt = max(_wrapAt, end);
+        _touchedEnd = max(_touchedEnd, end);
+
+        // Count the frame before publishing it so the counters never dip below zero when the
+        // consumer releases it
+
+        _frameCount.fetch_add(1, memory_order_relaxed);
+        _queuedBytes.fetch_add(size, memory_order_relaxed);
+        _tail.store(tail, memory_order_release);
+        _peakUsed = max(_peakUsed, UsedBytes());
+
+        _hasReservation = false;
+    }
+
+    void CancelWrite()
+    {
+        _hasReservation = false;
+    }
+
+    // Producer: Push
+    //
+    // Convenience for frames that already exist somewhere else: reserves, copies and commits
+
+    bool Push(span<const uint8_t> frame, system_clock::time_point presentAt = {})
+    {
+        uint8_t * destination = BeginWrite(frame.size());
+        if (!destination)
+            return false;
+
+        memcpy(destination, frame.data(), frame.size());
+        CommitWrite(frame.size(), presentAt);
+        return true;
+    }
+
+    // Consumer: ReadPosition
+    //
+    // Where the consumer's walk through committed frames starts.  Nothing before this position
+    // is considered queued anymore.
+
+    uint64_t ReadPosition() const
+    {
+        return _head.load(memory_order_relaxed);
+    }
+
+    // Consumer: Next
+    //
+    // Returns the frame at position and moves position past it, or nullopt if the producer
+    // hasn't committed anything there yet.  The frame's data stays valid until the frame is
+    // released.
+
+    optional<Frame> Next(uint64_t & position) const
+    {
+        uint64_t tail = _tail.load(memory_order_acquire);
+
+        while (position != tail)
+        {
+            RecordHeader header = ReadHeader(position);
+            size_t offset = position % _capacity;
+
+            if (header.flags & kWrapFlag)
+            {
+                position += _capacity - offset;
+                continue;
+            }
+
+            position += RecordSize(header.size);
+            if (header.flags & kDroppedFlag)
+                continue;
+
+            return FrameAt(offset, header);
+        }
+
+        return nullopt;
+    }
+
+    // Consumer: ReleaseTo
+    //
+    // Hands everything before position back to the producer, along with any dropped frames that
+    // directly follow it.  Returns how many frames were released, not counting dropped ones.
+
+    size_t ReleaseTo(uint64_t position)
+    {
+        uint64_t head = _head.load(memory_order_relaxed);
+        uint64_t tail = _tail.load(memory_order_acquire);
+        size_t frames = 0;
+        size_t bytes = 0;
+        size_t skipped = 0;
+
+        while (head != tail)
+        {
+            RecordHeader header = ReadHeader(head);
+            if (header.flags & kWrapFlag)
+            {
+                skipped += _capacity - head % _capacity;
+                head += _capacity - head % _capacity;
+                continue;
+            }
+
+            bool dropped = header.flags & kDroppedFlag;
+            if (head >= position && !dropped)
+                break;
+
+            // Dropped frames were uncounted when they were dropped
+
+            if (!dropped)
+            {
+                frames++;
+                bytes += header.size;
+            }
+            head += RecordSize(header.size);
+        }
+
+        _frameCount.fetch_sub(frames, memory_order_relaxed);
+        _queuedBytes.fetch_sub(bytes, memory_order_relaxed);
+        _head.store(head, memory_order_release);
+        _skippedBytes.fetch_sub(skipped, memory_order_relaxed);
+        return frames;
+    }
+
+    // Consumer: DropIf
+    //
+    // Walks the queued frames from position onwards, oldest first, and drops each frame for which
+    // shouldDrop(index, frame) returns true.  Frames before position, such as those being sent
+    // right now, are left alone.  Returns how many frames were dropped.
+
+    template <typename Predicate>
+    size_t DropIf(uint64_t position, Predicate shouldDrop)
+    {
+        uint64_t tail = _tail.load(memory_order_acquire);
+        size_t index = 0;
+        size_t dropped = 0;
+
+        while (position != tail)
+        {
+            RecordHeader header = ReadHeader(position);
+            size_t offset = position % _capacity;
+
+            if (header.flags & kWrapFlag)
+            {
+                position += _capacity - offset;
+                continue;
+            }
+
+            if (!(header.flags & kDroppedFlag) &&
+                shouldDrop(index++, FrameAt(offset, header)))
+            {
+                WriteHeader(position, header.size, header.flags | kDroppedFlag, header.enqueued, header.presentAt);
+                _frameCount.fetch_sub(1, memory_order_relaxed);
+                _queuedBytes.fetch_sub(header.size, memory_order_relaxed);
+                dropped++;
+            }
+
+            position += RecordSize(header.size);
+        }
+
+        return dropped;
+    }
+
+    // Consumer: Clear
+    //
+    // Releases every frame that has been committed so far
+
+    void Clear()
+    {
+        ReleaseTo(_tail.load(memory_order_acquire));
+    }
+};
@@ -0,0 +1,488 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// Frame sinks
+//
+// The outputs a feature can have other than a SocketChannel, for running a config with no devices
+// attached.  Which one a feature uses is set by the optional "sink" object in its config:
+//
+//   socket - A SocketChannel to the feature's NightDriverStrip client, which is the default
+//   null   - Only counts frames, so a benchmark measures rendering and compression and nothing else
+//   file   - Appends every frame to the file at path, to capture the output for later
+//   shm    - Keeps the newest frames in a ring in the POSIX shared memory object named path, for
+//            another process on the same machine to pick up
+//   sacn, artnet, ddp
+//          - Sends the pixels to an off-the-shelf controller at host in one of the standard
+//            lighting protocols (see lightingsink.h)
+//
+// A local sink takes each frame on the render thread as it's built, since there's nothing to wait
+// for, and never refuses one for being late or asks to be re-primed.  Frames are the same as a
+// client would get, compressed or not, with their presentation time.
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "json.hpp"
+#include "global.h"
+#include "interfaces.h"
+#include "metrics.h"
+#include "utilities.h"
+
+enum class FrameSinkType : uint8_t
+{
+    Socket,
+    Null,
+    File,
+    SharedMemory,
+    Sacn,
+    ArtNet,
+    Ddp
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(FrameSinkType, {
+    { FrameSinkType::Socket,       "socket" },
+    { FrameSinkType::Null,         "null"   },
+    { FrameSinkType::File,         "file"   },
+    { FrameSinkType::SharedMemory, "shm"    },
+    { FrameSinkType::Sacn,         "sacn"   },
+    { FrameSinkType::ArtNet,       "artnet" },
+    { FrameSinkType::Ddp,          "ddp"    }
+})
+
+// FrameSinkConfig
+//
+// A feature's "sink" object
+
+struct FrameSinkConfig
+{
+    static constexpr uint32_t kDefaultSlots = 16;
+    static constexpr uint32_t kMaxPixelsPerUniverse = 170;     // 510 of a DMX universe's 512 channels
+
+    FrameSinkType type = FrameSinkType::Socket;
+    string        path;                         // File to write to, or shared memory object name
+    uint32_t      slots = kDefaultSlots;        // Frames the shared memory ring holds
+    string        host;                         // Controller for the lighting protocols; none means sACN multicast
+    uint16_t      port = 0;                     // 0 means the protocol's own port
+    uint16_t      universe = 1;                 // First universe the feature's pixels go to
+    uint32_t      pixelsPerUniverse = kMaxPixelsPerUniverse;
+    double        maxFps = 0;                   // 0 means as fast as frames come
+
+    bool IsLightingProtocol() const
+    {
+        return type == FrameSinkType::Sacn || type == FrameSinkType::ArtNet || type == FrameSinkType::Ddp;
+    }
+
+    // What the sink writes to, in the place of a host name
+    string Describe() const
+    {
+        nlohmann::json name = type;
+        const auto& target = IsLightingProtocol() ? host : path;
+        return target.empty() ? name.get<string>() : name.get<string>() + ":" + target;
+    }
+};
+
+inline void to_json(nlohmann::json& j, const FrameSinkConfig& sink)
+{
+    j = {
+        {"type",              sink.type},
+        {"path",              sink.path},
+        {"slots",             sink.slots},
+        {"host",              sink.host},
+        {"port",              sink.port},
+        {"universe",          sink.universe},
+        {"pixelsPerUniverse", sink.pixelsPerUniverse},
+        {"maxFps",            sink.maxFps}
+    };
+}
+
+inline void from_json(const nlohmann::json& j, FrameSinkConfig& sink)
+{
+    FrameSinkConfig defaults;
+    sink.type              = j.value("type", defaults.type);
+    sink.path              = j.value("path", defaults.path);
+    sink.slots             = j.value("slots", defaults.slots);
+    sink.host              = j.value("host", defaults.host);
+    sink.port              = j.value("port", defaults.port);
+    sink.universe          = j.value("universe", defaults.universe);
+    sink.pixelsPerUniverse = j.value("pixelsPerUniverse", defaults.pixelsPerUniverse);
+    sink.maxFps            = j.value("maxFps", defaults.maxFps);
+
+    if (sink.type == FrameSinkType::File && sink.path.empty())
+        throw invalid_argument("A file sink needs a path");
+
+    if (sink.type == FrameSinkType::SharedMemory)
+    {
+        if (sink.path.size() < 2 || sink.path[0] != '/' || sink.path.find('/', 1) != string::npos)
+            throw invalid_argument("A shared memory sink needs a path of the form /name");
+        if (sink.slots < 2)
+            throw invalid_argument("A shared memory sink needs at least 2 slots");
+    }
+
+    if (sink.IsLightingProtocol())
+    {
+        if (sink.host.empty() && sink.type != FrameSinkType::Sacn)
+            throw invalid_argument("Only sACN can do without a host, by multicasting");
+        if (sink.pixelsPerUniverse == 0 || sink.pixelsPerUniverse > FrameSinkConfig::kMaxPixelsPerUniverse)
+            throw invalid_argument("pixelsPerUniverse must be between 1 and " + to_string(FrameSinkConfig::kMaxPixelsPerUniverse));
+        if (sink.type == FrameSinkType::Sacn && (sink.universe == 0 || sink.universe > 63999))
+            throw invalid_argument("sACN universes run from 1 to 63999");
+        if (sink.type == FrameSinkType::ArtNet && sink.universe > 0x7FFF)
+            throw invalid_argument("Art-Net universes run from 0 to 32767");
+        if (sink.maxFps < 0)
+            throw invalid_argument("maxFps can't be negative");
+    }
+}
+
+// LocalFrameSink
+//
+// What the local sinks have in common: ids, compression and metrics.  A subclass only has to
+// Write each frame, and may Open and Close whatever it writes to as the sink starts and stops.
+// Write is called with the sink's lock held, so starting and stopping can't pull the file or
+// mapping out from under the render thread.
+
+class LocalFrameSink : public IFrameSink
+{
+    static atomic<uint32_t> _nextId;
+    uint32_t       _id;
+    string         _friendlyName;
+    mutex          _mutex;
+    bool           _running = false;            // Guarded by _mutex
+    ChannelMetrics _metrics;
+
+protected:
+    virtual bool Open()  { return true; }
+    virtual void Close() {}
+    virtual bool Write(span<const uint8_t> frameData, system_clock::time_point presentAt) = 0;
+
+    // A sink that only queues frames in Write, to send them later, counts them as it sends them
+    // or drops them instead
+
+    virtual bool SendsLater() const { return false; }
+
+    void CountSent(size_t bytes)
+    {
+        _metrics.bytes.Add(bytes);
+        _metrics.frames.Add();
+    }
+
+    void CountDrops(size_t frames)
+    {
+        _metrics.drops.Add(frames);
+    }
+
+public:
+    explicit LocalFrameSink(const string& friendlyName) : _id(_nextId++), _friendlyName(friendlyName)
+    {
+    }
+
+    uint32_t Id() const override
+    {
+        return _id;
+    }
+
+    const string& FriendlyName() const override
+    {
+        return _friendlyName;
+    }
+
+    bool EnqueueFrame(span<const uint8_t> frameData, system_clock::time_point presentAt) override
+    {
+        lock_guard lock(_mutex);
+
+        if (!_running || !Write(frameData, presentAt))
+        {
+            _metrics.drops.Add();
+            return false;
+        }
+
+        _metrics.uncompressedBytes.Add(Utilities::UncompressedSize(frameData));
+        _metrics.queuedBytes.Add(frameData.size());
+        if (!SendsLater())
+            CountSent(frameData.size());
+        return true;
+    }
+
+    bool CompressAndEnqueueFrame(const vector<uint8_t>& frameData) override
+    {
+        return EnqueueFrame(CompressFrame(frameData), Utilities::DataFramePresentationTime(frameData));
+    }
+
+    vector<uint8_t> CompressFrame(const vector<uint8_t>& data) override
+    {
+        return Utilities::CompressFrame(data);
+    }
+
+    bool TakesCompressedFrames() const override
+    {
+        return true;
+    }
+
+    bool WantsRePrime() const override
+    {
+        return false;
+    }
+
+    size_t RePrime(const deque<RenderedFrame>&) override
+    {
+        return 0;
+    }
+
+    bool AcceptsFrames() const override
+    {
+        return true;
+    }
+
+    MetricsSnapshot GetMetrics() const override
+    {
+        return _metrics.Snapshot();
+    }
+
+    void Start() override
+    {
+        lock_guard lock(_mutex);
+        if (!_running)
+            _running = Open();
+    }
+
+    void Stop() override
+    {
+        lock_guard lock(_mutex);
+        if (_running)
+            Close();
+        _running = false;
+    }
+};
+
+// NullSink
+//
+// Takes every frame and does nothing with it
+
+class NullSink : public LocalFrameSink
+{
+protected:
+    bool Write(span<const uint8_t>, system_clock::time_point) override
+    {
+        return true;
+    }
+
+public:
+    using LocalFrameSink::LocalFrameSink;
+};
+
+// FileSink
+//
+// Appends each frame to a file as a record of its presentation time in microseconds since the
+// epoch (8 bytes), its size (4 bytes) and the frame itself, all little-endian like the frames.
+// Restarting the sink carries on at the end of the file.
+
+class FileSink : public LocalFrameSink
+{
+    string   _path;
+    ofstream _file;
+
+protected:
+    bool Open() override
+    {
+        _file.open(_path, ios::binary | ios::app);
+        if (!_file)
+            logger->error("Can't open {} for [{}]", _path, FriendlyName());
+        return _file.is_open();
+    }
+
+    void Close() override
+    {
+        _file.close();
+    }
+
+    bool Write(span<const uint8_t> frameData, system_clock::time_point presentAt) override
+    {
+        auto micros = duration_cast<microseconds>(presentAt.time_since_epoch()).count();
+        auto header = Utilities::CombineByteArrays(Utilities::ULONGToBytes(static_cast<uint64_t>(micros)),
+                                                   Utilities::DWORDToBytes(static_cast<uint32_t>(frameData.size())));
+
+        _file.write(reinterpret_cast<const char *>(header.data()), header.size());
+        _file.write(reinterpret_cast<const char *>(frameData.data()), frameData.size());
+        return _file.good();
+    }
+
+public:
+    FileSink(const string& friendlyName, const string& path) : LocalFrameSink(friendlyName), _path(path)
+    {
+    }
+
+    ~FileSink() override
+    {
+        Stop();
+    }
+};
+
+// SharedMemorySink
+//
+// Publishes frames through a POSIX shared memory object, laid out as a Header followed by a ring
+// of slots, each a Slot and room for the biggest frame the feature can produce.  Frame n goes in
+// slot n % slotCount, and Header::written counts the frames so far, so a reader wants slot
+// (written - 1) % slotCount for the newest one.  Each slot is a seqlock: its sequence is odd
+// while the frame is being written, so a reader copies the frame out and then checks that the
+// sequence is still the even value it saw before.  The object stays behind when the sink stops,
+// so a reader can keep the last frames, and is reset when it starts again.
+
+class SharedMemorySink : public LocalFrameSink
+{
+public:
+    static constexpr uint32_t kMagic = 0x4D534E44;     // "NDSM"
+    static constexpr uint32_t kVersion = 1;
+
+    struct Header
+    {
+        uint32_t         magic;
+        uint32_t         version;
+        uint32_t         slotCount;
+        uint32_t         slotBytes;             // Room for the frame in each slot, after the Slot
+        atomic<uint64_t> written;
+    };
+
+    struct Slot
+    {
+        atomic<uint64_t> sequence;
+        int64_t          presentAtMicros;       // Since the epoch
+        uint32_t         size;
+        uint32_t         reserved;
+    };
+
+    static_assert(atomic<uint64_t>::is_always_lock_free, "Shared memory needs lock-free 64-bit atomics");
+
+private:
+    string   _path;
+    uint32_t _slotCount;
+    uint32_t _slotBytes;
+    size_t   _mappedBytes = 0;
+    uint8_t * _mapping = nullptr;
+
+    size_t SlotStride() const
+    {
+        return (sizeof(Slot) + _slotBytes + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+    }
+
+    Header& GetHeader()
+    {
+        return *reinterpret_cast<Header *>(_mapping);
+    }
+
+    Slot& GetSlot(uint64_t index)
+    {
+        return *reinterpret_cast<Slot *>(_mapping + sizeof(Header) + (index % _slotCount) * SlotStride());
+    }
+
+protected:
+    bool Open() override
+    {
+        int fd = shm_open(_path.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0)
+        {
+            logger->error("Can't open shared memory {} for [{}]: {}", _path, FriendlyName(), strerror(errno));
+            return false;
+        }
+
+        _mappedBytes = sizeof(Header) + _slotCount * SlotStride();
+        void * mapping = MAP_FAILED;
+        if (ftruncate(fd, static_cast<off_t>(_mappedBytes)) == 0)
+            mapping = mmap(nullptr, _mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (mapping == MAP_FAILED)
+        {
+            logger->error("Can't map shared memory {} for [{}]: {}", _path, FriendlyName(), strerror(errno));
+            return false;
+        }
+
+        _mapping = static_cast<uint8_t *>(mapping);
+        memset(_mapping, 0, _mappedBytes);
+
+        auto& header = GetHeader();
+        header.version = kVersion;
+        header.slotCount = _slotCount;
+        header.slotBytes = _slotBytes;
+        header.written.store(0, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        header.magic = kMagic;
+        return true;
+    }
+
+    void Close() override
+    {
+        munmap(_mapping, _mappedBytes);
+        _mapping = nullptr;
+    }
+
+    bool Write(span<const uint8_t> frameData, system_clock::time_point presentAt) override
+    {
+        if (frameData.size() > _slotBytes)
+            return false;
+
+        auto& header = GetHeader();
+        uint64_t index = header.written.load(memory_order_relaxed);
+        auto& slot = GetSlot(index);
+
+        uint64_t sequence = slot.sequence.load(memory_order_relaxed);
+        slot.sequence.store(sequence + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        slot.presentAtMicros = duration_cast<microseconds>(presentAt.time_since_epoch()).count();
+        slot.size = static_cast<uint32_t>(frameData.size());
+        memcpy(reinterpret_cast<uint8_t *>(&slot) + sizeof(Slot), frameData.data(), frameData.size());
+
+        slot.sequence.store(sequence + 2, memory_order_release);
+        header.written.store(index + 1, memory_order_release);
+        return true;
+    }
+
+public:
+    // maxFrameBytes is the biggest frame the feature can produce, compressed or not
+
+    SharedMemorySink(const string& friendlyName, const string& path, uint32_t slotCount, size_t maxFrameBytes)
+        : LocalFrameSink(friendlyName),
+          _path(path),
+          _slotCount(slotCount),
+          _slotBytes(static_cast<uint32_t>(maxFrameBytes))
+    {
+    }
+
+    ~SharedMemorySink() override
+    {
+        Stop();
+    }
+};
+
+// MakeLocalFrameSink
+//
+// Creates the local sink a config asks for.  maxFrameBytes is the biggest frame the feature can
+// produce, compressed or not.
+
+inline shared_ptr<IFrameSink> MakeLocalFrameSink(const FrameSinkConfig& config, const string& friendlyName, size_t maxFrameBytes)
+{
+    switch (config.type)
+    {
+        case FrameSinkType::Null:
+            return make_shared<NullSink>(friendlyName);
+        case FrameSinkType::File:
+            return make_shared<FileSink>(friendlyName, config.path);
+        case FrameSinkType::SharedMemory:
+            return make_shared<SharedMemorySink>(friendlyName, config.path, config.slots, maxFrameBytes);
+        default:
+            throw invalid_argument("Not a local sink: " + config.Describe());
+    }
+}
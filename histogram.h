@@ -0,0 +1,187 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// LatencyHistogram
+//
+// An HDR-style histogram of durations in microseconds: log-linear buckets, eight to every power
+// of two above 16us, so every value is recorded to within 12.5% whether it's 20us or 20s, in a
+// fixed 2KB of counters.  One thread records (the channel's strand); any thread may take a
+// snapshot without locking.
+//
+// Problems on a link show up as jitter long before they show up in averages, so what matters is
+// the tail, and what matters is recent.  The histogram therefore covers the last kInterval to
+// 2 * kInterval only: it keeps two sets of buckets, records into the newer one and clears the
+// older one each time an interval is up.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include "json.hpp"
+
+// HistogramSnapshot
+//
+// A copy of a LatencyHistogram's counts that can be queried at leisure
+
+class HistogramSnapshot
+{
+public:
+    static constexpr size_t kLinearBuckets    = 16;     // Values below this get a bucket each
+    static constexpr size_t kSubBuckets       = 8;      // Buckets per power of two above that
+    static constexpr size_t kMaxShift         = 28;     // Values are clamped to 2^32us, a bit over an hour
+    static constexpr size_t kBucketCount      = kLinearBuckets + kMaxShift * kSubBuckets;
+
+    static size_t BucketFor(uint64_t value)
+    {
+        value = min<uint64_t>(value, (uint64_t(1) << 32) - 1);
+        if (value < kLinearBuckets)
+            return value;
+
+        size_t shift = bit_width(value) - 4;                    // Leaves value >> shift in [8, 16)
+        return kLinearBuckets + (shift - 1) * kSubBuckets + ((value >> shift) - kSubBuckets);
+    }
+
+    // The largest value that lands in a bucket, which is what we report for it
+
+    static uint64_t BucketUpperBound(size_t bucket)
+    {
+        if (bucket < kLinearBuckets)
+            return bucket;
+
+        size_t shift = (bucket - kLinearBuckets) / kSubBuckets + 1;
+        uint64_t subBucket = (bucket - kLinearBuckets) % kSubBuckets + kSubBuckets;
+        return ((subBucket + 1) << shift) - 1;
+    }
+
+    array<uint64_t, kBucketCount> counts {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    double Mean() const
+    {
+        return count ? static_cast<double>(sum) / count : 0.0;
+    }
+
+    uint64_t Percentile(double percentile) const
+    {
+        if (count == 0)
+            return 0;
+
+        uint64_t threshold = std::max(uint64_t(1), static_cast<uint64_t>(count * percentile / 100.0 + 0.5));
+        uint64_t seen = 0;
+
+        for (size_t bucket = 0; bucket < kBucketCount; bucket++)
+        {
+            seen += counts[bucket];
+            if (seen >= threshold)
+                return min(BucketUpperBound(bucket), this->max);
+        }
+
+        return this->max;
+    }
+
+    // The summary that goes into every socket's JSON
+
+    friend void to_json(nlohmann::json& j, const HistogramSnapshot& snapshot)
+    {
+        j = {
+            {"count", snapshot.count},
+            {"mean",  snapshot.Mean()},
+            {"p50",   snapshot.Percentile(50)},
+            {"p90",   snapshot.Percentile(90)},
+            {"p99",   snapshot.Percentile(99)},
+            {"p999",  snapshot.Percentile(99.9)},
+            {"max",   snapshot.max}
+        };
+    }
+
+    // The non-empty buckets as [upper bound, count] pairs, for when someone wants the whole shape
+
+    nlohmann::json Buckets() const
+    {
+        auto buckets = nlohmann::json::array();
+        for (size_t bucket = 0; bucket < kBucketCount; bucket++)
+            if (counts[bucket])
+                buckets.push_back({ BucketUpperBound(bucket), counts[bucket] });
+        return buckets;
+    }
+};
+
+class LatencyHistogram
+{
+    static constexpr auto kInterval = 10s;
+
+    struct Interval
+    {
+        array<atomic<uint64_t>, HistogramSnapshot::kBucketCount> counts {};
+        atomic<uint64_t> count {0};
+        atomic<uint64_t> sum {0};
+        atomic<uint64_t> max {0};
+
+        void Clear()
+        {
+            for (auto& bucket : counts)
+                bucket.store(0, memory_order_relaxed);
+            count.store(0, memory_order_relaxed);
+            sum.store(0, memory_order_relaxed);
+            max.store(0, memory_order_relaxed);
+        }
+    };
+
+    array<Interval, 2> _intervals;
+    atomic<size_t> _current {0};
+    steady_clock::time_point _intervalStart = steady_clock::now();
+
+public:
+    // Record
+    //
+    // Writer only.  Plain loads and stores rather than read-modify-writes, since nobody else writes.
+
+    void Record(microseconds duration)
+    {
+        auto now = steady_clock::now();
+        if (now - _intervalStart >= kInterval)
+        {
+            size_t older = 1 - _current.load(memory_order_relaxed);
+            _intervals[older].Clear();
+            _current.store(older, memory_order_release);
+            _intervalStart = now;
+        }
+
+        uint64_t value = max<int64_t>(0, duration.count());
+        auto& interval = _intervals[_current.load(memory_order_relaxed)];
+        auto& bucket = interval.counts[HistogramSnapshot::BucketFor(value)];
+
+        bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        interval.count.store(interval.count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        interval.sum.store(interval.sum.load(memory_order_relaxed) + value, memory_order_relaxed);
+        if (value > interval.max.load(memory_order_relaxed))
+            interval.max.store(value, memory_order_relaxed);
+    }
+
+    // Snapshot
+    //
+    // Any thread.  Racing the writer may leave a value or two out, which is fine for statistics.
+
+    HistogramSnapshot Snapshot() const
+    {
+        HistogramSnapshot snapshot;
+
+        for (const auto& interval : _intervals)
+        {
+            for (size_t bucket = 0; bucket < HistogramSnapshot::kBucketCount; bucket++)
+                snapshot.counts[bucket] += interval.counts[bucket].load(memory_order_relaxed);
+
+            snapshot.count += interval.count.load(memory_order_relaxed);
+            snapshot.sum += interval.sum.load(memory_order_relaxed);
+            snapshot.max = max(snapshot.max, interval.max.load(memory_order_relaxed));
+        }
+
+        return snapshot;
+    }
+};
@@ -10,6 +10,8 @@
 
 #include "pixeltypes.h"
 #include <vector>
+#include <deque>
+#include <span>
 #include <map>
 #include <chrono>
 #include <string>
@@ -51,6 +53,18 @@ public:
 
 
 struct ClientResponse;
+struct BatchLimits;
+struct OverflowPolicy;
+struct DroppedFrames;
+struct SendStats;
+struct ConnectStats;
+struct ChannelLatency;
+struct MetricsSnapshot;
+struct TransportProfile;
+struct UplinkLimits;
+struct QueueBudgetUsage;
+enum class ChannelProtocol : uint8_t;
+struct FrameSinkConfig;
 class ICanvas;
 
 // ILEDEffect
@@ -106,38 +120,88 @@ public:
     virtual void SetCurrentEffectIndex(int index) = 0;    
 };
 
+// RenderedFrame
+//
+// A data frame as the canvas pipeline built it, compressed or not, and when it is to be shown
+
+struct RenderedFrame
+{
+    system_clock::time_point presentAt;
+    vector<uint8_t>          data;
+};
+
+// IFrameSink
+//
+// Where a feature's frames go.  The render thread hands each frame it builds to the feature's
+// sink, which is usually a SocketChannel to a NightDriverStrip client, but can also be one of the
+// local sinks in framesink.h, which count, record or share frames without any device attached.
+
+class IFrameSink
+{
+public:
+    virtual ~IFrameSink() = default;
+
+    virtual uint32_t Id() const = 0;
+    virtual const string& FriendlyName() const = 0;
+
+    // Data transfer methods.  Frames carry the time the client should show them, which
+    // EnqueueFrame can't see in a compressed frame, so it takes it separately.
+    virtual bool EnqueueFrame(span<const uint8_t> frameData, system_clock::time_point presentAt) = 0;
+    virtual bool CompressAndEnqueueFrame(const vector<uint8_t>& frameData) = 0;
+    virtual vector<uint8_t> CompressFrame(const vector<uint8_t>& data) = 0;
+    virtual bool TakesCompressedFrames() const = 0;    // False for sinks that need the plain data frame
+
+    // Refilling the buffer of a client that has reconnected, from frames the pipeline built
+    // earlier and kept (see SocketChannel::RePrime)
+    virtual bool WantsRePrime() const = 0;
+    virtual size_t RePrime(const deque<RenderedFrame>& frames) = 0;
+
+    virtual bool AcceptsFrames() const = 0;     // False while the client is unreachable, to save building frames for it
+    virtual MetricsSnapshot GetMetrics() const = 0;
+
+    // Start and stop operations
+    virtual void Start() = 0;
+    virtual void Stop() = 0;
+};
+
 // ISocketChannel
 //
 // Defines a communication protocol for managing socket connections and sending data to a server.  
 // Provides methods for enqueuing frames, retrieving connection status, and tracking performance metrics.
 
-class ISocketChannel
+class ISocketChannel : public IFrameSink
 {
 public:
-    virtual ~ISocketChannel() = default;
-
     // Accessors for channel details
     virtual const string& HostName() const = 0;
-    virtual const string& FriendlyName() const = 0;
     virtual uint16_t Port() const = 0;
-
-    virtual uint32_t Id() const = 0;
-
-    // Data transfer methods
-    virtual bool EnqueueFrame(vector<uint8_t>&& frameData) = 0;
-    virtual vector<uint8_t> CompressFrame(const vector<uint8_t>& data) = 0;
+    virtual ChannelProtocol Protocol() const = 0;
 
     // Connection status
     virtual bool IsConnected() const = 0;
     virtual uint64_t GetLastBytesPerSecond() const = 0;
+    virtual double GetWakeupsPerSecond() const = 0;
+    virtual BatchLimits GetBatchLimits() const = 0;
+    virtual OverflowPolicy GetOverflowPolicy() const = 0;
+    virtual DroppedFrames GetDroppedFrames() const = 0;
+    virtual milliseconds GetStaleFrameGrace() const = 0;
+    virtual SendStats GetSendStats() const = 0;
     virtual ClientResponse LastClientResponse() const = 0;
+    virtual vector<ClientResponse> RecentClientResponses() const = 0;
+    virtual uint64_t GetResponseCount() const = 0;
+    virtual uint64_t GetInvalidResponseBytes() const = 0;
     virtual uint32_t GetReconnectCount() const = 0;
+    virtual ConnectStats GetConnectStats() const = 0;
+    virtual size_t GetConnectionChannelCount() const = 0;     // Channels sharing this one's connection, including it
+    virtual ChannelLatency GetLatency() const = 0;
     virtual size_t GetCurrentQueueDepth() const = 0;
+    virtual size_t GetQueuedBytes() const = 0;
     virtual size_t GetQueueMaxSize() const = 0;
-
-    // Start and stop operations
-    virtual void Start() = 0;
-    virtual void Stop() = 0;
+    virtual size_t GetQueueBudget() const = 0;      // This channel's share of the QueueBudget, in bytes
+    virtual size_t GetQueueResidentBytes() const = 0;   // Memory the queue's ring takes up right now
+    virtual TransportProfile GetTransport() const = 0;
+    virtual TransportProfile GetEffectiveTransport() const = 0;     // What the connection uses, merged with the other channels' on it
+    virtual void SetTransport(const TransportProfile& transport) = 0;   // Takes effect right away
 };
 
 
@@ -166,6 +230,11 @@ public:
     virtual vector<uint8_t> GetPixelData() const = 0;
     virtual vector<uint8_t> GetDataFrame() const = 0;    
 
+    virtual shared_ptr<IFrameSink> Sink() = 0;
+    virtual const shared_ptr<IFrameSink> Sink() const = 0;
+    virtual const FrameSinkConfig& SinkConfig() const = 0;
+
+    // The sink as a SocketChannel, or null if the feature goes to a local sink
     virtual shared_ptr<ISocketChannel> Socket() = 0;
     virtual const shared_ptr<ISocketChannel> Socket() const = 0;
 
@@ -213,6 +282,13 @@ public:
     virtual uint16_t GetPort() const = 0;
     virtual void     SetPort(uint16_t port) = 0;
 
+    virtual UplinkLimits GetUplinkLimits() const = 0;
+    virtual void         SetUplinkLimits(const UplinkLimits& limits) = 0;    // Applies to every connection right away
+
+    virtual size_t           GetQueueBudget() const = 0;
+    virtual void             SetQueueBudget(size_t budgetBytes) = 0;        // 0 for no budget
+    virtual QueueBudgetUsage GetQueueBudgetUsage() const = 0;
+
     virtual vector<shared_ptr<ICanvas>> Canvases() const = 0;
     virtual uint32_t AddCanvas(shared_ptr<ICanvas> ptrCanvas) = 0;
     virtual bool DeleteCanvasById(uint32_t id) = 0;
@@ -16,6 +16,8 @@ using namespace std::chrono;
 #include "interfaces.h"
 #include "utilities.h"
 #include "socketchannel.h"
+#include "framesink.h"
+#include "lightingsink.h"
 
 class LEDFeature : public ILEDFeature
 {
@@ -28,7 +30,9 @@ class LEDFeature : public ILEDFeature
     uint8_t     _channel;
     bool        _redGreenSwap;
     uint32_t    _clientBufferCount;
-    shared_ptr<ISocketChannel> _ptrSocketChannel;
+    FrameSinkConfig _sinkConfig;
+    shared_ptr<IFrameSink> _sink;
+    shared_ptr<ISocketChannel> _ptrSocketChannel;   // Same as _sink, if that is a SocketChannel
     static atomic<uint32_t> _nextId;
     uint32_t _id;    
 
@@ -43,7 +47,12 @@ public:
                bool           reversed = false,
                uint8_t        channel = 0,
                bool           redGreenSwap = false,
-               uint32_t       clientBufferCount = 8)
+               uint32_t       clientBufferCount = 8,
+               OverflowPolicy overflowPolicy = {},
+               ChannelProtocol protocol = ChannelProtocol::Tcp,
+               milliseconds   staleFrameGrace = SocketChannel::kDefaultStaleFrameGrace,
+               const TransportProfile& transport = {},
+               const FrameSinkConfig& sink = {})
         : _width(width),
           _height(height),
           _offsetX(offsetX),
@@ -52,9 +61,29 @@ public:
           _channel(channel),
           _redGreenSwap(redGreenSwap),
           _clientBufferCount(clientBufferCount),
+          _sinkConfig(sink),
           _id(_nextId++)
     {
-        _ptrSocketChannel = make_shared<SocketChannel>(hostName, friendlyName, port);
+        if (sink.type == FrameSinkType::Socket)
+        {
+            _ptrSocketChannel = make_shared<SocketChannel>(hostName, friendlyName, port, clientBufferCount, overflowPolicy, protocol, staleFrameGrace, transport);
+            _sink = _ptrSocketChannel;
+        }
+        else if (sink.IsLightingProtocol())
+        {
+            _sink = make_shared<LightingProtocolSink>(sink, friendlyName);
+        }
+        else
+        {
+            _sink = MakeLocalFrameSink(sink, friendlyName, MaxFrameBytes());
+        }
+    }
+
+    // The size of the biggest frame we can produce: a data frame that doesn't compress at all
+
+    size_t MaxFrameBytes() const
+    {
+        return Utilities::kCompressedHeaderSize + Utilities::CompressBound(Utilities::kDataFrameHeaderSize + _width * _height * sizeof(CRGB));
     }
 
     uint32_t Id() const override 
@@ -86,6 +115,21 @@ public:
         return(_clientBufferCount * kBufferFillRatio) / _canvas->Effects().GetFPS();
     }
     
+    shared_ptr<IFrameSink> Sink() override
+    {
+        return _sink;
+    }
+
+    const shared_ptr<IFrameSink> Sink() const override
+    {
+        return _sink;
+    }
+
+    const FrameSinkConfig& SinkConfig() const override
+    {
+        return _sinkConfig;
+    }
+
     virtual shared_ptr<ISocketChannel> Socket() override 
     {
         return _ptrSocketChannel;
@@ -167,10 +211,11 @@ public:
 
     vector<uint8_t> GetDataFrame() const override
     {
-        // Calculate epoch time
-        auto now = system_clock::now();
-        auto epoch = duration_cast<microseconds>(now.time_since_epoch()).count();
-        uint64_t seconds = epoch / 1'000'000 + TimeOffset();
+        // Calculate the presentation time as epoch time.  The offset is usually a fraction of a
+        // second, so it has to be added before splitting the time into seconds and microseconds.
+        auto presentAt = system_clock::now() + duration_cast<system_clock::duration>(duration<double>(TimeOffset()));
+        auto epoch = duration_cast<microseconds>(presentAt.time_since_epoch()).count();
+        uint64_t seconds = epoch / 1'000'000;
         uint64_t microseconds = epoch % 1'000'000;
 
         auto pixelData = GetPixelData();
@@ -188,9 +233,7 @@ inline void to_json(nlohmann::json& j, const ILEDFeature & feature)
 {
     j = {
             {"id",                feature.Id()},
-            {"hostName",          feature.Socket()->HostName()},
-            {"friendlyName",      feature.Socket()->FriendlyName()},
-            {"port",              feature.Socket()->Port()},
+            {"friendlyName",      feature.Sink()->FriendlyName()},
             {"width",             feature.Width()},
             {"height",            feature.Height()},
             {"offsetX",           feature.OffsetX()},
@@ -200,25 +243,58 @@ inline void to_json(nlohmann::json& j, const ILEDFeature & feature)
             {"redGreenSwap",      feature.RedGreenSwap()},
             {"clientBufferCount", feature.ClientBufferCount()},
             {"timeOffset",        feature.TimeOffset()},
-            {"bytesPerSecond",    feature.Socket()->GetLastBytesPerSecond()},
-            {"isConnected",       feature.Socket()->IsConnected()},
-            {"queueDepth",        feature.Socket()->GetCurrentQueueDepth()},
-            {"queueMaxSize",      feature.Socket()->GetQueueMaxSize()},
-            {"reconnectCount",    feature.Socket()->GetReconnectCount()}
+            {"sink",              feature.SinkConfig()}
         };
 
-    const auto &response = feature.Socket()->LastClientResponse();
+    // A local sink has no client, so it has no host name or port either; the sink object says where
+    // its frames go.  It stands in for the client otherwise: it's always connected and never queues.
+
+    const auto socket = feature.Socket();
+    if (!socket)
+    {
+        auto metrics = feature.Sink()->GetMetrics();
+        j["bytesPerSecond"] = static_cast<uint64_t>(metrics.bytesPerSecond);
+        j["isConnected"] = feature.Sink()->AcceptsFrames();
+        j["queueDepth"] = 0;
+        j["droppedFrames"] = metrics.drops;
+        j["metrics"] = metrics;
+        return;
+    }
+
+    j["hostName"]          = socket->HostName();
+    j["port"]              = socket->Port();
+    j["protocol"]          = socket->Protocol();
+    j["bytesPerSecond"]    = socket->GetLastBytesPerSecond();
+    j["wakeupsPerSecond"]  = socket->GetWakeupsPerSecond();
+    j["isConnected"]       = socket->IsConnected();
+    j["queueDepth"]        = socket->GetCurrentQueueDepth();
+    j["queueMaxSize"]      = socket->GetQueueMaxSize();
+    j["queuedBytes"]       = socket->GetQueuedBytes();
+    j["reconnectCount"]    = socket->GetReconnectCount();
+    j["overflowPolicy"]    = socket->GetOverflowPolicy();
+    j["staleFrameGraceMs"] = socket->GetStaleFrameGrace().count();
+    j["transport"]         = socket->GetTransport();
+    j["effectiveTransport"] = socket->GetEffectiveTransport();
+    j["droppedFrames"]     = socket->GetDroppedFrames().Total();
+
+    const auto &response = socket->LastClientResponse();
     if (response.size == sizeof(ClientResponse))
         j["lastClientResponse"] = response;
 }
 
 inline void from_json(const nlohmann::json& j, shared_ptr<ILEDFeature> & feature) 
 {
-    // Use `at` for all fields since they are mandatory
+    // Use `at` for all the fields that are mandatory; the overflow policy, protocol, stale frame
+    // grace period, transport profile and sink are optional.  A local sink has no client, so it
+    // doesn't need a host name or port either.
+
+    auto sink = j.value("sink", FrameSinkConfig());
+    bool needsClient = sink.type == FrameSinkType::Socket;
+
     feature = std::make_shared<LEDFeature>(
-        j.at("hostName").get<std::string>(),
+        needsClient ? j.at("hostName").get<std::string>() : j.value("hostName", std::string()),
         j.at("friendlyName").get<std::string>(),
-        j.at("port").get<uint16_t>(),
+        needsClient ? j.at("port").get<uint16_t>() : j.value("port", uint16_t(0)),
         j.at("width").get<uint32_t>(),
         j.at("height").get<uint32_t>(),
         j.at("offsetX").get<uint32_t>(),
@@ -226,7 +302,11 @@ inline void from_json(const nlohmann::json& j, shared_ptr<ILEDFeature> & feature
         j.at("reversed").get<bool>(),
         j.at("channel").get<uint8_t>(),
         j.at("redGreenSwap").get<bool>(),
-        j.at("clientBufferCount").get<uint32_t>()
+        j.at("clientBufferCount").get<uint32_t>(),
+        j.value("overflowPolicy", OverflowPolicy()),
+        j.value("protocol", ChannelProtocol::Tcp),
+        milliseconds(j.value("staleFrameGraceMs", SocketChannel::kDefaultStaleFrameGrace.count())),
+        j.value("transport", TransportProfile()),
+        sink
     );
 }
-
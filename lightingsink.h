@@ -0,0 +1,486 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// LightingProtocolSink
+//
+// Sends a feature's pixels to an off-the-shelf pixel controller in one of the standard lighting
+// protocols, over UDP:
+//
+//   sacn   - E1.31 (streaming ACN) data packets on port 5568, a universe each, unicast to the
+//            host or, with no host, multicast to 239.255.<universe high>.<universe low>
+//   artnet - Art-Net ArtDmx packets on port 6454, a universe each
+//   ddp    - DDP packets on port 4048 of up to 480 pixels each, the last one with the push flag
+//
+// The feature's pixels are split across universes of pixelsPerUniverse pixels, 170 by default
+// (510 of the 512 DMX channels), starting at universe and counting up.
+//
+// Such controllers show what they get right away, so the sink holds on to each frame until its
+// presentation time and only sends it then, which keeps them in step with NightDriverStrip clients
+// showing the same canvas.  If the feature's clientBufferCount is 0, that's as soon as the frame
+// is built.  Should frames fall behind, only the newest one that is due goes out, and maxFps caps
+// the rate further for controllers that can't keep up with the canvas.  Each frame's packets are
+// sent in one go, with sendmmsg() on Linux.  Frames are sent on the SocketReactor, so the sink
+// needs no thread of its own.
+
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include <asio.hpp>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <span>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "global.h"
+#include "framesink.h"
+#include "socketreactor.h"
+#include "utilities.h"
+
+class LightingProtocolSink : public LocalFrameSink, public enable_shared_from_this<LightingProtocolSink>
+{
+public:
+    static constexpr uint16_t kSacnPort          = 5568;
+    static constexpr uint16_t kArtNetPort        = 6454;
+    static constexpr uint16_t kDdpPort           = 4048;
+    static constexpr size_t   kDdpMaxPayload     = 480 * sizeof(CRGB);
+    static constexpr size_t   kMaxPendingFrames  = 256;        // Frames waiting for their presentation time
+    static constexpr uint16_t kMaxSacnUniverse   = 63999;
+    static constexpr uint16_t kMaxArtNetUniverse = 0x7FFF;
+
+private:
+    static constexpr size_t kSacnHeaderSize   = 126;
+    static constexpr size_t kArtNetHeaderSize = 18;
+    static constexpr size_t kDdpHeaderSize    = 10;
+    static constexpr size_t kMaxHeaderSize    = kSacnHeaderSize;
+
+    struct Packet
+    {
+        array<uint8_t, kMaxHeaderSize> header;
+        size_t                         headerSize;
+        span<const uint8_t>            payload;
+        bool                           padded;          // Art-Net wants an even number of channels
+        asio::ip::udp::endpoint        destination;
+    };
+
+    struct PendingFrame
+    {
+        system_clock::time_point presentAt;
+        vector<uint8_t>          pixels;
+    };
+
+    const FrameSinkConfig   _config;
+    array<uint8_t, 16>      _cid;                       // sACN component identifier
+    string                  _sourceName;
+
+    mutex                   _sendMutex;                 // Guards everything below
+    asio::ip::udp::socket   _socket;
+    asio::system_timer      _timer;
+    bool                    _timerArmed = false;
+    uint64_t                _epoch = 0;                 // Counts Close calls, so a late lookup knows it's stale
+    optional<asio::ip::address> _address;
+    deque<PendingFrame>     _pending;
+    uint8_t                 _sequence = 0;
+    steady_clock::time_point _lastSent;
+
+    vector<Packet>          _packets;
+    vector<iovec>           _iovecs;
+#ifdef __linux__
+    vector<mmsghdr>         _messages;
+#else
+    vector<msghdr>          _messages;
+#endif
+
+    static constexpr uint8_t kPadding = 0;
+
+    static void PutWord(uint8_t * destination, uint16_t value)
+    {
+        destination[0] = static_cast<uint8_t>(value >> 8);
+        destination[1] = static_cast<uint8_t>(value);
+    }
+
+    static void PutDWord(uint8_t * destination, uint32_t value)
+    {
+        PutWord(destination, static_cast<uint16_t>(value >> 16));
+        PutWord(destination + 2, static_cast<uint16_t>(value));
+    }
+
+    uint16_t Port() const
+    {
+        if (_config.port)
+            return _config.port;
+
+        switch (_config.type)
+        {
+            case FrameSinkType::Sacn:   return kSacnPort;
+            case FrameSinkType::ArtNet: return kArtNetPort;
+            default:                    return kDdpPort;
+        }
+    }
+
+    // Where a universe's packets go: the host, or the universe's multicast group for sACN
+
+    asio::ip::udp::endpoint Destination(uint16_t universe) const
+    {
+        if (_address)
+            return { *_address, Port() };
+
+        return { asio::ip::address_v4({ 239, 255, static_cast<uint8_t>(universe >> 8), static_cast<uint8_t>(universe) }), Port() };
+    }
+
+    // E1.31 section 4: root layer, framing layer and DMP layer, all lengths counted from their
+    // own layer onwards
+
+    void WriteSacnHeader(Packet& packet, uint16_t universe, size_t channels) const
+    {
+        static constexpr char kAcnIdentifier[12] = { 'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0 };
+        auto * header = packet.header.data();
+        size_t length = kSacnHeaderSize + channels;
+
+        memset(header, 0, kSacnHeaderSize);
+        PutWord(header, 0x0010);                                        // Preamble size
+        memcpy(header + 4, kAcnIdentifier, sizeof(kAcnIdentifier));
+        PutWord(header + 16, static_cast<uint16_t>(0x7000 | (length - 16)));
+        PutDWord(header + 18, 0x00000004);                              // VECTOR_ROOT_E131_DATA
+        memcpy(header + 22, _cid.data(), _cid.size());
+
+        PutWord(header + 38, static_cast<uint16_t>(0x7000 | (length - 38)));
+        PutDWord(header + 40, 0x00000002);                              // VECTOR_E131_DATA_PACKET
+        memcpy(header + 44, _sourceName.data(), _sourceName.size());
+        header[108] = 100;                                              // Priority
+        header[111] = _sequence;
+        PutWord(header + 113, universe);
+
+        PutWord(header + 115, static_cast<uint16_t>(0x7000 | (length - 115)));
+        header[117] = 0x02;                                             // VECTOR_DMP_SET_PROPERTY
+        header[118] = 0xA1;                                             // Address and data type
+        PutWord(header + 121, 0x0001);                                  // Address increment
+        PutWord(header + 123, static_cast<uint16_t>(channels + 1));     // Including the start code
+
+        packet.headerSize = kSacnHeaderSize;
+    }
+
+    void WriteArtNetHeader(Packet& packet, uint16_t universe, size_t channels) const
+    {
+        static constexpr char kArtNetId[8] = { 'A', 'r', 't', '-', 'N', 'e', 't', 0 };
+        auto * header = packet.header.data();
+
+        memcpy(header, kArtNetId, sizeof(kArtNetId));
+        header[8] = 0x00;                                               // OpDmx, little-endian
+        header[9] = 0x50;
+        PutWord(header + 10, 14);                                       // Protocol version
+        header[12] = static_cast<uint8_t>(_sequence % 255 + 1);         // 0 would turn sequencing off
+        header[13] = 0;                                                 // Physical port
+        header[14] = static_cast<uint8_t>(universe);                    // SubUni
+        header[15] = static_cast<uint8_t>(universe >> 8);               // Net
+        PutWord(header + 16, static_cast<uint16_t>(channels + channels % 2));
+
+        packet.headerSize = kArtNetHeaderSize;
+        packet.padded = channels % 2;
+    }
+
+    void WriteDdpHeader(Packet& packet, size_t offset, size_t length, bool last) const
+    {
+        auto * header = packet.header.data();
+
+        header[0] = last ? 0x41 : 0x40;                                 // Version 1, push on the last packet
+        header[1] = static_cast<uint8_t>(_sequence % 15 + 1);
+        header[2] = 0x0B;                                               // 8-bit RGB
+        header[3] = 0x01;                                               // Default output device
+        PutDWord(header + 4, static_cast<uint32_t>(offset));
+        PutWord(header + 8, static_cast<uint16_t>(length));
+
+        packet.headerSize = kDdpHeaderSize;
+    }
+
+    // BuildPackets
+    //
+    // Splits a frame's pixels into packets, each a gather list of its header and its slice of the
+    // pixels, so the pixels aren't copied again
+
+    void BuildPackets(span<const uint8_t> pixels)
+    {
+        bool ddp = _config.type == FrameSinkType::Ddp;
+        size_t sliceBytes = ddp ? kDdpMaxPayload : _config.pixelsPerUniverse * sizeof(CRGB);
+        uint16_t maxUniverse = _config.type == FrameSinkType::Sacn ? kMaxSacnUniverse : kMaxArtNetUniverse;
+
+        _packets.clear();
+        for (size_t offset = 0, index = 0; offset < pixels.size(); offset += sliceBytes, index++)
+        {
+            auto& packet = _packets.emplace_back();
+            packet.payload = pixels.subspan(offset, min(sliceBytes, pixels.size() - offset));
+            packet.padded = false;
+
+            if (ddp)
+            {
+                WriteDdpHeader(packet, offset, packet.payload.size(), offset + sliceBytes >= pixels.size());
+                packet.destination = Destination(0);
+                continue;
+            }
+
+            if (_config.universe + index > maxUniverse)
+            {
+                _packets.pop_back();
+                break;
+            }
+
+            auto universe = static_cast<uint16_t>(_config.universe + index);
+            if (_config.type == FrameSinkType::Sacn)
+                WriteSacnHeader(packet, universe, packet.payload.size());
+            else
+                WriteArtNetHeader(packet, universe, packet.payload.size());
+            packet.destination = Destination(universe);
+        }
+
+        _iovecs.resize(3 * _packets.size());
+        _messages.resize(_packets.size());
+
+        for (size_t i = 0; i < _packets.size(); i++)
+        {
+            auto& packet = _packets[i];
+            _iovecs[3 * i]     = { packet.header.data(), packet.headerSize };
+            _iovecs[3 * i + 1] = { const_cast<uint8_t *>(packet.payload.data()), packet.payload.size() };
+            _iovecs[3 * i + 2] = { const_cast<uint8_t *>(&kPadding), 1 };
+
+            msghdr message {};
+            message.msg_name = packet.destination.data();
+            message.msg_namelen = static_cast<socklen_t>(packet.destination.size());
+            message.msg_iov = &_iovecs[3 * i];
+            message.msg_iovlen = packet.padded ? 3 : 2;
+#ifdef __linux__
+            _messages[i] = { message, 0 };
+#else
+            _messages[i] = message;
+#endif
+        }
+    }
+
+    // SendPackets
+    //
+    // Hands the packets to the kernel without blocking.  Returns whether they all went out, adding
+    // what did to bytesSent.
+
+    bool SendPackets(size_t & bytesSent)
+    {
+        int socketFd = _socket.native_handle();
+        size_t next = 0;
+
+        while (next < _messages.size())
+        {
+#ifdef __linux__
+            int sent = sendmmsg(socketFd, &_messages[next], _messages.size() - next, MSG_DONTWAIT);
+            if (sent < 0)
+                return false;
+
+            for (int i = 0; i < sent; i++)
+                bytesSent += _messages[next + i].msg_len;
+            next += sent;
+#else
+            ssize_t result = sendmsg(socketFd, &_messages[next], MSG_DONTWAIT);
+            if (result < 0)
+                return false;
+
+            bytesSent += result;
+            next++;
+#endif
+        }
+        return true;
+    }
+
+    void SendFrame(const PendingFrame& frame)
+    {
+        if (!_socket.is_open())
+        {
+            CountDrops(1);
+            return;
+        }
+
+        BuildPackets(frame.pixels);
+
+        size_t bytesSent = 0;
+        if (!SendPackets(bytesSent))
+        {
+            logger->debug("Couldn't send to {} [{}]: {}", _config.Describe(), FriendlyName(), strerror(errno));
+            CountDrops(1);
+            return;
+        }
+
+        CountSent(bytesSent);
+        _sequence++;
+    }
+
+    // Called with _sendMutex held, whenever a frame is queued or one has been sent
+
+    void ArmTimer()
+    {
+        if (_timerArmed || _pending.empty())
+            return;
+
+        _timerArmed = true;
+        _timer.expires_at(_pending.front().presentAt);
+        _timer.async_wait([weakSelf = weak_from_this()](const asio::error_code& error)
+        {
+            if (error)
+                return;
+            if (auto self = weakSelf.lock())
+                self->OnTimer();
+        });
+    }
+
+    void OnTimer()
+    {
+        lock_guard lock(_sendMutex);
+        _timerArmed = false;
+
+        auto now = system_clock::now();
+        optional<PendingFrame> due;
+        while (!_pending.empty() && _pending.front().presentAt <= now)
+        {
+            if (due)
+                CountDrops(1);
+            due = std::move(_pending.front());
+            _pending.pop_front();
+        }
+
+        if (due)
+        {
+            auto sentAt = steady_clock::now();
+            if (_config.maxFps > 0 && sentAt - _lastSent < duration<double>(1.0 / _config.maxFps))
+            {
+                CountDrops(1);
+            }
+            else
+            {
+                SendFrame(*due);
+                _lastSent = sentAt;
+            }
+        }
+
+        ArmTimer();
+    }
+
+    // OpenSocket
+    //
+    // Called with _sendMutex held once we know where the packets go
+
+    void OpenSocket(asio::ip::udp protocol)
+    {
+        asio::error_code error;
+        _socket.open(protocol, error);
+        if (error)
+            logger->error("Can't open a socket for {} [{}]: {}", _config.Describe(), FriendlyName(), error.message());
+    }
+
+protected:
+    bool SendsLater() const override
+    {
+        return true;
+    }
+
+    // Literal addresses resolve right away, within Resolve, and names later on an I/O thread;
+    // frames that come before then are dropped
+
+    bool Open() override
+    {
+        uint64_t epoch;
+        {
+            lock_guard lock(_sendMutex);
+            epoch = _epoch;
+
+            if (_config.host.empty())
+            {
+                OpenSocket(asio::ip::udp::v4());
+                return true;
+            }
+        }
+
+        SocketReactor::Instance().Resolver().Resolve(_config.host,
+            [weakSelf = weak_from_this(), epoch](const asio::error_code& error, const HostResolver::Addresses& addresses)
+            {
+                auto self = weakSelf.lock();
+                if (!self)
+                    return;
+
+                lock_guard lock(self->_sendMutex);
+                if (self->_epoch != epoch)
+                    return;
+
+                if (error)
+                {
+                    logger->error("Can't resolve {} for [{}]: {}", self->_config.host, self->FriendlyName(), error.message());
+                    return;
+                }
+
+                self->_address = addresses.front();
+                self->OpenSocket(addresses.front().is_v6() ? asio::ip::udp::v6() : asio::ip::udp::v4());
+            });
+
+        return true;
+    }
+
+    void Close() override
+    {
+        lock_guard lock(_sendMutex);
+
+        _epoch++;
+        _pending.clear();
+        _timer.cancel();
+        _timerArmed = false;
+        _address.reset();
+
+        asio::error_code error;
+        _socket.close(error);
+    }
+
+    bool Write(span<const uint8_t> frameData, system_clock::time_point presentAt) override
+    {
+        // We send the pixels as they are, so a compressed frame is of no use to us
+
+        if (frameData.size() < Utilities::kDataFrameHeaderSize || Utilities::UncompressedSize(frameData) != frameData.size())
+            return false;
+
+        lock_guard lock(_sendMutex);
+
+        if (_pending.size() >= kMaxPendingFrames)
+        {
+            _pending.pop_front();
+            CountDrops(1);
+        }
+
+        _pending.push_back({ presentAt, vector<uint8_t>(frameData.begin() + Utilities::kDataFrameHeaderSize, frameData.end()) });
+        ArmTimer();
+        return true;
+    }
+
+public:
+    LightingProtocolSink(const FrameSinkConfig& config, const string& friendlyName)
+        : LocalFrameSink(friendlyName),
+          _config(config),
+          _sourceName(("ndscpp " + friendlyName).substr(0, 63)),
+          _socket(SocketReactor::Instance().Context()),
+          _timer(SocketReactor::Instance().Context())
+    {
+        random_device random;
+        for (auto& byte : _cid)
+            byte = static_cast<uint8_t>(random());
+    }
+
+    ~LightingProtocolSink() override
+    {
+        Stop();
+    }
+
+    bool TakesCompressedFrames() const override
+    {
+        return false;
+    }
+};
@@ -35,6 +35,7 @@ using namespace std;
 atomic<uint32_t> Canvas::_nextId{0};        // Initialize the static member variable for canvas.h
 atomic<uint32_t> LEDFeature::_nextId{0};    // Initialize the static member variable for ledfeature.h
 atomic<uint32_t> SocketChannel::_nextId{0}; // Initialize the static member variable for socketchannel.h
+atomic<uint32_t> LocalFrameSink::_nextId{0}; // Initialize the static member variable for framesink.h
 
 shared_ptr<spdlog::logger> logger = spdlog::stdout_color_mt("console");
 
@@ -0,0 +1,173 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// Metrics
+//
+// The throughput figures each channel reports: how fast it sends bytes, frames and batches, how
+// well its frames compress, and how often it drops frames or has to reconnect.  They are kept in
+// a ChannelMetrics block of atomics that the sender and the render thread update as they go, and
+// that API threads read without taking any lock.  Every rate is an exponentially weighted moving
+// average on the monotonic clock, so a wall clock step can't skew it.
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include "json.hpp"
+
+// EwmaRate
+//
+// Counts things and keeps an exponentially weighted moving average of how many per second.  Any
+// thread may Add; whichever adder finds the average at least kUpdateInterval old folds what has
+// been counted since into it.  Readers never write: they fold the pending count into a copy of
+// the average, which is also what makes the rate decay once nothing is being counted anymore.
+
+class EwmaRate
+{
+    static constexpr nanoseconds kTimeConstant = 2s;
+    static constexpr nanoseconds kUpdateInterval = 100ms;
+
+    atomic<uint64_t> _total{0};
+    atomic<uint64_t> _foldedTotal{0};
+    atomic<int64_t>  _foldedAt;         // steady_clock ticks
+    atomic<double>   _rate{0};
+
+    static int64_t Now()
+    {
+        return steady_clock::now().time_since_epoch().count();
+    }
+
+    // Moves the average towards the rate of count things over elapsed nanoseconds, by more the
+    // longer that was
+
+    static double Fold(double average, uint64_t count, int64_t elapsed)
+    {
+        double weight = 1.0 - exp(-static_cast<double>(elapsed) / kTimeConstant.count());
+        return average + weight * (count * 1e9 / elapsed - average);
+    }
+
+public:
+    EwmaRate() : _foldedAt(Now()) {}
+
+    void Add(uint64_t amount = 1)
+    {
+        uint64_t total = _total.fetch_add(amount, memory_order_relaxed) + amount;
+        int64_t now = Now();
+        int64_t foldedAt = _foldedAt.load(memory_order_relaxed);
+
+        // Only one adder gets to fold per interval
+
+        if (now - foldedAt < kUpdateInterval.count() ||
+            !_foldedAt.compare_exchange_strong(foldedAt, now, memory_order_relaxed))
+            return;
+
+        uint64_t folded = _foldedTotal.exchange(total, memory_order_relaxed);
+        _rate.store(Fold(_rate.load(memory_order_relaxed), total - folded, now - foldedAt), memory_order_relaxed);
+    }
+
+    uint64_t Total() const
+    {
+        return _total.load(memory_order_relaxed);
+    }
+
+    double PerSecond() const
+    {
+        int64_t elapsed = Now() - _foldedAt.load(memory_order_relaxed);
+        double rate = _rate.load(memory_order_relaxed);
+
+        if (elapsed < kUpdateInterval.count())
+            return rate;
+
+        uint64_t total = _total.load(memory_order_relaxed);
+        uint64_t folded = _foldedTotal.load(memory_order_relaxed);
+        return Fold(rate, total > folded ? total - folded : 0, elapsed);
+    }
+};
+
+// MetricsSnapshot
+//
+// A plain copy of a ChannelMetrics block, for reporting
+
+struct MetricsSnapshot
+{
+    double   bytesPerSecond = 0;
+    double   framesPerSecond = 0;
+    double   batchesPerSecond = 0;
+    double   compressionRatio = 0;      // Uncompressed bytes per queued byte; 1 for uncompressed frames
+    double   dropsPerSecond = 0;
+    double   reconnectsPerSecond = 0;
+    uint64_t bytes = 0;
+    uint64_t frames = 0;
+    uint64_t batches = 0;
+    uint64_t drops = 0;
+    uint64_t reconnects = 0;
+    uint64_t rePrimedFrames = 0;        // Frames sent again to refill a client's buffer after a reconnect
+
+    friend void to_json(nlohmann::json& j, const MetricsSnapshot& metrics)
+    {
+        j = {
+            {"bytesPerSecond",      metrics.bytesPerSecond},
+            {"framesPerSecond",     metrics.framesPerSecond},
+            {"batchesPerSecond",    metrics.batchesPerSecond},
+            {"compressionRatio",    metrics.compressionRatio},
+            {"dropsPerSecond",      metrics.dropsPerSecond},
+            {"reconnectsPerSecond", metrics.reconnectsPerSecond},
+            {"bytes",               metrics.bytes},
+            {"frames",              metrics.frames},
+            {"batches",             metrics.batches},
+            {"drops",               metrics.drops},
+            {"reconnects",          metrics.reconnects},
+            {"rePrimedFrames",      metrics.rePrimedFrames}
+        };
+    }
+};
+
+// ChannelMetrics
+//
+// One channel's block.  The sender's counters and the render thread's counters sit on cache lines
+// of their own, so neither side's updates keep stealing the line the other one is writing.
+
+struct alignas(64) ChannelMetrics
+{
+    // Updated by the sender
+
+    EwmaRate bytes;
+    EwmaRate frames;
+    EwmaRate batches;                   // Batches this channel had frames in
+    EwmaRate reconnects;
+    EwmaRate wakeups;                   // Times the connection looked for something to send
+    EwmaRate blockedMicroseconds;       // Spent waiting for the connection's socket to become writable
+
+    // Updated by the render thread
+
+    alignas(64) EwmaRate uncompressedBytes;
+    EwmaRate queuedBytes;
+    EwmaRate rePrimedFrames;
+
+    // Updated by both, whichever one drops a frame
+
+    alignas(64) EwmaRate drops;
+
+    MetricsSnapshot Snapshot() const
+    {
+        MetricsSnapshot snapshot;
+        snapshot.bytesPerSecond      = bytes.PerSecond();
+        snapshot.framesPerSecond     = frames.PerSecond();
+        snapshot.batchesPerSecond    = batches.PerSecond();
+        snapshot.dropsPerSecond      = drops.PerSecond();
+        snapshot.reconnectsPerSecond = reconnects.PerSecond();
+        snapshot.bytes               = bytes.Total();
+        snapshot.frames              = frames.Total();
+        snapshot.batches             = batches.Total();
+        snapshot.drops               = drops.Total();
+        snapshot.reconnects          = reconnects.Total();
+        snapshot.rePrimedFrames      = rePrimedFrames.Total();
+
+        double queuedRate = queuedBytes.PerSecond();
+        if (queuedRate > 0)
+            snapshot.compressionRatio = uncompressedBytes.PerSecond() / queuedRate;
+
+        return snapshot;
+    }
+};
@@ -75,8 +75,17 @@ void Monitor::drawContent()
                     mvwprintw(contentWin, row - scrollOffset, x, "%-*s", COLUMNS[1].second, featureName.c_str());
                     x += COLUMNS[1].second + 1;
 
-                    // Hostname
-                    mvwprintw(contentWin, row - scrollOffset, x, "%-*s", COLUMNS[2].second, featureJson["hostName"].get<std::string>().c_str());
+                    // Hostname, or for a feature with a local sink, what the sink writes to
+                    std::string hostName = featureJson.value("hostName", std::string());
+                    if (hostName.empty() && featureJson.contains("sink"))
+                    {
+                        const auto& sink = featureJson["sink"];
+                        std::string target = sink.value("host", std::string());
+                        if (target.empty())
+                            target = sink.value("path", std::string());
+                        hostName = sink.value("type", std::string()) + (target.empty() ? "" : ":" + target);
+                    }
+                    mvwprintw(contentWin, row - scrollOffset, x, "%-*s", COLUMNS[2].second, hostName.c_str());
                     x += COLUMNS[2].second + 1;
 
 
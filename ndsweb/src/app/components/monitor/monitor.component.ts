@@ -340,6 +340,16 @@ export class MonitorComponent implements OnChanges {
         );
     }
 
+    // What a feature with a local sink writes to, in the place of a host name
+    describeSink(feature: Feature): string {
+        const sink = feature.sink;
+        if (!sink) {
+            return '';
+        }
+        const target = sink.host || sink.path;
+        return target ? `${sink.type}:${target}` : sink.type;
+    }
+
     transformFeatureToRowData(canvas: Canvas, feature: Feature) {
         const now = new Date().getTime();
         const isConnected = feature.isConnected;
@@ -355,7 +365,7 @@ export class MonitorComponent implements OnChanges {
             featureId: feature.id,
             canvasName: canvas.name,
             featureName: feature.friendlyName,
-            hostName: feature.hostName,
+            hostName: feature.hostName ?? this.describeSink(feature),
             size: `${feature.height}x${feature.width}`,
             reconnectCount: reconnectCount,
             reconnectStatus: !reconnectCount
@@ -56,7 +56,7 @@ export interface Feature {
     clientBufferCount: number;
     friendlyName: string;
     height: number;
-    hostName: string;
+    hostName?: string;           // Not for features with a local sink
     id: number;
     isConnected: boolean;
     lastClientResponse?: {
@@ -75,12 +75,17 @@ export interface Feature {
     };
     offsetX: number;
     offsetY: number;
-    port: number;
+    port?: number;
     queueDepth: number;
     queueMaxSize: number;
     reconnectCount: number;
     redGreenSwap: boolean;
     reversed: boolean;
+    sink?: {
+        type: string;
+        host: string;
+        path: string;
+    };
     timeOffset: number;
     type: string;
     width: number;
@@ -0,0 +1,92 @@
+#pragma once
+using namespace std;
+
+// OverflowPolicy
+//
+// What a SocketChannel does when frames are produced faster than they can be sent and its queue
+// fills up.  Configured per feature:
+//
+//   dropOldest - Drops just enough of the oldest queued frames to get back under the limits
+//   keepLatest - Drops everything but the newest keepLatest frames
+//   decimate   - Drops every other queued frame, so the backlog plays out at half the frame rate
+//   reset      - Drops the whole queue and reconnects, which is what the channel used to always do
+//
+// Only reset touches the connection, and only one that no other feature shares; the others let
+// the client keep playing what it has while the backlog shrinks.
+
+#include <atomic>
+#include <cstdint>
+#include "json.hpp"
+
+struct OverflowPolicy
+{
+    enum class Mode : uint8_t
+    {
+        DropOldest,
+        KeepLatest,
+        Decimate,
+        Reset
+    };
+
+    static constexpr uint32_t kDefaultKeepLatest = 60;
+
+    Mode     mode = Mode::DropOldest;
+    uint32_t keepLatest = kDefaultKeepLatest;   // Frames that Mode::KeepLatest holds on to
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(OverflowPolicy::Mode, {
+    { OverflowPolicy::Mode::DropOldest, "dropOldest" },
+    { OverflowPolicy::Mode::KeepLatest, "keepLatest" },
+    { OverflowPolicy::Mode::Decimate,   "decimate"   },
+    { OverflowPolicy::Mode::Reset,      "reset"      }
+})
+
+inline void to_json(nlohmann::json& j, const OverflowPolicy& policy)
+{
+    j = {
+        {"mode",       policy.mode},
+        {"keepLatest", policy.keepLatest}
+    };
+}
+
+inline void from_json(const nlohmann::json& j, OverflowPolicy& policy)
+{
+    OverflowPolicy defaults;
+    policy.mode = j.value("mode", defaults.mode);
+    policy.keepLatest = j.value("keepLatest", defaults.keepLatest);
+}
+
+// DroppedFrames
+//
+// How many frames each policy has dropped, whether by trimming the queue or by turning away a
+// new frame that didn't fit, plus the stale frames the sender skipped because their presentation
+// time had already passed by the time they got to the front of the queue, and the queued frames
+// that a re-prime after a reconnect replaced
+
+struct DroppedFrames
+{
+    uint64_t dropOldest = 0;
+    uint64_t keepLatest = 0;
+    uint64_t decimate = 0;
+    uint64_t reset = 0;
+    uint64_t stale = 0;
+    uint64_t replaced = 0;
+
+    uint64_t Total() const
+    {
+        return dropOldest + keepLatest + decimate + reset + stale + replaced;
+    }
+
+    friend void to_json(nlohmann::json& j, const DroppedFrames& dropped)
+    {
+        j = {
+            {"dropOldest", dropped.dropOldest},
+            {"keepLatest", dropped.keepLatest},
+            {"decimate",   dropped.decimate},
+            {"reset",      dropped.reset},
+            {"stale",      dropped.stale},
+            {"replaced",   dropped.replaced},
+            {"total",      dropped.Total()}
+        };
+    }
+};
@@ -0,0 +1,202 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// QueueBudget
+//
+// Caps the memory that all the channels' frame queues together may hold.  Each channel opens an
+// account here, and every kRebalanceInterval the budget adds up what the accounts are using and
+// hands them all the same limit, the max-min fair level: going through the channels from the
+// smallest up, each one either fits within an equal split of what the ones before it left over,
+// or that split is the level.  While the total is under budget, that works out as what the
+// biggest channel could grow to with all the others staying where they are.  Once it's over,
+// it's the level at which the budget would be used up exactly, so the channels using the most
+// are the only ones above it and the first to shed frames, while the smaller ones keep theirs.
+//
+// The budget doesn't drop anything itself: a channel checks its limit as it queues a frame, and
+// applies its overflow policy once it's over, just as it does with its own queue limits.  Limits
+// are only recomputed every round, so in between the total can overshoot by what gets queued in
+// the meantime.  A budget of zero, which is the default, means no limit, but the rounds still
+// run to keep the usage figures current.
+
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include <asio.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "json.hpp"
+
+// QueueBudgetUsage
+//
+// Where the budget stands as of its last round, for the API
+
+struct QueueBudgetUsage
+{
+    size_t   budgetBytes = 0;               // 0 means no budget
+    size_t   usedBytes = 0;
+    size_t   fairShareBytes = 0;            // The limit every channel has
+    size_t   channels = 0;
+    size_t   channelsOverShare = 0;         // Channels that have to shed frames
+    uint64_t sheds = 0;                     // Times a channel ran into its share
+
+    friend void to_json(nlohmann::json& j, const QueueBudgetUsage& usage)
+    {
+        j = {
+            {"budgetBytes",       usage.budgetBytes},
+            {"usedBytes",         usage.usedBytes},
+            {"fairShareBytes",    usage.fairShareBytes},
+            {"channels",          usage.channels},
+            {"channelsOverShare", usage.channelsOverShare},
+            {"sheds",             usage.sheds}
+        };
+    }
+};
+
+class QueueBudget
+{
+public:
+    static constexpr auto   kRebalanceInterval = 100ms;
+    static constexpr size_t kMinShareBytes = 64 * 1024;    // However tight the budget, a channel can queue this much
+    static constexpr size_t kNoLimit = numeric_limits<size_t>::max();
+
+    // Account
+    //
+    // A channel's share.  The channel owns it, reads its limit before queueing a frame and counts
+    // a shed whenever that stops it; closing the account is just letting go of it.
+
+    struct Account
+    {
+        function<size_t()> usage;               // Called during a round, from an I/O thread
+        atomic<size_t>     limit{kNoLimit};
+        atomic<uint64_t>   sheds{0};
+    };
+
+private:
+    mutable mutex              _mutex;
+    asio::steady_timer         _timer;
+    bool                       _timerArmed = false;
+    size_t                     _budgetBytes = 0;
+    vector<weak_ptr<Account>>  _accounts;
+    QueueBudgetUsage           _usage;
+
+    void ArmTimer()
+    {
+        if (_timerArmed || _accounts.empty())
+            return;
+
+        _timerArmed = true;
+        _timer.expires_after(kRebalanceInterval);
+        _timer.async_wait([this](const asio::error_code& error)
+        {
+            if (error)
+                return;
+
+            lock_guard lock(_mutex);
+            _timerArmed = false;
+            Rebalance();
+            ArmTimer();
+        });
+    }
+
+    // Rebalance
+    //
+    // Called with the lock held: adds up the accounts and sets their limits
+
+    void Rebalance()
+    {
+        vector<pair<shared_ptr<Account>, size_t>> used;
+        size_t total = 0;
+        uint64_t sheds = 0;
+
+        erase_if(_accounts, [](const auto& account) { return account.expired(); });
+        for (const auto& weakAccount : _accounts)
+        {
+            if (auto account = weakAccount.lock())
+            {
+                size_t bytes = account->usage();
+                total += bytes;
+                sheds += account->sheds.load(memory_order_relaxed);
+                used.emplace_back(std::move(account), bytes);
+            }
+        }
+
+        _usage = { _budgetBytes, total, 0, used.size(), 0, sheds };
+
+        if (_budgetBytes == 0 || used.empty())
+        {
+            for (auto& [account, bytes] : used)
+                account->limit.store(kNoLimit, memory_order_relaxed);
+            return;
+        }
+
+        ranges::sort(used, {}, [](const auto& entry) { return entry.second; });
+
+        size_t remaining = _budgetBytes;
+        size_t level = 0;
+        for (size_t i = 0; i < used.size(); i++)
+        {
+            level = remaining / (used.size() - i);
+            if (used[i].second > level)
+                break;
+            remaining -= used[i].second;
+        }
+
+        level = max(level, kMinShareBytes);
+        _usage.fairShareBytes = level;
+
+        for (auto& [account, bytes] : used)
+        {
+            account->limit.store(level, memory_order_relaxed);
+            if (bytes > level)
+                _usage.channelsOverShare++;
+        }
+    }
+
+public:
+    explicit QueueBudget(asio::io_context& context) : _timer(context)
+    {
+    }
+
+    shared_ptr<Account> Open(function<size_t()> usage)
+    {
+        auto account = make_shared<Account>();
+        account->usage = std::move(usage);
+
+        lock_guard lock(_mutex);
+        _accounts.push_back(account);
+        ArmTimer();
+        return account;
+    }
+
+    size_t GetBudget() const
+    {
+        lock_guard lock(_mutex);
+        return _budgetBytes;
+    }
+
+    // SetBudget
+    //
+    // Takes effect right away
+
+    void SetBudget(size_t budgetBytes)
+    {
+        lock_guard lock(_mutex);
+        _budgetBytes = budgetBytes;
+        Rebalance();
+    }
+
+    QueueBudgetUsage GetUsage() const
+    {
+        lock_guard lock(_mutex);
+        return _usage;
+    }
+};
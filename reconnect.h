@@ -0,0 +1,276 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// Reconnect
+//
+// The pieces a SocketChannel uses to get (back) on the air without every channel hammering the
+// network at once:
+//
+//   ReconnectBackoff   - Per channel: how long to wait before the next attempt after a failure
+//   ConnectRateLimiter - Process wide: caps how many connection attempts start per second
+//   HostResolver       - Process wide: asynchronous name lookup with a small TTL cache
+//
+// The limiter and resolver are owned by the SocketReactor so that they outlive its I/O threads.
+
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include <asio.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "json.hpp"
+
+// ConnectionState
+//
+// Where a channel is in its connect cycle, for the API
+
+enum class ConnectionState : uint8_t
+{
+    Stopped,
+    Resolving,
+    WaitingForSlot,     // Held back by the ConnectRateLimiter
+    Connecting,
+    Connected,
+    BackingOff          // Waiting out the ReconnectBackoff delay after a failure
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(ConnectionState, {
+    { ConnectionState::Stopped,        "stopped"        },
+    { ConnectionState::Resolving,      "resolving"      },
+    { ConnectionState::WaitingForSlot, "waitingForSlot" },
+    { ConnectionState::Connecting,     "connecting"     },
+    { ConnectionState::Connected,      "connected"      },
+    { ConnectionState::BackingOff,     "backingOff"     }
+})
+
+// ConnectStats
+//
+// A snapshot of a channel's connection state and history
+
+struct ConnectStats
+{
+    ConnectionState state = ConnectionState::Stopped;
+    uint64_t        attempts = 0;               // Connection attempts started, successful or not
+    uint32_t        consecutiveFailures = 0;    // Since the last successful connect
+    int64_t         retryInMs = 0;              // Only meaningful while BackingOff or WaitingForSlot
+    string          address;                    // The address we last tried to connect to
+    string          lastError;
+
+    friend void to_json(nlohmann::json& j, const ConnectStats& stats)
+    {
+        j = {
+            {"state",               stats.state},
+            {"attempts",            stats.attempts},
+            {"consecutiveFailures", stats.consecutiveFailures},
+            {"address",             stats.address},
+            {"lastError",           stats.lastError}
+        };
+
+        if (stats.state == ConnectionState::BackingOff || stats.state == ConnectionState::WaitingForSlot)
+            j["retryInMs"] = stats.retryInMs;
+    }
+};
+
+// ReconnectBackoff
+//
+// Exponential backoff with jitter.  Each consecutive failure doubles the delay, up to kMaxDelay,
+// and the actual wait is picked at random from the upper half of that, so channels that lost
+// their connections at the same moment (an access point rebooting, say) don't all come back at
+// the same moment too.
+
+class ReconnectBackoff
+{
+    static constexpr milliseconds kInitialDelay = 1000ms;
+    static constexpr milliseconds kMaxDelay     = 30000ms;
+
+    uint32_t _failures = 0;
+    minstd_rand _random;
+
+public:
+    explicit ReconnectBackoff(uint32_t seed) : _random(random_device{}() ^ seed)
+    {
+    }
+
+    uint32_t Failures() const
+    {
+        return _failures;
+    }
+
+    // The delay before the next attempt, which also counts as one more failure
+
+    milliseconds NextDelay()
+    {
+        auto delay = kMaxDelay;
+        if (_failures < 16)
+            delay = min(kMaxDelay, kInitialDelay * (1 << _failures));
+
+        _failures++;
+
+        uniform_int_distribution<int64_t> jitter(delay.count() / 2, delay.count());
+        return milliseconds(jitter(_random));
+    }
+
+    void Reset()
+    {
+        _failures = 0;
+    }
+};
+
+// ConnectRateLimiter
+//
+// A process-wide cap of kMaxAttemptsPerSecond connection attempts, allowing a burst of up to a
+// second's worth.  Callers reserve a slot and are told when they may go ahead, which is right
+// away unless others have used up the budget.  Lock-free, so any channel's strand can call it.
+
+class ConnectRateLimiter
+{
+public:
+    static constexpr uint32_t kMaxAttemptsPerSecond = 10;
+
+private:
+    static constexpr steady_clock::duration kInterval = duration_cast<steady_clock::duration>(1s) / kMaxAttemptsPerSecond;
+    static constexpr steady_clock::duration kBurst = kInterval * kMaxAttemptsPerSecond;
+
+    atomic<steady_clock::rep> _nextFree{0};     // When the budget will be fully spent, were nobody to wait
+
+public:
+    steady_clock::time_point Reserve(steady_clock::time_point now)
+    {
+        auto current = _nextFree.load(memory_order_relaxed);
+        steady_clock::time_point nextFree;
+
+        do
+        {
+            nextFree = max(steady_clock::time_point(steady_clock::duration(current)), now) + kInterval;
+        }
+        while (!_nextFree.compare_exchange_weak(current, nextFree.time_since_epoch().count(), memory_order_relaxed));
+
+        return max(now, nextFree - kBurst);
+    }
+};
+
+// HostResolver
+//
+// Looks host names up asynchronously on the reactor and caches the results for kTtl, or for
+// kFailureTtl if the lookup failed.  getaddrinfo doesn't tell us the record's real TTL, so these
+// are simply short enough to pick up a DHCP change and long enough that a room full of channels
+// reconnecting doesn't become a room full of lookups.  Concurrent lookups of the same name share
+// one query.  Literal IPv4 and IPv6 addresses are answered right away without touching the cache.
+
+class HostResolver
+{
+public:
+    using Addresses = vector<asio::ip::address>;
+    using Callback = function<void(const asio::error_code&, const Addresses&)>;
+
+private:
+    static constexpr auto kTtl        = 60s;
+    static constexpr auto kFailureTtl = 5s;
+
+    struct Entry
+    {
+        Addresses                addresses;
+        asio::error_code         error;
+        steady_clock::time_point expires;
+        bool                     pending = false;
+        vector<Callback>         waiters;
+    };
+
+    asio::ip::tcp::resolver        _resolver;
+    mutex                          _mutex;
+    unordered_map<string, Entry>   _entries;
+
+    void OnResolved(const string& host, asio::error_code error, const asio::ip::tcp::resolver::results_type& results)
+    {
+        Addresses addresses;
+        for (const auto& result : results)
+        {
+            auto address = result.endpoint().address();
+            if (find(addresses.begin(), addresses.end(), address) == addresses.end())
+                addresses.push_back(address);
+        }
+
+        if (!error && addresses.empty())
+            error = asio::error::host_not_found;
+
+        vector<Callback> waiters;
+        {
+            lock_guard lock(_mutex);
+            auto& entry = _entries[host];
+            entry.addresses = addresses;
+            entry.error = error;
+            entry.expires = steady_clock::now() + (error ? kFailureTtl : kTtl);
+            entry.pending = false;
+            waiters.swap(entry.waiters);
+        }
+
+        for (auto& waiter : waiters)
+            waiter(error, addresses);
+    }
+
+public:
+    explicit HostResolver(asio::io_context& context) : _resolver(context)
+    {
+    }
+
+    // Resolve
+    //
+    // Calls back with the host's addresses, in the order getaddrinfo prefers them.  The callback
+    // may run before Resolve returns or later on an I/O thread, so callers should hop back onto
+    // their own strand.
+
+    void Resolve(const string& host, Callback callback)
+    {
+        asio::error_code error;
+        auto address = asio::ip::make_address(host, error);
+        if (!error)
+        {
+            callback(error, { address });
+            return;
+        }
+
+        unique_lock lock(_mutex);
+        auto& entry = _entries[host];
+
+        if (!entry.pending && steady_clock::now() < entry.expires)
+        {
+            auto cachedError = entry.error;
+            auto addresses = entry.addresses;
+            lock.unlock();
+
+            callback(cachedError, addresses);
+            return;
+        }
+
+        entry.waiters.push_back(std::move(callback));
+        if (entry.pending)
+            return;
+
+        entry.pending = true;
+        _resolver.async_resolve(host, "", [this, host](const asio::error_code& error, asio::ip::tcp::resolver::results_type results)
+        {
+            OnResolved(host, error, results);
+        });
+    }
+
+    // Forget
+    //
+    // Drops a cached answer, such as an address we could no longer connect to
+
+    void Forget(const string& host)
+    {
+        lock_guard lock(_mutex);
+        auto entry = _entries.find(host);
+        if (entry != _entries.end() && !entry->second.pending)
+            _entries.erase(entry);
+    }
+};
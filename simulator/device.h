@@ -0,0 +1,342 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// Simulated NightDriverStrip device
+//
+// What a NightDriverStrip client does with the frames the server sends it, short of lighting any
+// LEDs: splits the stream into frames, inflates the compressed ones and checks their headers,
+// keeps them in a buffer of bufferSize frames that drains at the device's frame rate as their
+// presentation times come up, and answers every frame with a ClientResponse.  Anything the real
+// device would choke on is reported as invalid.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <span>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+namespace Simulator
+{
+    constexpr uint32_t kCompressedTag   = 0x44415645;       // "DAVE"
+    constexpr uint32_t kDatagramTag     = 0x4E445355;       // "NDSU"
+    constexpr size_t   kCompressedHeaderSize = 16;
+    constexpr size_t   kDatagramHeaderSize = 8;
+    constexpr size_t   kDataHeaderSize  = 24;
+    constexpr uint16_t kPixelDataCommand = 3;
+    constexpr uint32_t kMaxPixels       = 1024 * 1024;      // Anything bigger is a corrupt length
+    constexpr uint32_t kFlashVersion    = 99;
+
+    inline uint32_t ReadDWord(const uint8_t * source)
+    {
+        return source[0] | (source[1] << 8) | (source[2] << 16) | (static_cast<uint32_t>(source[3]) << 24);
+    }
+
+    inline uint64_t ReadULong(const uint8_t * source)
+    {
+        return ReadDWord(source) | (static_cast<uint64_t>(ReadDWord(source + 4)) << 32);
+    }
+
+    // DeviceResponse
+    //
+    // The ClientResponse the server expects, field for field
+
+    struct DeviceResponse
+    {
+        uint32_t size = sizeof(DeviceResponse);
+        uint64_t sequence = 0;
+        uint32_t flashVersion = kFlashVersion;
+        double   currentClock = 0;
+        double   oldestPacket = 0;
+        double   newestPacket = 0;
+        double   brightness = 100;
+        double   wifiSignal = -50;
+        uint32_t bufferSize = 0;
+        uint32_t bufferPos = 0;
+        uint32_t fpsDrawing = 0;
+        uint32_t watts = 0;
+    } __attribute__((packed));
+
+    static_assert(sizeof(DeviceResponse) == 72, "DeviceResponse must match the server's ClientResponse");
+
+    // Frame
+    //
+    // What we keep of a valid frame
+
+    struct Frame
+    {
+        uint16_t                 channel;
+        uint32_t                 pixels;
+        system_clock::time_point presentAt;
+    };
+
+    enum class ParseResult
+    {
+        Incomplete,
+        Frame,
+        Invalid
+    };
+
+    // ParseDataFrame
+    //
+    // Checks an uncompressed pixel data frame, which has to be exactly as long as its header says
+
+    inline bool ParseDataFrame(span<const uint8_t> data, Frame & frame, string & error)
+    {
+        if (data.size() < kDataHeaderSize)
+            return error = "data frame too short", false;
+
+        uint16_t command = data[0] | (data[1] << 8);
+        if (command != kPixelDataCommand)
+            return error = "unknown command " + to_string(command), false;
+
+        frame.channel = data[2] | (data[3] << 8);
+        frame.pixels = ReadDWord(data.data() + 4);
+        if (frame.pixels > kMaxPixels || data.size() != kDataHeaderSize + frame.pixels * 3ull)
+            return error = "data frame of " + to_string(data.size()) + " bytes for " + to_string(frame.pixels) + " pixels", false;
+
+        uint64_t wholeSeconds = ReadULong(data.data() + 8);
+        uint64_t micros = ReadULong(data.data() + 16);
+        if (micros >= 1'000'000)
+            return error = "bad microseconds " + to_string(micros), false;
+
+        frame.presentAt = system_clock::time_point(duration_cast<system_clock::duration>(seconds(wholeSeconds) + microseconds(micros)));
+        return true;
+    }
+
+    // FrameParser
+    //
+    // Splits what arrives on a connection into frames.  Each is either a compressed frame, a
+    // "DAVE" header of tag, compressed size, original size and custom tag in front of the zlib
+    // data, or a plain data frame.  A datagram holds exactly one frame behind its "NDSU" header.
+
+    class FrameParser
+    {
+        vector<uint8_t> _pending;
+        vector<uint8_t> _inflated;
+
+        bool Inflate(span<const uint8_t> compressed, size_t originalSize, string & error)
+        {
+            _inflated.resize(originalSize);
+            uLongf size = static_cast<uLongf>(originalSize);
+            if (uncompress(_inflated.data(), &size, compressed.data(), static_cast<uLong>(compressed.size())) != Z_OK)
+                return error = "compressed frame doesn't inflate", false;
+            if (size != originalSize)
+                return error = "compressed frame inflates to " + to_string(size) + " bytes, not " + to_string(originalSize), false;
+            return true;
+        }
+
+        // Parses one frame from the front of data, setting used to its length
+
+        ParseResult ParseOne(span<const uint8_t> data, Frame & frame, size_t & used, string & error)
+        {
+            if (data.size() < sizeof(uint32_t))
+                return ParseResult::Incomplete;
+
+            if (ReadDWord(data.data()) == kCompressedTag)
+            {
+                if (data.size() < kCompressedHeaderSize)
+                    return ParseResult::Incomplete;
+
+                uint32_t compressedSize = ReadDWord(data.data() + 4);
+                uint32_t originalSize = ReadDWord(data.data() + 8);
+                if (originalSize > kDataHeaderSize + kMaxPixels * 3)
+                    return error = "compressed frame claims " + to_string(originalSize) + " bytes", ParseResult::Invalid;
+                if (data.size() < kCompressedHeaderSize + compressedSize)
+                    return ParseResult::Incomplete;
+
+                used = kCompressedHeaderSize + compressedSize;
+                if (!Inflate(data.subspan(kCompressedHeaderSize, compressedSize), originalSize, error) ||
+                    !ParseDataFrame(_inflated, frame, error))
+                    return ParseResult::Invalid;
+                return ParseResult::Frame;
+            }
+
+            if (data.size() < kDataHeaderSize)
+                return ParseResult::Incomplete;
+
+            uint32_t pixels = ReadDWord(data.data() + 4);
+            if (pixels > kMaxPixels)
+                return error = "data frame claims " + to_string(pixels) + " pixels", ParseResult::Invalid;
+            if (data.size() < kDataHeaderSize + pixels * 3ull)
+                return ParseResult::Incomplete;
+
+            used = kDataHeaderSize + pixels * 3;
+            return ParseDataFrame(data.first(used), frame, error) ? ParseResult::Frame : ParseResult::Invalid;
+        }
+
+    public:
+        // Feed
+        //
+        // Adds bytes from a stream and calls onFrame for each complete frame.  Returns false, with
+        // error set, as soon as one is invalid, after which the stream can't be trusted anymore.
+
+        template <typename Handler>
+        bool Feed(span<const uint8_t> data, string & error, Handler onFrame)
+        {
+            _pending.insert(_pending.end(), data.begin(), data.end());
+
+            size_t offset = 0;
+            for (;;)
+            {
+                Frame frame;
+                size_t used = 0;
+                auto result = ParseOne(span<const uint8_t>(_pending).subspan(offset), frame, used, error);
+                if (result == ParseResult::Invalid)
+                    return false;
+                if (result == ParseResult::Incomplete)
+                    break;
+
+                offset += used;
+                onFrame(frame);
+            }
+
+            _pending.erase(_pending.begin(), _pending.begin() + offset);
+            return true;
+        }
+
+        // ParseDatagram
+        //
+        // Checks a datagram's header and the frame behind it, and returns its sequence number
+
+        ParseResult ParseDatagram(span<const uint8_t> datagram, Frame & frame, uint32_t & sequence, string & error)
+        {
+            if (datagram.size() < kDatagramHeaderSize || ReadDWord(datagram.data()) != kDatagramTag)
+                return error = "datagram without a header", ParseResult::Invalid;
+
+            sequence = ReadDWord(datagram.data() + 4);
+
+            size_t used = 0;
+            auto result = ParseOne(datagram.subspan(kDatagramHeaderSize), frame, used, error);
+            if (result == ParseResult::Incomplete || (result == ParseResult::Frame && used != datagram.size() - kDatagramHeaderSize))
+                return error = "datagram doesn't hold exactly one frame", ParseResult::Invalid;
+            return result;
+        }
+
+        void Clear()
+        {
+            _pending.clear();
+        }
+    };
+
+    // DeviceStats
+    //
+    // Counters shared by every simulated device, for the periodic report
+
+    struct DeviceStats
+    {
+        atomic<uint64_t> connections{0};
+        atomic<uint64_t> disconnects{0};
+        atomic<uint64_t> bytes{0};
+        atomic<uint64_t> frames{0};
+        atomic<uint64_t> invalid{0};
+        atomic<uint64_t> drawn{0};          // Frames shown
+        atomic<uint64_t> skipped{0};        // Frames whose turn came along with a newer one's
+        atomic<uint64_t> late{0};           // Frames that arrived after their presentation time
+        atomic<uint64_t> overflows{0};      // Frames pushed out of a full buffer
+        atomic<uint64_t> responses{0};
+    };
+
+    // FrameBuffer
+    //
+    // The device's frame buffer.  Frames wait in presentation order until the device draws, which
+    // it does fps times a second, showing the newest frame whose time has come and discarding any
+    // older ones.  Frames that are already late when they arrive are discarded right away, as the
+    // real device does, and a full buffer loses its oldest frame.
+
+    class FrameBuffer
+    {
+        size_t                   _capacity;
+        nanoseconds              _drawInterval;
+        deque<Frame>             _frames;
+        steady_clock::time_point _nextDraw;
+        DeviceStats            & _stats;
+
+    public:
+        FrameBuffer(size_t capacity, double fps, DeviceStats & stats)
+            : _capacity(capacity),
+              _drawInterval(duration_cast<nanoseconds>(duration<double>(1.0 / fps))),
+              _nextDraw(steady_clock::now()),
+              _stats(stats)
+        {
+        }
+
+        // Draw
+        //
+        // Catches up with the draws that were due by now
+
+        void Draw()
+        {
+            auto now = steady_clock::now();
+            if (now < _nextDraw)
+                return;
+
+            // However long it's been, drawing once at the latest due time amounts to the same
+
+            auto systemNow = system_clock::now();
+            size_t due = 0;
+            while (due < _frames.size() && _frames[due].presentAt <= systemNow)
+                due++;
+
+            if (due)
+            {
+                _stats.drawn++;
+                _stats.skipped += due - 1;
+                _frames.erase(_frames.begin(), _frames.begin() + due);
+            }
+
+            _nextDraw += ((now - _nextDraw) / _drawInterval + 1) * _drawInterval;
+        }
+
+        void Add(const Frame & frame)
+        {
+            Draw();
+
+            if (frame.presentAt < system_clock::now())
+            {
+                _stats.late++;
+                return;
+            }
+
+            if (_frames.size() >= _capacity)
+            {
+                _frames.pop_front();
+                _stats.overflows++;
+            }
+
+            auto position = upper_bound(_frames.begin(), _frames.end(), frame.presentAt,
+                                        [](auto presentAt, const Frame & other) { return presentAt < other.presentAt; });
+            _frames.insert(position, frame);
+        }
+
+        void Clear()
+        {
+            _frames.clear();
+        }
+
+        // Response
+        //
+        // The device's answer to the frame with the given sequence number
+
+        DeviceResponse Response(uint64_t sequence, uint32_t fps)
+        {
+            Draw();
+
+            auto toSeconds = [](system_clock::time_point time) { return duration<double>(time.time_since_epoch()).count(); };
+
+            DeviceResponse response;
+            response.sequence = sequence;
+            response.currentClock = toSeconds(system_clock::now());
+            response.oldestPacket = _frames.empty() ? 0 : toSeconds(_frames.front().presentAt);
+            response.newestPacket = _frames.empty() ? 0 : toSeconds(_frames.back().presentAt);
+            response.bufferSize = static_cast<uint32_t>(_capacity);
+            response.bufferPos = static_cast<uint32_t>(_frames.size());
+            response.fpsDrawing = fps;
+            return response;
+        }
+    };
+}
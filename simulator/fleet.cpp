@@ -0,0 +1,929 @@
+#include <arpa/inet.h>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <optional>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h> // for getopt
+#include <unordered_map>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "device.h"
+#include "histogram.h"
+
+using namespace Simulator;
+using json = nlohmann::json;
+
+// ndsfleet
+//
+// Finds out where the server runs out of steam.  For each fleet size asked for, it writes a
+// config.led that spreads that many features over the canvases, starts ndscpp on it, and plays
+// every device itself: one thread with an epoll loop serves all the loopback ports, taking frames
+// and acknowledging each with a ClientResponse as a real device would.  After a warm-up it
+// measures for a while and prints a line with the server's CPU time per frame, the frame rates
+// the canvases actually achieve at the devices, the server's queue depths and latencies, and the
+// end-to-end latency from render to arrival.
+
+struct Options
+{
+    vector<size_t> featureCounts;
+    size_t         canvases = 10;
+    uint32_t       width = 144;
+    uint32_t       height = 1;
+    uint32_t       fps = 30;
+    uint32_t       clientBufferCount = 30;
+    uint16_t       firstPort = 20000;     // Below the ephemeral ports, which the server's own connections use
+    uint16_t       apiPort = 7777;
+    string         configFile = "fleet.led";
+    string         server = "./ndscpp";
+    seconds        warmUp{5};
+    seconds        measure{10};
+    bool           generateOnly = false;
+    bool           verbose = false;
+};
+
+static Options options;
+static atomic<bool> running{true};
+
+// Poller
+//
+// Readiness for a few thousand sockets: epoll on Linux, plain poll() elsewhere
+
+class Poller
+{
+#ifdef __linux__
+    int                         _epoll;
+    vector<epoll_event>         _ready;
+#else
+    vector<pollfd>              _fds;
+    unordered_map<int, size_t>  _indexes;
+#endif
+
+public:
+    struct Event
+    {
+        int  fd;
+        bool readable;
+        bool writable;
+        bool failed;
+    };
+
+#ifdef __linux__
+    Poller() : _epoll(epoll_create1(0)), _ready(1024)
+    {
+        if (_epoll < 0)
+            throw runtime_error("Can't create an epoll instance");
+    }
+
+    ~Poller()
+    {
+        close(_epoll);
+    }
+
+    void Add(int fd)
+    {
+        epoll_event event { EPOLLIN, { .fd = fd } };
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    void Modify(int fd, bool wantWrite)
+    {
+        epoll_event event { EPOLLIN | (wantWrite ? EPOLLOUT : 0u), { .fd = fd } };
+        epoll_ctl(_epoll, EPOLL_CTL_MOD, fd, &event);
+    }
+
+    void Remove(int fd)
+    {
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr);
+    }
+
+    void Wait(vector<Event> & events, int timeoutMs)
+    {
+        events.clear();
+        int count = epoll_wait(_epoll, _ready.data(), static_cast<int>(_ready.size()), timeoutMs);
+        for (int i = 0; i < count; i++)
+        {
+            auto flags = _ready[i].events;
+            events.push_back({ _ready[i].data.fd, (flags & EPOLLIN) != 0, (flags & EPOLLOUT) != 0, (flags & (EPOLLERR | EPOLLHUP)) != 0 });
+        }
+    }
+#else
+    void Add(int fd)
+    {
+        _indexes[fd] = _fds.size();
+        _fds.push_back({ fd, POLLIN, 0 });
+    }
+
+    void Modify(int fd, bool wantWrite)
+    {
+        _fds[_indexes[fd]].events = POLLIN | (wantWrite ? POLLOUT : 0);
+    }
+
+    void Remove(int fd)
+    {
+        auto found = _indexes.find(fd);
+        if (found == _indexes.end())
+            return;
+
+        _fds[found->second] = _fds.back();
+        _indexes[_fds.back().fd] = found->second;
+        _fds.pop_back();
+        _indexes.erase(fd);
+    }
+
+    void Wait(vector<Event> & events, int timeoutMs)
+    {
+        events.clear();
+        if (poll(_fds.data(), _fds.size(), timeoutMs) <= 0)
+            return;
+
+        for (const auto & entry : _fds)
+            if (entry.revents)
+                events.push_back({ entry.fd, (entry.revents & POLLIN) != 0, (entry.revents & POLLOUT) != 0, (entry.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0 });
+    }
+#endif
+};
+
+// SinkFleet
+//
+// All the simulated devices.  Feature i listens on firstPort + i.  Only the fleet's own thread
+// touches the sockets; the counters and the latency histogram are what other threads may read.
+
+class SinkFleet
+{
+    struct Connection
+    {
+        size_t                  feature;
+        FrameParser             parser;
+        unique_ptr<FrameBuffer> buffer;
+        uint64_t                sequence = 0;
+        vector<uint8_t>         unsent;
+        bool                    wantsWrite = false;
+    };
+
+    struct FeatureCounters
+    {
+        atomic<uint64_t> frames{0};
+        atomic<int64_t>  timeOffsetMicros{0};   // How far ahead of rendering frames are to be shown
+    };
+
+    Poller                              _poller;
+    unordered_map<int, size_t>          _listeners;         // Socket to feature
+    unordered_map<int, Connection>      _connections;
+    vector<FeatureCounters>             _features;
+    DeviceStats                         _stats;
+    atomic<size_t>                      _connected{0};
+    mutex                               _latencyMutex;
+    HistogramSnapshot                   _latency;           // End to end, under _latencyMutex
+    vector<uint8_t>                     _readBuffer = vector<uint8_t>(256 * 1024);
+    thread                              _thread;
+
+    static void SetNonBlocking(int fd)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    void Accept(int listener, size_t feature)
+    {
+        int fd;
+        while ((fd = accept(listener, nullptr, nullptr)) >= 0)
+        {
+            SetNonBlocking(fd);
+            int enable = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+            auto & connection = _connections[fd];
+            connection.feature = feature;
+            connection.buffer = make_unique<FrameBuffer>(options.clientBufferCount, options.fps, _stats);
+            _poller.Add(fd);
+
+            _stats.connections++;
+            _connected++;
+        }
+    }
+
+    void Drop(int fd)
+    {
+        _poller.Remove(fd);
+        close(fd);
+        _connections.erase(fd);
+
+        _stats.disconnects++;
+        _connected--;
+    }
+
+    void RecordLatency(microseconds latency)
+    {
+        uint64_t value = max<int64_t>(0, latency.count());
+
+        lock_guard lock(_latencyMutex);
+        _latency.counts[HistogramSnapshot::BucketFor(value)]++;
+        _latency.count++;
+        _latency.sum += value;
+        _latency.max = max(_latency.max, value);
+    }
+
+    // Returns false if the connection is gone
+
+    bool Flush(int fd, Connection & connection)
+    {
+        if (!connection.unsent.empty())
+        {
+            ssize_t sent = send(fd, connection.unsent.data(), connection.unsent.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            if (sent > 0)
+                connection.unsent.erase(connection.unsent.begin(), connection.unsent.begin() + sent);
+        }
+
+        bool wantsWrite = !connection.unsent.empty();
+        if (wantsWrite != connection.wantsWrite)
+        {
+            _poller.Modify(fd, wantsWrite);
+            connection.wantsWrite = wantsWrite;
+        }
+        return true;
+    }
+
+    // Returns false if the connection is gone or can't be trusted anymore
+
+    bool Read(int fd, Connection & connection)
+    {
+        auto & counters = _features[connection.feature];
+
+        for (;;)
+        {
+            ssize_t received = recv(fd, _readBuffer.data(), _readBuffer.size(), 0);
+            if (received == 0)
+                return false;
+            if (received < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+
+            _stats.bytes += received;
+
+            auto arrived = system_clock::now();
+            auto timeOffset = microseconds(counters.timeOffsetMicros.load(memory_order_relaxed));
+
+            string error;
+            bool valid = connection.parser.Feed(span<const uint8_t>(_readBuffer.data(), received), error, [&](const Frame & frame)
+            {
+                _stats.frames++;
+                counters.frames++;
+                RecordLatency(duration_cast<microseconds>(arrived - (frame.presentAt - timeOffset)));
+
+                connection.buffer->Add(frame);
+                auto response = connection.buffer->Response(++connection.sequence, options.fps);
+                auto bytes = reinterpret_cast<const uint8_t *>(&response);
+                connection.unsent.insert(connection.unsent.end(), bytes, bytes + sizeof(response));
+                _stats.responses++;
+            });
+
+            if (!valid)
+            {
+                _stats.invalid++;
+                fprintf(stderr, "Invalid frame on port %u: %s\n", options.firstPort + static_cast<unsigned>(connection.feature), error.c_str());
+                return false;
+            }
+
+            if (!Flush(fd, connection))
+                return false;
+        }
+    }
+
+    void Run()
+    {
+        vector<Poller::Event> events;
+
+        while (running)
+        {
+            _poller.Wait(events, 100);
+
+            for (const auto & event : events)
+            {
+                if (auto listener = _listeners.find(event.fd); listener != _listeners.end())
+                {
+                    Accept(event.fd, listener->second);
+                    continue;
+                }
+
+                auto found = _connections.find(event.fd);
+                if (found == _connections.end())
+                    continue;
+
+                auto & connection = found->second;
+                bool alive = !event.failed || event.readable;
+                if (alive && event.readable)
+                    alive = Read(event.fd, connection);
+                if (alive && event.writable)
+                    alive = Flush(event.fd, connection);
+                if (!alive)
+                    Drop(event.fd);
+            }
+        }
+
+        for (auto & [fd, connection] : _connections)
+            close(fd);
+        _connections.clear();
+    }
+
+public:
+    explicit SinkFleet(size_t featureCount) : _features(featureCount)
+    {
+        for (size_t feature = 0; feature < featureCount; feature++)
+        {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            int enable = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+            sockaddr_in address {};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            address.sin_port = htons(options.firstPort + feature);
+
+            if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(fd, 16) < 0)
+                throw runtime_error("Can't listen on port " + to_string(options.firstPort + feature) + ": " + strerror(errno));
+
+            SetNonBlocking(fd);
+            _poller.Add(fd);
+            _listeners[fd] = feature;
+        }
+    }
+
+    ~SinkFleet()
+    {
+        if (_thread.joinable())
+            _thread.join();
+
+        for (auto & [fd, feature] : _listeners)
+            close(fd);
+    }
+
+    void Start()
+    {
+        _thread = thread(&SinkFleet::Run, this);
+    }
+
+    void SetTimeOffset(size_t feature, double seconds)
+    {
+        _features[feature].timeOffsetMicros = static_cast<int64_t>(seconds * 1'000'000);
+    }
+
+    uint64_t Frames(size_t feature) const
+    {
+        return _features[feature].frames;
+    }
+
+    size_t Connected() const
+    {
+        return _connected;
+    }
+
+    const DeviceStats & Stats() const
+    {
+        return _stats;
+    }
+
+    // TakeLatency
+    //
+    // The end-to-end latencies recorded since the last call
+
+    HistogramSnapshot TakeLatency()
+    {
+        lock_guard lock(_latencyMutex);
+        return exchange(_latency, HistogramSnapshot {});
+    }
+};
+
+// FeatureRange
+//
+// The features that go on a canvas: as even a split as there can be, in port order
+
+pair<size_t, size_t> FeatureRange(size_t canvas, size_t canvases, size_t features)
+{
+    return { canvas * features / canvases, (canvas + 1) * features / canvases };
+}
+
+json MakeConfig(size_t canvases, size_t features)
+{
+    auto jsonCanvases = json::array();
+
+    for (size_t canvas = 0; canvas < canvases; canvas++)
+    {
+        auto [first, last] = FeatureRange(canvas, canvases, features);
+
+        auto jsonFeatures = json::array();
+        for (size_t feature = first; feature < last; feature++)
+        {
+            jsonFeatures.push_back({
+                {"hostName",          "127.0.0.1"},
+                {"friendlyName",      "Fleet " + to_string(feature)},
+                {"port",              options.firstPort + feature},
+                {"width",             options.width},
+                {"height",            options.height},
+                {"offsetX",           0},
+                {"offsetY",           (feature - first) * options.height},
+                {"reversed",          false},
+                {"channel",           0},
+                {"redGreenSwap",      false},
+                {"clientBufferCount", options.clientBufferCount}
+            });
+        }
+
+        jsonCanvases.push_back({
+            {"name",   "Fleet canvas " + to_string(canvas)},
+            {"width",  options.width},
+            {"height", (last - first) * options.height},
+            {"fps",    options.fps},
+            {"effectsManager", {
+                {"fps", options.fps},
+                {"currentEffectIndex", 0},
+                {"effects", json::array({ {{"type", "15ColorWaveEffect"}, {"name", "Color Wave"}} })}
+            }},
+            {"features", jsonFeatures}
+        });
+    }
+
+    return { {"port", options.apiPort}, {"canvases", jsonCanvases} };
+}
+
+// GetJson
+//
+// Just enough HTTP to read the server's API
+
+optional<json> GetJson(const string & path)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return nullopt;
+
+    timeval timeout { 30, 0 };      // A server under load can be slow to answer
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(options.apiPort);
+
+    string response;
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0)
+    {
+        string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+        if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size()))
+        {
+            char buffer[16384];
+            ssize_t received;
+            while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+                response.append(buffer, received);
+        }
+    }
+    close(fd);
+
+    auto body = response.find("\r\n\r\n");
+    if (response.compare(0, 12, "HTTP/1.1 200") != 0 || body == string::npos)
+        return nullopt;
+
+    auto parsed = json::parse(response.substr(body + 4), nullptr, false);
+    if (parsed.is_discarded())
+        return nullopt;
+    return parsed;
+}
+
+// ServerCpuTime
+//
+// User plus system time the server has used so far, where the system will tell us
+
+optional<duration<double>> ServerCpuTime(pid_t pid)
+{
+#ifdef __linux__
+    ifstream file("/proc/" + to_string(pid) + "/stat");
+    string stat((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+    // The fields after the parenthesized command name start with the state, field 3; user and
+    // system time are fields 14 and 15
+
+    auto end = stat.rfind(')');
+    if (end == string::npos)
+        return nullopt;
+
+    istringstream fields(stat.substr(end + 1));
+    string field;
+    for (int index = 3; index < 14 && fields >> field; index++)
+        ;
+
+    unsigned long long user = 0, system = 0;
+    if (!(fields >> user >> system))
+        return nullopt;
+    return duration<double>(static_cast<double>(user + system) / sysconf(_SC_CLK_TCK));
+#else
+    (void)pid;
+    return nullopt;
+#endif
+}
+
+pid_t StartServer()
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int log = open((options.configFile + ".log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log >= 0)
+        {
+            dup2(log, STDOUT_FILENO);
+            dup2(log, STDERR_FILENO);
+        }
+        string port = to_string(options.apiPort);
+        execl(options.server.c_str(), options.server.c_str(), "-c", options.configFile.c_str(), "-p", port.c_str(), nullptr);
+        _exit(127);
+    }
+    return pid;
+}
+
+void StopServer(pid_t pid)
+{
+    kill(pid, SIGINT);
+    for (int tries = 0; tries < 50; tries++)
+    {
+        if (waitpid(pid, nullptr, WNOHANG) == pid)
+            return;
+        this_thread::sleep_for(100ms);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+}
+
+// Sleep
+//
+// Like sleep_for, but gives up early on Ctrl-C
+
+bool Sleep(seconds duration)
+{
+    auto until = steady_clock::now() + duration;
+    while (running && steady_clock::now() < until)
+        this_thread::sleep_for(50ms);
+    return running;
+}
+
+// SocketSample
+//
+// What the server says about the fleet's sockets
+
+struct SocketSample
+{
+    double   meanQueueDepth = 0;
+    uint64_t maxQueueDepth = 0;
+    uint64_t droppedFrames = 0;
+    uint64_t reconnects = 0;
+    double   queueWaitP50 = 0;      // Means of the sockets' medians, and the worst of their p99s
+    uint64_t queueWaitP99 = 0;
+    double   rttP50 = 0;
+    uint64_t rttP99 = 0;
+};
+
+SocketSample SampleSockets(size_t features)
+{
+    SocketSample sample;
+    auto sockets = GetJson("/api/sockets");
+    if (!sockets)
+        return sample;
+
+    size_t count = 0;
+    for (const auto & socket : sockets->value("sockets", json::array()))
+    {
+        auto port = socket.value("port", 0u);
+        if (port < options.firstPort || port >= options.firstPort + features)
+            continue;
+
+        count++;
+        uint64_t depth = socket.value("queueDepth", uint64_t(0));
+        sample.meanQueueDepth += depth;
+        sample.maxQueueDepth = max(sample.maxQueueDepth, depth);
+        sample.droppedFrames += socket["droppedFrames"].value("total", uint64_t(0));
+        sample.reconnects += socket.value("reconnectCount", uint64_t(0));
+
+        const auto & latency = socket["latency"];
+        sample.queueWaitP50 += latency["queueWaitUs"].value("p50", uint64_t(0));
+        sample.queueWaitP99 = max(sample.queueWaitP99, latency["queueWaitUs"].value("p99", uint64_t(0)));
+        sample.rttP50 += latency["rttUs"].value("p50", uint64_t(0));
+        sample.rttP99 = max(sample.rttP99, latency["rttUs"].value("p99", uint64_t(0)));
+    }
+
+    if (count)
+    {
+        sample.meanQueueDepth /= count;
+        sample.queueWaitP50 /= count;
+        sample.rttP50 /= count;
+    }
+    return sample;
+}
+
+// RunStep
+//
+// Measures one fleet size and prints its line.  Returns false if the run should stop.
+
+bool RunStep(SinkFleet & fleet, size_t features)
+{
+    size_t canvases = min(options.canvases, features);
+    {
+        ofstream file(options.configFile);
+        file << MakeConfig(canvases, features).dump(4);
+    }
+
+    pid_t server = StartServer();
+    if (server < 0)
+    {
+        fprintf(stderr, "Error: Can't start %s\n", options.server.c_str());
+        return false;
+    }
+
+    // Wait for the API to come up, then learn how far ahead of rendering each feature's frames
+    // are stamped, so arrival times can be turned into end-to-end latencies
+
+    optional<json> jsonCanvases;
+    for (int tries = 0; running && !jsonCanvases && tries < 100; tries++)
+    {
+        if (waitpid(server, nullptr, WNOHANG) == server)
+        {
+            fprintf(stderr, "Error: The server exited, see %s.log\n", options.configFile.c_str());
+            return false;
+        }
+        this_thread::sleep_for(100ms);
+        jsonCanvases = GetJson("/api/canvases");
+    }
+
+    if (!jsonCanvases)
+    {
+        fprintf(stderr, "Error: The server's API didn't come up on port %u\n", options.apiPort);
+        StopServer(server);
+        return false;
+    }
+
+    for (const auto & canvas : *jsonCanvases)
+        for (const auto & feature : canvas.value("features", json::array()))
+        {
+            auto port = feature.value("port", 0u);
+            if (port >= options.firstPort && port < options.firstPort + features)
+                fleet.SetTimeOffset(port - options.firstPort, feature.value("timeOffset", 0.0));
+        }
+
+    // The server paces its connection attempts, so a big fleet takes a while to come up
+
+    auto connectDeadline = steady_clock::now() + seconds(30 + features / 5);
+    while (running && fleet.Connected() < features && steady_clock::now() < connectDeadline)
+        this_thread::sleep_for(50ms);
+
+    if (!Sleep(options.warmUp))
+    {
+        StopServer(server);
+        return false;
+    }
+
+    // Measure
+
+    auto Frames = [&]
+    {
+        vector<uint64_t> frames(features);
+        for (size_t feature = 0; feature < features; feature++)
+            frames[feature] = fleet.Frames(feature);
+        return frames;
+    };
+
+    auto startFrames = Frames();
+    auto startCpu = ServerCpuTime(server);
+    auto startSockets = SampleSockets(features);
+    uint64_t startLate = fleet.Stats().late;
+    auto start = steady_clock::now();
+    fleet.TakeLatency();
+
+    bool completed = Sleep(options.measure);
+
+    auto elapsed = duration<double>(steady_clock::now() - start).count();
+    auto endFrames = Frames();
+    auto endCpu = ServerCpuTime(server);
+    auto sockets = SampleSockets(features);
+    uint64_t late = fleet.Stats().late - startLate;
+    auto latency = fleet.TakeLatency();
+    size_t connected = fleet.Connected();
+
+    StopServer(server);
+
+    // Frame rates as the devices saw them
+
+    uint64_t frames = 0;
+    vector<double> canvasFps(canvases);
+    for (size_t canvas = 0; canvas < canvases; canvas++)
+    {
+        auto [first, last] = FeatureRange(canvas, canvases, features);
+        uint64_t canvasFrames = 0;
+        for (size_t feature = first; feature < last; feature++)
+            canvasFrames += endFrames[feature] - startFrames[feature];
+
+        frames += canvasFrames;
+        canvasFps[canvas] = canvasFrames / elapsed / (last - first);
+    }
+
+    double meanFps = 0;
+    for (auto fps : canvasFps)
+        meanFps += fps / canvases;
+
+    string cpu = "     n/a", cpuPerFrame = "     n/a";
+    if (startCpu && endCpu)
+    {
+        auto used = (*endCpu - *startCpu).count();
+        char text[32];
+        snprintf(text, sizeof(text), "%7.1f%%", 100 * used / elapsed);
+        cpu = text;
+        snprintf(text, sizeof(text), "%8.1f", frames ? used * 1'000'000 / frames : 0.0);
+        cpuPerFrame = text;
+    }
+
+    auto ms = [](double micros) { return micros / 1000; };
+
+    printf("%8zu %8zu %9zu %s %s %9.0f %6.1f %6.1f %6.1f %6.2f %7.1f %6llu %7llu %6llu %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f\n",
+           features, canvases, connected, cpu.c_str(), cpuPerFrame.c_str(), frames / elapsed,
+           *min_element(canvasFps.begin(), canvasFps.end()), meanFps, *max_element(canvasFps.begin(), canvasFps.end()),
+           frames ? 100.0 * late / frames : 0.0,
+           sockets.meanQueueDepth, static_cast<unsigned long long>(sockets.maxQueueDepth),
+           static_cast<unsigned long long>(sockets.droppedFrames - min(sockets.droppedFrames, startSockets.droppedFrames)),
+           static_cast<unsigned long long>(sockets.reconnects - min(sockets.reconnects, startSockets.reconnects)),
+           ms(sockets.queueWaitP50), ms(sockets.queueWaitP99), ms(sockets.rttP50), ms(sockets.rttP99),
+           ms(latency.Percentile(50)), ms(latency.Percentile(99)), ms(latency.max));
+
+    if (options.verbose)
+        for (size_t canvas = 0; canvas < canvases; canvas++)
+            printf("    canvas %zu: %.1f fps\n", canvas, canvasFps[canvas]);
+
+    fflush(stdout);
+
+    // Let the fleet see the server's connections go before the next step
+
+    for (int tries = 0; fleet.Connected() && tries < 50; tries++)
+        this_thread::sleep_for(100ms);
+
+    return completed;
+}
+
+void print_usage(const char *program_name)
+{
+    fprintf(stderr, "Usage: %s [-m features[,features...]] [-n canvases] [options]\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -m <features>  Fleet sizes to measure, like 10,100,1000 (default: 100)\n");
+    fprintf(stderr, "  -n <canvases>  Canvases to spread the features over (default: 10)\n");
+    fprintf(stderr, "  -g <WxH>       Size of every feature (default: 144x1)\n");
+    fprintf(stderr, "  -f <fps>       Frame rate of every canvas (default: 30)\n");
+    fprintf(stderr, "  -b <frames>    Client buffer size of every feature (default: 30)\n");
+    fprintf(stderr, "  -P <port>      First of the loopback ports the devices listen on (default: 20000)\n");
+    fprintf(stderr, "  -a <port>      Port for the server's API (default: 7777)\n");
+    fprintf(stderr, "  -c <file>      Configuration file to write (default: fleet.led)\n");
+    fprintf(stderr, "  -s <path>      Server to run (default: ./ndscpp)\n");
+    fprintf(stderr, "  -w <seconds>   Warm-up before measuring (default: 5)\n");
+    fprintf(stderr, "  -t <seconds>   How long to measure each fleet size (default: 10)\n");
+    fprintf(stderr, "  -G             Only write the configuration for the first fleet size\n");
+    fprintf(stderr, "  -v             Also print every canvas's frame rate\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    // Parse command line options
+    while ((opt = getopt(argc, argv, "m:n:g:f:b:P:a:c:s:w:t:Gvh")) != -1)
+    {
+        try
+        {
+            switch (opt)
+            {
+            case 'm':
+            {
+                options.featureCounts.clear();
+                stringstream list(optarg);
+                string count;
+                while (getline(list, count, ','))
+                    options.featureCounts.push_back(stoul(count));
+                break;
+            }
+            case 'n':
+                options.canvases = stoul(optarg);
+                break;
+            case 'g':
+            {
+                string geometry = optarg;
+                auto x = geometry.find('x');
+                options.width = stoul(geometry.substr(0, x));
+                options.height = x == string::npos ? 1 : stoul(geometry.substr(x + 1));
+                break;
+            }
+            case 'f':
+                options.fps = stoul(optarg);
+                break;
+            case 'b':
+                options.clientBufferCount = stoul(optarg);
+                break;
+            case 'P':
+                options.firstPort = static_cast<uint16_t>(stoul(optarg));
+                break;
+            case 'a':
+                options.apiPort = static_cast<uint16_t>(stoul(optarg));
+                break;
+            case 'c':
+                options.configFile = optarg;
+                break;
+            case 's':
+                options.server = optarg;
+                break;
+            case 'w':
+                options.warmUp = seconds(stoul(optarg));
+                break;
+            case 't':
+                options.measure = seconds(stoul(optarg));
+                break;
+            case 'G':
+                options.generateOnly = true;
+                break;
+            case 'v':
+                options.verbose = true;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        catch (const exception &)
+        {
+            fprintf(stderr, "Error: Invalid value for -%c\n", opt);
+            exit(1);
+        }
+    }
+
+    if (options.featureCounts.empty())
+        options.featureCounts.push_back(100);
+
+    size_t maxFeatures = *max_element(options.featureCounts.begin(), options.featureCounts.end());
+    size_t minFeatures = *min_element(options.featureCounts.begin(), options.featureCounts.end());
+    if (!minFeatures || !options.canvases || !options.fps || !options.clientBufferCount || !options.width || !options.height ||
+        options.measure.count() == 0 || options.firstPort + maxFeatures > 65536)
+    {
+        fprintf(stderr, "Error: Every count, size and duration must be positive, and the ports must fit below 65536\n");
+        exit(1);
+    }
+
+    if (options.generateOnly)
+    {
+        ofstream(options.configFile) << MakeConfig(min(options.canvases, options.featureCounts.front()), options.featureCounts.front()).dump(4);
+        return 0;
+    }
+
+    // Every feature takes a listening socket and a connection
+
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    signal(SIGINT, [](int) { running = false; });
+    signal(SIGTERM, [](int) { running = false; });
+    signal(SIGPIPE, SIG_IGN);
+
+    try
+    {
+        SinkFleet fleet(maxFeatures);
+        fleet.Start();
+
+        printf("%8s %8s %9s %8s %8s %9s %6s %6s %6s %6s %7s %6s %7s %6s %7s %7s %7s %7s %7s %7s %7s\n",
+               "features", "canvases", "connected", "cpu", "us/frame", "frames/s", "minFps", "fps", "maxFps", "late%",
+               "queue", "maxQ", "dropped", "reconn", "waitP50", "waitP99", "rttP50", "rttP99", "e2eP50", "e2eP99", "e2eMax");
+        fflush(stdout);
+
+        for (auto features : options.featureCounts)
+            if (!RunStep(fleet, features))
+                break;
+
+        running = false;
+    }
+    catch (const exception & e)
+    {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
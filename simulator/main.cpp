@@ -0,0 +1,467 @@
+#include <arpa/inet.h>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h> // for getopt
+
+#include "device.h"
+
+using namespace Simulator;
+
+// Options
+//
+// How every simulated device behaves
+
+struct Options
+{
+    vector<uint16_t> ports;
+    double           fps = 30.0;
+    size_t           bufferFrames = 100;
+    milliseconds     latency{0};            // Added before each response goes out
+    double           bytesPerSecond = 0;    // Read rate cap, 0 for none
+    seconds          disconnectEvery{0};    // Drop each connection after this long, 0 for never
+    seconds          offlineFor{5};         // And stay unreachable for this long afterwards
+    bool             verbose = false;
+};
+
+static Options options;
+static DeviceStats stats;
+static atomic<bool> running{true};
+static atomic<size_t> activeConnections{0};
+
+// Port
+//
+// One simulated device, listening for TCP and UDP on the same port.  While it's "offline" after
+// a dropped connection it closes its listening socket, so connection attempts are refused just as
+// they would be while a real device reboots.
+
+struct Port
+{
+    uint16_t                    number;
+    atomic<steady_clock::rep>   offlineUntil{0};
+
+    explicit Port(uint16_t port) : number(port)
+    {
+    }
+
+    bool IsOffline() const
+    {
+        return steady_clock::now().time_since_epoch().count() < offlineUntil.load();
+    }
+
+    void GoOffline()
+    {
+        offlineUntil = (steady_clock::now() + options.offlineFor).time_since_epoch().count();
+    }
+};
+
+void print_usage(const char *program_name)
+{
+    fprintf(stderr, "Usage: %s [-p port[-last]]... [-f fps] [-b frames] [-l ms] [-r bytes/sec] [-d seconds] [-o seconds] [-v]\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -p <port>      Port to listen on for TCP and UDP, or a range like 49152-49251 (default: 49152)\n");
+    fprintf(stderr, "  -f <fps>       Rate the device draws at (default: 30)\n");
+    fprintf(stderr, "  -b <frames>    Size of the device's frame buffer (default: 100)\n");
+    fprintf(stderr, "  -l <ms>        Latency added to every response (default: 0)\n");
+    fprintf(stderr, "  -r <bytes/sec> Cap on how fast each connection is read (default: none)\n");
+    fprintf(stderr, "  -d <seconds>   Drop every connection after this long (default: never)\n");
+    fprintf(stderr, "  -o <seconds>   Refuse connections for this long after dropping one (default: 5)\n");
+    fprintf(stderr, "  -v             Log connections and invalid frames\n");
+}
+
+// ParsePorts
+//
+// Adds a port, or an inclusive range of them, to the list
+
+bool ParsePorts(const string & arg, vector<uint16_t> & ports)
+{
+    try
+    {
+        auto dash = arg.find('-');
+        int first = stoi(arg.substr(0, dash));
+        int last = dash == string::npos ? first : stoi(arg.substr(dash + 1));
+        if (first <= 0 || last > 65535 || last < first)
+            return false;
+        for (int port = first; port <= last; port++)
+            ports.push_back(static_cast<uint16_t>(port));
+        return true;
+    }
+    catch (const exception &)
+    {
+        return false;
+    }
+}
+
+int Listen(uint16_t port, int type)
+{
+    int fd = socket(AF_INET, type, 0);
+    if (fd < 0)
+        return -1;
+
+    int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || (type == SOCK_STREAM && listen(fd, 4) < 0))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void SendResponse(int fd, const DeviceResponse & response)
+{
+    if (send(fd, &response, sizeof(response), MSG_NOSIGNAL) == sizeof(response))
+        stats.responses++;
+}
+
+// ServeConnection
+//
+// Plays the device for one server connection: reads frames (no faster than the rate cap allows,
+// so the server sees real backpressure), buffers and draws them, and answers each one, after the
+// injected latency if there is one, until the server hangs up or it's time to drop the line.
+
+void ServeConnection(int fd, Port & port)
+{
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    FrameParser parser;
+    FrameBuffer buffer(options.bufferFrames, options.fps, stats);
+    deque<pair<steady_clock::time_point, DeviceResponse>> delayed;
+    uint64_t sequence = 0;
+    vector<uint8_t> readBuffer(64 * 1024);
+
+    auto connected = steady_clock::now();
+    auto lastRefill = connected;
+    double tokens = options.bytesPerSecond / 10;
+
+    while (running)
+    {
+        auto now = steady_clock::now();
+
+        if (options.disconnectEvery.count() && now - connected >= options.disconnectEvery)
+        {
+            if (options.verbose)
+                fprintf(stderr, "Dropping the connection on port %u\n", port.number);
+            port.GoOffline();
+            break;
+        }
+
+        while (!delayed.empty() && delayed.front().first <= now)
+        {
+            SendResponse(fd, delayed.front().second);
+            delayed.pop_front();
+        }
+
+        // Refill the token bucket, which holds at most a tenth of a second's worth
+
+        if (options.bytesPerSecond > 0)
+        {
+            tokens = min(options.bytesPerSecond / 10, tokens + options.bytesPerSecond * duration<double>(now - lastRefill).count());
+            lastRefill = now;
+        }
+
+        bool canRead = options.bytesPerSecond <= 0 || tokens >= 1;
+        int timeout = 10;
+        if (!delayed.empty())
+            timeout = clamp(static_cast<int>(duration_cast<milliseconds>(delayed.front().first - now).count()), 0, timeout);
+
+        pollfd poller { fd, static_cast<short>(canRead ? POLLIN : 0), 0 };
+        if (poll(&poller, 1, timeout) < 0 && errno != EINTR)
+            break;
+
+        buffer.Draw();
+
+        if (!(poller.revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        size_t wanted = readBuffer.size();
+        if (options.bytesPerSecond > 0)
+            wanted = min(wanted, static_cast<size_t>(tokens));
+
+        ssize_t received = recv(fd, readBuffer.data(), wanted, 0);
+        if (received <= 0)
+            break;
+
+        tokens -= received;
+        stats.bytes += received;
+
+        string error;
+        bool valid = parser.Feed(span<const uint8_t>(readBuffer.data(), received), error, [&](const Frame & frame)
+        {
+            stats.frames++;
+            buffer.Add(frame);
+
+            auto response = buffer.Response(++sequence, static_cast<uint32_t>(options.fps));
+            if (options.latency.count())
+                delayed.emplace_back(steady_clock::now() + options.latency, response);
+            else
+                SendResponse(fd, response);
+        });
+
+        if (!valid)
+        {
+            stats.invalid++;
+            fprintf(stderr, "Invalid frame on port %u after %llu good ones: %s\n", port.number, static_cast<unsigned long long>(sequence), error.c_str());
+            break;
+        }
+    }
+
+    if (options.verbose)
+        fprintf(stderr, "Connection on port %u closed after %llu frames\n", port.number, static_cast<unsigned long long>(sequence));
+
+    close(fd);
+    stats.disconnects++;
+    activeConnections--;
+}
+
+// ServeTcp
+//
+// Accepts connections on a port for as long as it's online
+
+void ServeTcp(Port & port)
+{
+    int listener = -1;
+
+    while (running)
+    {
+        if (port.IsOffline())
+        {
+            if (listener >= 0)
+                close(listener);
+            listener = -1;
+            this_thread::sleep_for(100ms);
+            continue;
+        }
+
+        if (listener < 0 && (listener = Listen(port.number, SOCK_STREAM)) < 0)
+        {
+            fprintf(stderr, "Can't listen on TCP port %u\n", port.number);
+            this_thread::sleep_for(1s);
+            continue;
+        }
+
+        pollfd poller { listener, POLLIN, 0 };
+        if (poll(&poller, 1, 100) <= 0)
+            continue;
+
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+
+        if (options.verbose)
+            fprintf(stderr, "Connection on port %u\n", port.number);
+
+        stats.connections++;
+        activeConnections++;
+        thread(ServeConnection, fd, ref(port)).detach();
+    }
+
+    if (listener >= 0)
+        close(listener);
+}
+
+// ServeUdp
+//
+// Takes frames as datagrams, each behind a header with its sequence number, and answers to
+// whichever port they came from.  Every sender gets a frame buffer of its own.
+
+void ServeUdp(Port & port)
+{
+    int fd = Listen(port.number, SOCK_DGRAM);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Can't listen on UDP port %u\n", port.number);
+        return;
+    }
+
+    FrameParser parser;
+    map<pair<uint32_t, uint16_t>, unique_ptr<FrameBuffer>> buffers;
+    vector<uint8_t> datagram(64 * 1024);
+
+    while (running)
+    {
+        pollfd poller { fd, POLLIN, 0 };
+        int ready = poll(&poller, 1, 10);
+
+        for (auto & [sender, buffer] : buffers)
+            buffer->Draw();
+
+        if (ready <= 0)
+            continue;
+
+        sockaddr_in sender {};
+        socklen_t senderLength = sizeof(sender);
+        ssize_t received = recvfrom(fd, datagram.data(), datagram.size(), 0, reinterpret_cast<sockaddr *>(&sender), &senderLength);
+        if (received <= 0 || port.IsOffline())
+            continue;
+
+        stats.bytes += received;
+
+        Frame frame;
+        uint32_t sequence = 0;
+        string error;
+        if (parser.ParseDatagram(span<const uint8_t>(datagram.data(), received), frame, sequence, error) != ParseResult::Frame)
+        {
+            stats.invalid++;
+            if (options.verbose)
+                fprintf(stderr, "Invalid datagram on port %u: %s\n", port.number, error.c_str());
+            continue;
+        }
+
+        auto & buffer = buffers[{ sender.sin_addr.s_addr, sender.sin_port }];
+        if (!buffer)
+            buffer = make_unique<FrameBuffer>(options.bufferFrames, options.fps, stats);
+
+        stats.frames++;
+        buffer->Add(frame);
+
+        // Latency here would hold up every other sender, so it's only applied on TCP
+
+        auto response = buffer->Response(sequence, static_cast<uint32_t>(options.fps));
+        if (sendto(fd, &response, sizeof(response), 0, reinterpret_cast<sockaddr *>(&sender), senderLength) == sizeof(response))
+            stats.responses++;
+    }
+
+    close(fd);
+}
+
+// Report
+//
+// Prints a line of per-second rates and totals
+
+void Report()
+{
+    uint64_t lastFrames = 0, lastBytes = 0;
+
+    while (running)
+    {
+        this_thread::sleep_for(1s);
+
+        uint64_t frames = stats.frames, bytes = stats.bytes;
+        printf("connected %zu  frames/s %llu  KB/s %.1f  drawn %llu  skipped %llu  late %llu  overflowed %llu  invalid %llu  responses %llu  drops %llu\n",
+               activeConnections.load(),
+               static_cast<unsigned long long>(frames - lastFrames),
+               (bytes - lastBytes) / 1024.0,
+               static_cast<unsigned long long>(stats.drawn.load()),
+               static_cast<unsigned long long>(stats.skipped.load()),
+               static_cast<unsigned long long>(stats.late.load()),
+               static_cast<unsigned long long>(stats.overflows.load()),
+               static_cast<unsigned long long>(stats.invalid.load()),
+               static_cast<unsigned long long>(stats.responses.load()),
+               static_cast<unsigned long long>(stats.disconnects.load()));
+        fflush(stdout);
+
+        lastFrames = frames;
+        lastBytes = bytes;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    // Parse command line options
+    while ((opt = getopt(argc, argv, "p:f:b:l:r:d:o:vh")) != -1)
+    {
+        try
+        {
+            switch (opt)
+            {
+            case 'p':
+                if (!ParsePorts(optarg, options.ports))
+                {
+                    fprintf(stderr, "Error: Invalid port or port range %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'f':
+                options.fps = stod(optarg);
+                if (options.fps <= 0.0)
+                {
+                    fprintf(stderr, "Error: FPS must be greater than 0\n");
+                    exit(1);
+                }
+                break;
+            case 'b':
+                options.bufferFrames = stoul(optarg);
+                if (options.bufferFrames == 0)
+                {
+                    fprintf(stderr, "Error: The buffer must hold at least one frame\n");
+                    exit(1);
+                }
+                break;
+            case 'l':
+                options.latency = milliseconds(stoul(optarg));
+                break;
+            case 'r':
+                options.bytesPerSecond = stod(optarg);
+                break;
+            case 'd':
+                options.disconnectEvery = seconds(stoul(optarg));
+                break;
+            case 'o':
+                options.offlineFor = seconds(stoul(optarg));
+                break;
+            case 'v':
+                options.verbose = true;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        catch (const exception &)
+        {
+            fprintf(stderr, "Error: Invalid value for -%c\n", opt);
+            exit(1);
+        }
+    }
+
+    if (options.ports.empty())
+        options.ports.push_back(49152);
+
+    signal(SIGINT, [](int) { running = false; });
+    signal(SIGTERM, [](int) { running = false; });
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "Simulating %zu device(s) on ports %u-%u at %.1f fps with %zu-frame buffers\n",
+            options.ports.size(), options.ports.front(), options.ports.back(), options.fps, options.bufferFrames);
+
+    vector<unique_ptr<Port>> ports;
+    vector<thread> threads;
+    for (auto number : options.ports)
+    {
+        auto & port = *ports.emplace_back(make_unique<Port>(number));
+        threads.emplace_back(ServeTcp, ref(port));
+        threads.emplace_back(ServeUdp, ref(port));
+    }
+    threads.emplace_back(Report);
+
+    for (auto & thread : threads)
+        thread.join();
+
+    // Connection threads notice within one poll timeout
+
+    while (activeConnections)
+        this_thread::sleep_for(10ms);
+
+    return 0;
+}
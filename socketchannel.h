@@ -2,315 +2,281 @@
 using namespace std;
 
 #include <iostream>
-#include <bit>
 #include <string>
 #include <vector>
+#include <deque>
 #include <atomic>
 #include <chrono>
 #include <mutex>
-#include <queue>
-#include <thread>
+#include <future>
+#include <array>
+#include <span>
 #include <stdexcept>
 #include <cstdint>
 #include <cstring>
-#include <netinet/in.h>
-#include <netinet/tcp.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-#include <poll.h>
-#include <fcntl.h>
-#include <cerrno>
 #include "json.hpp"
 #include "global.h"
 #include "interfaces.h"
 #include "utilities.h"
 #include "pixeltypes.h"
+#include "overflowpolicy.h"
+#include "transport.h"
+#include "socketconnection.h"
 
-// How long to wait for a connection to be established or data sent
+// SocketChannel
+//
+// The output of one feature to a NightDriverStrip client.  Keeps a queue of frames, written only
+// by the render thread of the canvas that owns the feature, and hands them to the
+// SocketConnection it shares with every other channel for the same client, which sends them in
+// batches over TCP or, if the feature asks for it, as UDP datagrams (see datagram.h).  The queue
+// is a FrameRing that the connection reads on its strand.  The channel keeps its own overflow
+// policy and drop counts, its own grace period for frames that reach the front of the queue
+// after their presentation time, and its transport profile, whose queue limits are its own and
+// whose other settings it hands to the connection; the connection state, send stats and client
+// responses it reports are the connection's.
+
+class SocketChannel : public ISocketChannel, public enable_shared_from_this<SocketChannel>
+{
+public:
+    static constexpr milliseconds kDefaultStaleFrameGrace = 100ms;     // Allows for some clock skew between us and the client
 
-constexpr auto kConnectTimeout = 3000ms; 
-constexpr auto kSendTimeout    = 2000ms;
+private:
+    static constexpr uint16_t CommandPixelData = 3;
+    static constexpr double kDropOldestRatio = 0.9;                     // DropOldest trims the queue to this fraction of the limits
 
-// SpeedTracker
-// 
-// A class that tracks the speed of data transfer over a given time window.  It is used to
-// calculate the bytes per second that are being sent to the client.  The class uses a
-// weighted average to smooth out the data and provide a more accurate representation of
-// the speed.
+    string _hostName;
+    string _friendlyName;
+    uint16_t _port;
 
-class SpeedTracker
-{
-private:
-    static constexpr milliseconds kSpeedWindowMS{3000}; // 3 second window
-    static constexpr double kPreviousWindowWeight{0.3}; // Weight for previous window in average
+    static atomic<uint32_t> _nextId;
+    uint32_t _id;
+    const OverflowPolicy _overflowPolicy;
+    const ChannelProtocol _protocol;
+
+    atomic<bool> _running;
+    atomic<bool> _overflowPending;              // Set by the producer when the queue overflows
+
+    shared_ptr<SocketConnection> _connection;
+    shared_ptr<ChannelQueue> _queue;            // Consumed on the connection's strand
+    FrameRing& _frameRing;                      // _queue->ring
+
+    array<atomic<uint64_t>, 4> _droppedFrames{};  // Indexed by OverflowPolicy::Mode
+
+    mutable mutex    _transportMutex;
+    TransportProfile _transport;                // Guarded by _transportMutex
+    atomic<size_t>   _maxQueueFrames;
+    atomic<size_t>   _overflowBytes;            // Ring usage at which the overflow policy kicks in
+    shared_ptr<QueueBudget::Account> _budgetAccount;    // Our share of the process-wide queue budget
+
+    // The ring is sized when the channel is created, so a profile can shrink the queue later but
+    // not grow it past that.  That only reserves address space: the ring's wrap limit keeps it to
+    // what the queue may use right now (see RingLimit).
+
+    static size_t RingCapacity(const TransportProfile& transport)
+    {
+        return max(transport.maxQueueBytes, TransportProfile::kDefaultMaxQueueBytes);
+    }
+
+    // Leaves headroom for frames that arrive while the overflow policy runs
+
+    size_t OverflowBytes(const TransportProfile& transport) const
+    {
+        return min(transport.maxQueueBytes, _frameRing.Capacity()) / 4 * 3;
+    }
+
+    // Ring usage the queue has to stay under: our own limit or our share of the budget
+
+    size_t ByteLimit() const
+    {
+        return min(_overflowBytes.load(memory_order_relaxed), _budgetAccount->limit.load(memory_order_relaxed));
+    }
+
+    // How much of the ring the producer may use, which is the byte limit plus the same headroom
+    // that OverflowBytes leaves, so the ring only ever takes up memory in line with our share
 
-    uint64_t _currentWindowBytes{0};
-    uint64_t _previousWindowBytes{0};
-    system_clock::time_point _windowStartTime;
+    size_t RingLimit() const
+    {
+        return ByteLimit() / 3 * 4;
+    }
 
 public:
-    SpeedTracker() : _windowStartTime(system_clock::now()) {}
+    SocketChannel(const string& hostName,
+                  const string& friendlyName,
+                  uint16_t port = 49152,
+                  uint32_t clientBufferCount = 8,
+                  OverflowPolicy overflowPolicy = {},
+                  ChannelProtocol protocol = ChannelProtocol::Tcp,
+                  milliseconds staleFrameGrace = kDefaultStaleFrameGrace,
+                  const TransportProfile& transport = {})
+        : _hostName(hostName),
+          _friendlyName(friendlyName),
+          _port(port),
+          _id(_nextId++),
+          _overflowPolicy(overflowPolicy),
+          _protocol(protocol),
+          _running(false),
+          _overflowPending(false),
+          _connection(SocketConnection::Acquire(hostName, port, protocol, clientBufferCount)),
+          _queue(make_shared<ChannelQueue>(RingCapacity(transport), staleFrameGrace)),
+          _frameRing(_queue->ring),
+          _transport(transport),
+          _maxQueueFrames(transport.maxQueueFrames),
+          _overflowBytes(OverflowBytes(transport)),
+          _budgetAccount(SocketReactor::Instance().Budget().Open([queue = _queue]() { return queue->ring.UsedBytes(); }))
+    {
+    }
 
-    void AddBytes(uint64_t bytes)
+    ~SocketChannel() override
     {
-        // Check for overflow before adding.  No idea if overflow is a practical
-        // concern, but I'd feel weird not checking.
+        // Handlers only ever hold on to the queue, not to us, so there's nothing to wait for;
+        // the connection just has to stop sending from the queue
 
-        if (_currentWindowBytes <= (numeric_limits<uint64_t>::max() - bytes))
-            _currentWindowBytes += bytes;
-        else
-            _currentWindowBytes = numeric_limits<uint64_t>::max();
+        if (_running)
+            asio::post(_connection->Strand(), [connection = _connection, queue = _queue]() { connection->Detach(queue); });
     }
 
-    uint64_t UpdateBytesPerSecond()
+    uint32_t Id() const override
     {
-        auto now = system_clock::now();
-        auto elapsed = duration_cast<milliseconds>(now - _windowStartTime);
+        return _id;
+    }
 
-        // If we haven't completed a window yet, calculate based on partial window
-        if (elapsed < kSpeedWindowMS)
-        {
-            if (elapsed.count() == 0)
-                return 0; // Avoid division by zero
+    size_t GetCurrentQueueDepth() const override
+    {
+        return _frameRing.FrameCount();
+    }
 
-            // Scale up partial window to full second
-            double currentRate = (_currentWindowBytes * 1000.0) / elapsed.count();
+    size_t GetQueuedBytes() const override
+    {
+        return _frameRing.QueuedBytes();
+    }
 
-            // Blend with previous window data
-            double previousRate = (_previousWindowBytes * 1000.0) / kSpeedWindowMS.count();
-            return static_cast<uint64_t>(
-                (currentRate * (1.0 - kPreviousWindowWeight)) +
-                (previousRate * kPreviousWindowWeight));
-        }
+    size_t GetQueueMaxSize() const override
+    {
+        return _maxQueueFrames;
+    }
 
-        // Window complete - rotate windows
-        _previousWindowBytes = _currentWindowBytes;
-        _currentWindowBytes = 0;
-        _windowStartTime = now;
+    size_t GetQueueBudget() const override
+    {
+        return _budgetAccount->limit;
+    }
 
-        // Calculate blended rate
-        double previousRate = (_previousWindowBytes * 1000.0) / kSpeedWindowMS.count();
-        return static_cast<uint64_t>(previousRate);
+    size_t GetQueueResidentBytes() const override
+    {
+        return _frameRing.ResidentBytes();
     }
 
-    uint64_t GetLastBytesPerSecond() const
+    TransportProfile GetTransport() const override
     {
-        return (_previousWindowBytes * 1000) / kSpeedWindowMS.count();
+        lock_guard lock(_transportMutex);
+        return _transport;
     }
-};
 
-// ClientResponse
-//
-// Response data sent back to server every time we receive a packet.
-// This struct is packed to match the exact network protocol format used by ESP32 clients.
-// The packed attribute is required to ensure correct network communication but may cause
-// alignment issues on some architectures.
+    // GetEffectiveTransport
+    //
+    // The profile our frames actually go out with: the connection's, merged from those of every
+    // channel on it (see MergeTransports), with our own queue limits
 
-inline static double ByteSwapDouble(double value)
-{
-    // Helper function to swap bytes in a double
-    uint64_t temp;
-    memcpy(&temp, &value, sizeof(double)); // Copy bits of double to temp
-    temp = __builtin_bswap64(temp);        // Byte swap the 64-bit integer
-    memcpy(&value, &temp, sizeof(double)); // Copy bits back to double
-    return value;
-}
+    TransportProfile GetEffectiveTransport() const override
+    {
+        auto transport = GetTransport();
+        if (!_running)
+            return transport;
 
-struct OldClientResponse
-{
-    uint32_t size;         // 4
-    uint32_t flashVersion; // 4
-    double currentClock;   // 8
-    double oldestPacket;   // 8
-    double newestPacket;   // 8
-    double brightness;     // 8
-    double wifiSignal;     // 8
-    uint32_t bufferSize;   // 4
-    uint32_t bufferPos;    // 4
-    uint32_t fpsDrawing;   // 4
-    uint32_t watts;        // 4
-} __attribute__((packed)); // Packed attribute required for network protocol compatibility
-
-struct ClientResponse
-{
-    uint32_t size = sizeof(ClientResponse);         // 4
-    uint64_t sequence = 0;                          // 8
-    uint32_t flashVersion = 0;                      // 4
-    double currentClock = 0;                        // 8
-    double oldestPacket = 0;                        // 8
-    double newestPacket = 0;                        // 8
-    double brightness = 0;                          // 8
-    double wifiSignal = 0;                          // 8
-    uint32_t bufferSize = 0;                        // 4
-    uint32_t bufferPos = 0;                         // 4
-    uint32_t fpsDrawing = 0;                        // 4
-    uint32_t watts = 0;                             // 4
-
-    ClientResponse& operator=(const OldClientResponse& old)
-    {
-        size = sizeof(ClientResponse);;
-        sequence = 0;  // New field, initialize to 0
-        flashVersion = old.flashVersion;
-        currentClock = old.currentClock;
-        oldestPacket = old.oldestPacket;
-        newestPacket = old.newestPacket;
-        brightness = old.brightness;
-        wifiSignal = old.wifiSignal;
-        bufferSize = old.bufferSize;
-        bufferPos = old.bufferPos;
-        fpsDrawing = old.fpsDrawing;
-        watts = old.watts;
-        return *this;
-    }
-
-    // Member function to translate the structure from the ESP32 little endian
-    // to whatever the current running system is
-
-    void TranslateClientResponse()
-    {
-        // Check the system's endianness
-        if constexpr (endian::native == endian::little)
-            return; // No-op for little-endian systems
-
-        // Perform byte swaps for big-endian systems
-        size = __builtin_bswap32(size);
-        sequence = __builtin_bswap64(sequence); // Added missing sequence swap
-        flashVersion = __builtin_bswap32(flashVersion);
-        currentClock = ByteSwapDouble(currentClock);
-        oldestPacket = ByteSwapDouble(oldestPacket);
-        newestPacket = ByteSwapDouble(newestPacket);
-        brightness = ByteSwapDouble(brightness);
-        wifiSignal = ByteSwapDouble(wifiSignal);
-        bufferSize = __builtin_bswap32(bufferSize);
-        bufferPos = __builtin_bswap32(bufferPos);
-        fpsDrawing = __builtin_bswap32(fpsDrawing);
-        watts = __builtin_bswap32(watts);
-    }
-
-    friend void to_json(nlohmann::json &j, const ClientResponse &response)
-    {
-        j ={
-                {"responseSize", response.size},
-                {"sequenceNumber", response.sequence},
-                {"flashVersion", response.flashVersion},
-                {"currentClock", response.currentClock},
-                {"oldestPacket", response.oldestPacket},
-                {"newestPacket", response.newestPacket},
-                {"brightness", response.brightness},
-                {"wifiSignal", response.wifiSignal},
-                {"bufferSize", response.bufferSize},
-                {"bufferPos", response.bufferPos},
-                {"fpsDrawing", response.fpsDrawing},
-                {"watts", response.watts}
-        };
-    }
-
-    friend void from_json(const nlohmann::json& j, ClientResponse& response) 
-    {
-        response.size = j.at("responseSize").get<uint8_t>();
-        response.sequence = j.at("sequenceNumber").get<uint32_t>();
-        response.flashVersion = j.at("flashVersion").get<uint32_t>();
-        response.currentClock = j.at("currentClock").get<uint64_t>();
-        response.oldestPacket = j.at("oldestPacket").get<uint64_t>();
-        response.newestPacket = j.at("newestPacket").get<uint64_t>();
-        response.brightness = j.at("brightness").get<uint8_t>();
-        response.wifiSignal = j.at("wifiSignal").get<int8_t>();
-        response.bufferSize = j.at("bufferSize").get<uint32_t>();
-        response.bufferPos = j.at("bufferPos").get<uint32_t>();
-        response.fpsDrawing = j.at("fpsDrawing").get<float>();
-        response.watts = j.at("watts").get<float>();
-    }
-
-} __attribute__((packed)); // Packed attribute required for network protocol compatibility
+        auto effective = _connection->GetTransport();
+        effective.maxQueueFrames = transport.maxQueueFrames;
+        effective.maxQueueBytes = transport.maxQueueBytes;
+        return effective;
+    }
 
-// SocketChannel
-//
-// Represents a socket connection to a NightDriverStrip client. Keeps a queue of frames and 
-// pops them off the queue and sends them on a worker thread. The worker thread will attempt
-// to connect to the client if it is not already connected. The worker thread will also
-// attempt to reconnect if the connection is lost.
+    // SetTransport
+    //
+    // Switches to a new transport profile while the channel runs.  The queue limits apply to the
+    // next frame queued, and the rest is handed to the connection on its strand.
 
-class SocketChannel : public ISocketChannel
-{
-    static constexpr uint16_t CommandPixelData = 3;
-    static constexpr size_t MaxQueueDepth = 500;
-    static constexpr size_t MaxQueuedBytes = 1024 * 1024 * 10;  // 10MB memory limit
+    void SetTransport(const TransportProfile& transport) override
+    {
+        lock_guard lock(_transportMutex);
 
-    string _hostName;
-    string _friendlyName;
-    uint16_t _port;
+        _transport = transport;
+        _maxQueueFrames = transport.maxQueueFrames;
+        _overflowBytes = OverflowBytes(transport);
 
-    static atomic<uint32_t> _nextId;
-    uint32_t _id;
+        if (transport.maxQueueBytes > _frameRing.Capacity())
+            logger->warn("Queue for {} [{}] is limited to {} bytes", _hostName, _friendlyName, _frameRing.Capacity());
 
-    mutable mutex _mutex;                       // 
-    mutable mutex _queueMutex;
-    mutable mutex _responseMutex;
-    
-    atomic<bool> _isConnected;
-    atomic<bool> _running;
+        if (_running)
+            asio::post(_connection->Strand(), [connection = _connection, queue = _queue, transport]() { connection->SetTransport(queue, transport); });
+    }
 
-    int _socketFd;
+    uint32_t GetReconnectCount() const override
+    {
+        return _connection->GetReconnectCount();
+    }
 
-    ClientResponse _lastClientResponse;
-    system_clock::time_point _lastResponseTime;
-    system_clock::time_point _lastConnectionAttempt;
-    SpeedTracker _speedTracker;
+    ConnectStats GetConnectStats() const override
+    {
+        return _connection->GetConnectStats();
+    }
 
-    uint32_t _reconnectCount;
+    size_t GetConnectionChannelCount() const override
+    {
+        return _connection->ChannelCount();
+    }
 
-    queue<vector<uint8_t>> _frameQueue;
-    size_t _totalQueuedBytes;  // Track total memory usage
-    thread _workerThread;
+    virtual uint64_t GetLastBytesPerSecond() const override
+    {
+        return static_cast<uint64_t>(_queue->metrics.bytes.PerSecond());
+    }
 
+    MetricsSnapshot GetMetrics() const override
+    {
+        return _queue->metrics.Snapshot();
+    }
 
-public:
-    SocketChannel(const string& hostName, const string& friendlyName, uint16_t port = 49152)
-        : _hostName(hostName),
-          _friendlyName(friendlyName),
-          _port(port),
-          _id(_nextId++),
-          _isConnected(false),
-          _running(false),
-          _socketFd(-1),
-          _lastClientResponse(),
-          _lastConnectionAttempt(system_clock::now()),
-          _reconnectCount(0),
-          _totalQueuedBytes(0)
+    double GetWakeupsPerSecond() const override
     {
+        return _queue->metrics.wakeups.PerSecond();
     }
 
-    ~SocketChannel() override
+    BatchLimits GetBatchLimits() const override
     {
-        Stop();
-        CloseSocket();
+        return _connection->GetBatchLimits();
     }
 
-    uint32_t Id() const override 
-    { 
-        return _id; 
+    SendStats GetSendStats() const override
+    {
+        return _connection->GetSendStats(*_queue);
     }
 
-    size_t GetCurrentQueueDepth() const override
+    ChannelLatency GetLatency() const override
     {
-        lock_guard lock(_queueMutex);
-        return _frameQueue.size();  
+        ChannelLatency latency = _connection->GetLatency();
+        latency.queueWait = _queue->queueWait.Snapshot();
+        return latency;
     }
 
-    size_t GetQueueMaxSize() const override
+    OverflowPolicy GetOverflowPolicy() const override
     {
-        return MaxQueueDepth;
+        return _overflowPolicy;
     }
 
-    uint32_t GetReconnectCount() const override
+    DroppedFrames GetDroppedFrames() const override
     {
-        lock_guard lock(_mutex);
-        return _reconnectCount;
+        using Mode = OverflowPolicy::Mode;
+
+        DroppedFrames dropped;
+        dropped.dropOldest = _droppedFrames[static_cast<size_t>(Mode::DropOldest)];
+        dropped.keepLatest = _droppedFrames[static_cast<size_t>(Mode::KeepLatest)];
+        dropped.decimate   = _droppedFrames[static_cast<size_t>(Mode::Decimate)];
+        dropped.reset      = _droppedFrames[static_cast<size_t>(Mode::Reset)];
+        dropped.stale      = _queue->staleFrames;
+        dropped.replaced   = _queue->replacedFrames;
+        return dropped;
     }
 
-    virtual uint64_t GetLastBytesPerSecond() const override
+    milliseconds GetStaleFrameGrace() const override
     {
-        return _speedTracker.GetLastBytesPerSecond();
+        return _queue->staleFrameGrace;
     }
 
     uint16_t Port() const override
@@ -318,54 +284,69 @@ public:
         return _port;
     }
 
+    ChannelProtocol Protocol() const override
+    {
+        return _protocol;
+    }
+
     void Start() override
     {
         logger->debug("Starting socket channel for {} [{}]", _hostName, _friendlyName);
 
-        lock_guard lock(_mutex);
-        if (!_running)
-        {
-            _running = true;
-            _workerThread = thread(&SocketChannel::WorkerLoop, this);
-        }
+        if (!_running.exchange(true))
+            _connection->Attach(_queue, GetTransport());
     }
 
     void Stop() override
     {
         logger->debug("Stopping socket channel for {} [{}]", _hostName, _friendlyName);
-        {
-            lock_guard lock(_mutex);
-            _running = false;
-        }
 
-        if (_workerThread.joinable())
-            _workerThread.join();
+        if (!_running.exchange(false))
+            return;
 
-        CloseSocket();
+        // Detach on the strand so we can't race a handler that is sending from our queue, and
+        // wait for that to happen so the channel is quiet by the time we return
+
+        promise<void> detached;
+        asio::post(_connection->Strand(), [this, &detached]()
+        {
+            _connection->Detach(_queue);
+            detached.set_value();
+        });
+        detached.get_future().wait();
     }
 
     bool IsConnected() const override
     {
-        lock_guard lock(_mutex);
-        return _isConnected;
+        return _running && _connection->IsConnected();
     }
-    
+
+    bool AcceptsFrames() const override
+    {
+        return !_connection->IsBreakerOpen();
+    }
+
     const string& HostName() const override { return _hostName; }
     const string& FriendlyName() const override { return _friendlyName; }
-    
-    // LastClientResponse
-    // 
-    // A copy of the last success/stats packet we got back from the client
-    
-    ClientResponse LastClientResponse() const override  // Changed to return by value
-    { 
-        constexpr auto kMaxResponseAge = 2s;
 
-        lock_guard lock(_responseMutex);
-        if (_lastResponseTime - system_clock::now() > kMaxResponseAge)
-            return ClientResponse {}; // Return empty response if too old
+    ClientResponse LastClientResponse() const override
+    {
+        return _connection->LastClientResponse();
+    }
 
-        return _lastClientResponse; 
+    vector<ClientResponse> RecentClientResponses() const override
+    {
+        return _connection->RecentClientResponses();
+    }
+
+    uint64_t GetResponseCount() const override
+    {
+        return _connection->GetResponseCount();
+    }
+
+    uint64_t GetInvalidResponseBytes() const override
+    {
+        return _connection->GetInvalidResponseBytes();
     }
 
     // CompressFrame
@@ -375,394 +356,313 @@ public:
 
     vector<uint8_t> CompressFrame(const vector<uint8_t>& data) override
     {
-        constexpr uint32_t COMPRESSED_HEADER_TAG = 0x44415645; // Magic "DAVE" tag
-        constexpr uint32_t CUSTOM_TAG = 0x12345678;
-
-        // Compress the data
-        auto compressedData = Utilities::Compress(data);
-
-        // Create the compressed frame
-        return Utilities::CombineByteArrays(
-            Utilities::DWORDToBytes(COMPRESSED_HEADER_TAG),
-            Utilities::DWORDToBytes(static_cast<uint32_t>(compressedData.size())),
-            Utilities::DWORDToBytes(static_cast<uint32_t>(data.size())),
-            Utilities::DWORDToBytes(CUSTOM_TAG),
-            std::move(compressedData)
-        );
+        return Utilities::CompressFrame(data);
     }
 
-bool EnqueueFrame(vector<uint8_t>&& frameData) override
-{
-    bool isQueueFull = false;
-    {
-        lock_guard lock(_queueMutex);
-        size_t newTotalBytes = _totalQueuedBytes + frameData.size();
-        if (_frameQueue.size() >= MaxQueueDepth || newTotalBytes > MaxQueuedBytes)
-            isQueueFull = true;
-        else {
-            _totalQueuedBytes += frameData.size();
-            _frameQueue.push(std::move(frameData));
-        }
+    bool TakesCompressedFrames() const override
+    {
+        return true;
     }
 
-    // If the queue is full, we reset the socket and drop the frames in the queue
+    // EnqueueFrame
+    //
+    // Copies an already built frame into the queue, which leaves the caller free to queue the same
+    // frame to other channels.  Must only be called from the one thread that produces frames for
+    // this channel.
 
-    if (isQueueFull)
+    bool EnqueueFrame(span<const uint8_t> frameData, system_clock::time_point presentAt) override
     {
-        logger->warn("Queue is full at {} [{}] dropping frame and resetting socket", _hostName, _friendlyName);
-        CloseSocket();
-        EmptyQueue();
-        return false;
-    }
-
-    return true;
-}
+        if (!CheckQueueLimits() || !_frameRing.Push(frameData, presentAt))
+            return DropNewFrame();
 
-private:
+        _queue->metrics.uncompressedBytes.Add(Utilities::UncompressedSize(frameData));
+        _queue->metrics.queuedBytes.Add(frameData.size());
+        WakeSender(frameData.size());
+        return true;
+    }
 
-    // Worker Loop
+    // CompressAndEnqueueFrame
     //
-    // The main duties of the WorkerLoop are to send frames to the client and read responses from the client.
-    // It continually watches for new packets to appear int he queue and then sends them in batches.
-    // It also reads responses from the client and updates the lastClientResponse member variable.
+    // Same as EnqueueFrame(CompressFrame(data)), except that the compressed frame is written straight
+    // into the queue, so there's no intermediate buffer to allocate or copy.
 
-    void WorkerLoop()
+    bool CompressAndEnqueueFrame(const vector<uint8_t>& frameData) override
     {
-        steady_clock::time_point lastSendTime = steady_clock::now();
-        constexpr auto kMaxBatchSize = 20;
-        constexpr auto kMaxBatchDelay = 1000ms;  // Fixed variable name
-        constexpr auto reconnectDelay = 1000ms;
+        uint8_t * destination = nullptr;
+        if (CheckQueueLimits())
+            destination = _frameRing.BeginWrite(Utilities::kCompressedHeaderSize + Utilities::CompressBound(frameData.size()));
 
-        while (_running)
+        if (!destination)
+            return DropNewFrame();
+
+        size_t compressedSize;
+        try
         {
-            try
-            {
-                vector<uint8_t> combinedBuffer;
-                size_t packetCount = 0;
+            compressedSize = Utilities::CompressInto(frameData,
+                                                     destination + Utilities::kCompressedHeaderSize,
+                                                     Utilities::CompressBound(frameData.size()));
+        }
+        catch (const exception&)
+        {
+            _frameRing.CancelWrite();
+            throw;
+        }
 
-                auto now = steady_clock::now();
-                auto bTimeToSend = duration_cast<milliseconds>(now - lastSendTime) >= kMaxBatchDelay;
+        Utilities::WriteCompressedHeader(destination, compressedSize, frameData.size());
+        _frameRing.CommitWrite(Utilities::kCompressedHeaderSize + compressedSize, Utilities::DataFramePresentationTime(frameData));
 
-                // Calculate total bytes first to preallocate buffer
-                {
-                    unique_lock<mutex> lock(_queueMutex);
-                    size_t tempCount = 0;
-                    size_t tempBytes = 0;
-                    auto queueCopy = _frameQueue;
-                    while (!queueCopy.empty() && tempCount < kMaxBatchSize)
-                    {
-                        tempBytes += queueCopy.front().size();
-                        tempCount++;
-                        queueCopy.pop();
-                    }
-                    if (tempBytes > 0) 
-                        combinedBuffer.reserve(tempBytes);
-                }
-
-                if (!_frameQueue.empty() && (_frameQueue.size() >= kMaxBatchSize || bTimeToSend))
-                {
-                    unique_lock<mutex> lock(_queueMutex);
-                    
-                    while (!_frameQueue.empty() && packetCount < kMaxBatchSize)
-                    {
-                        vector<uint8_t>& frame = _frameQueue.front();
-                        packetCount++;
-                        combinedBuffer.insert(combinedBuffer.end(), frame.begin(), frame.end());
-                        _totalQueuedBytes -= frame.size();
-                        _frameQueue.pop();
-                    }
-                }
-
-                if (packetCount > 0)
-                {
-                    logger->debug("Sending {} packets to {} [{}]", packetCount, _hostName, _friendlyName);
-
-                    if (!combinedBuffer.empty())
-                    {
-                        lastSendTime = steady_clock::now();
-                        optional<ClientResponse> response = SendFrame(std::move(combinedBuffer));
-                        if (response)
-                        {
-                            lock_guard lock(_responseMutex);
-                            _lastClientResponse = std::move(*response);
-                            _lastResponseTime = system_clock::now();
-                        }
-                        _speedTracker.UpdateBytesPerSecond();
-                    }
-                }
-            }
-            catch (const exception& e)
-            {
-                logger->warn("SocketChannel WorkerLoop exception: {}", e.what());
-                CloseSocket();
-                
-                // Wait before attempting to reconnect
-                auto now = system_clock::now();
-                if (duration_cast<milliseconds>(now - _lastConnectionAttempt) < reconnectDelay)
-                {
-                    cout << "Waiting for " << duration_cast<milliseconds>(reconnectDelay - (now - _lastConnectionAttempt)).count() << "ms before reconnecting" << endl; 
-                    this_thread::sleep_for(reconnectDelay - (now - _lastConnectionAttempt));
-                    continue;
-                }
-            }
+        _queue->metrics.uncompressedBytes.Add(frameData.size());
+        _queue->metrics.queuedBytes.Add(Utilities::kCompressedHeaderSize + compressedSize);
 
-            this_thread::sleep_for(milliseconds(1));
-        }
+        WakeSender(Utilities::kCompressedHeaderSize + compressedSize);
+        return true;
     }
 
-    optional<ClientResponse> ReadSocketResponse() 
+    bool WantsRePrime() const override
     {
-        const size_t cbToRead = sizeof(ClientResponse);
-        optional<ClientResponse> lastResponse;
+        return _queue->rePrimeRequested.load(memory_order_relaxed) != 0;
+    }
 
-        pollfd pfd;
-        pfd.fd = _socketFd;
-        pfd.events = POLLIN;
+    // RePrime
+    //
+    // Refills the client's buffer after it reconnected.  frames are what the pipeline has built for
+    // this channel lately, oldest first, and we queue again the newest of them that the client is
+    // still to show, up to half the queue's limits, so a large buffer can't run the channel into its
+    // overflow policy.  They supersede whatever was queued already, which the connection drops
+    // instead of sending.  With no frames to replay, the channel just carries on with its queue.
+    // Must only be called from the one thread that produces frames for this channel.
+
+    size_t RePrime(const deque<RenderedFrame>& frames) override
+    {
+        if (!WantsRePrime())
+            return 0;
 
-        // Keep reading while there's data available
-        while (poll(&pfd, 1, 0) > 0)
+        auto now = system_clock::now();
+        size_t maxFrames = _maxQueueFrames.load(memory_order_relaxed) / 2;
+        size_t maxBytes = ByteLimit() / 2;
+        size_t bytes = 0;
+
+        auto first = frames.end();
+        while (first != frames.begin())
         {
-            uint8_t byteCount = 0;
-            ssize_t readBytes = recv(_socketFd, &byteCount, 1, MSG_PEEK);
-            if (readBytes <= 0)
+            auto previous = prev(first);
+            if (previous->presentAt <= now ||
+                static_cast<size_t>(frames.end() - previous) > maxFrames ||
+                bytes + previous->data.size() > maxBytes)
                 break;
 
-            if (byteCount != static_cast<uint8_t>(cbToRead))
-            {
-                if (byteCount == sizeof(OldClientResponse))
-                {
-                    OldClientResponse oldResponse;
-                    readBytes = recv(_socketFd, &oldResponse, sizeof(OldClientResponse), 0);
-                    if (readBytes == sizeof(OldClientResponse))
-                    {
-                        ClientResponse response;
-                        response = oldResponse;
-                        response.TranslateClientResponse();
-                        lastResponse = response;
-                        continue;  // Check for more data
-                    }
-                }
-
-                logger->warn("Invalid byte count reading response from {} [{}]", _hostName, _friendlyName);
-                // Invalid byte count; eat the contents
-                vector<uint8_t> tempBuffer(byteCount);
-                recv(_socketFd, tempBuffer.data(), byteCount, 0);
-                continue;  // Check for more data
-            }
-
-            // Read the full response
-            vector<uint8_t> buffer(cbToRead);
-            readBytes = recv(_socketFd, buffer.data(), cbToRead, 0);
-            if (readBytes == static_cast<ssize_t>(cbToRead))
-            {
-                ClientResponse response;
-                memcpy(&response, buffer.data(), cbToRead);
-                response.TranslateClientResponse();
-                lastResponse = response;
-                continue;  // Check for more data
-            }
-            logger->warn("Error reading response from {} [{}]", _hostName, _friendlyName);
-            break;  // Error reading data
+            bytes += previous->data.size();
+            first = previous;
         }
 
-        return lastResponse;
-    }
+        uint64_t fence = _frameRing.WritePosition();
+        size_t replayed = 0;
+        for (auto frame = first; frame != frames.end() && _frameRing.Push(frame->data, frame->presentAt); frame++)
+            replayed++;
 
-    bool SetSocketOptions(int socketFd)
-    {
-        // Set socket to non-blocking mode
+        if (replayed)
+            _queue->rePrimeFence.store(fence, memory_order_relaxed);
+        _queue->rePrimeRequested.store(0, memory_order_release);
+        _queue->metrics.rePrimedFrames.Add(replayed);
 
-        int flags = fcntl(socketFd, F_GETFL, 0);
-        if (flags == -1) 
-            return false;
-        
-        if (!(fcntl(socketFd, F_SETFL, flags | O_NONBLOCK) != -1))
-            return false;
+        logger->debug("Re-primed {} [{}] with {} frames", _hostName, _friendlyName, replayed);
 
-        // Enable TCP keepalive on the socket
+        if (_running)
+            _connection->Wake();
+        return replayed;
+    }
 
-        int keepalive = 1;
-        int keepcnt = 3;          // Number of keepalive probes before declaring dead
-        int keepidle = 1;         // Time in seconds before sending keepalive probes
-        int keepintvl = 1;        // Time in seconds between keepalive probes
+private:
 
-        // On macOS, TCP_KEEPIDLE is called TCP_KEEPALIVE
-        #ifdef __APPLE__
-            #define TCP_KEEPIDLE TCP_KEEPALIVE
-        #endif
+    // WakeSender
+    //
+    // Called by the producer after it has queued a frame.  The sender only needs to run when that
+    // frame changes something: the first frame after the queue ran dry starts the batch delay
+    // timer, and the frame that fills a batch (in frames or in bytes) means it's time to send.
+    // Anything in between would be a wasted trip through the strand, as would waking it while one
+    // wake is still pending or while there is no connection to send on.  Frames beyond a full
+    // batch don't need a wake either: whatever write is in flight re-checks the queues on its own
+    // when it completes.  On a shared connection this only looks at our own queue, so a batch that
+    // several channels fill together goes out when its batch delay is up.
+
+    void WakeSender(size_t frameBytes)
+    {
+        if (!_running || !_connection->IsConnected())
+            return;
 
-        if (setsockopt(socketFd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive)) < 0 ||
-            setsockopt(socketFd, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt)) < 0 ||
-            setsockopt(socketFd, IPPROTO_TCP, TCP_KEEPIDLE, &keepidle, sizeof(keepidle)) < 0 ||
-            setsockopt(socketFd, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl)) < 0)
-        {
-            logger->warn("Could not set keepalive options for {} [{}]", _hostName, _friendlyName);
-            return false;
-        }           
+        BatchLimits limits = _connection->GetBatchLimits();
+        size_t queuedFrames = _frameRing.FrameCount();
+        size_t queuedBytes = _frameRing.QueuedBytes();
 
-        struct timeval timeouttv;
-        timeouttv.tv_sec = kSendTimeout.count() / 1000;
-        timeouttv.tv_usec = (kSendTimeout.count() % 1000) * 1000;
+        bool fillsBatch = queuedFrames == limits.maxFrames ||
+                          (queuedBytes >= limits.maxBytes && queuedBytes - frameBytes < limits.maxBytes);
 
-        if (setsockopt(socketFd, SOL_SOCKET, SO_SNDTIMEO, &timeouttv, sizeof(timeouttv)) < 0)
-        {
-            logger->warn("Could not set TCP send timeout for {} [{}]", _hostName, _friendlyName);
-            return false;
-        }
+        if (queuedFrames != 1 && !fillsBatch)
+            return;
 
-        return true;
+        _connection->Wake();
     }
 
-    optional<ClientResponse> SendFrame(const vector<uint8_t>&& frame)
+    // CheckQueueLimits
+    //
+    // Called by the producer before it queues a frame.  Once the queue reaches the profile's
+    // maxQueueFrames, takes up three quarters of its maxQueueBytes or outgrows its share of the
+    // QueueBudget, the overflow policy has to make room.  Returns false
+    // if the new frame should be turned away, which only the reset policy does; the others queue
+    // it as long as the ring still has room.
+
+    bool CheckQueueLimits()
     {
-        if (_socketFd == -1 && !ConnectSocket())
-        {
-            logger->warn("Could not connect to {} [{}] in SendFrame", _hostName, _friendlyName);
-            lock_guard lock(_mutex);
-            _isConnected = false;
-            return nullopt;
-        }
+        _frameRing.SetWrapLimit(RingLimit());
 
-        size_t totalSent = 0;
-        while (totalSent < frame.size() && _running)
-        {
-            auto startTime = steady_clock::now();
-
-            ssize_t sent = send(_socketFd, 
-                            frame.data() + totalSent, 
-                            frame.size() - totalSent, 
-                            MSG_NOSIGNAL);
-            
-            if (sent > 0)
-            {
-                totalSent += sent;
-                continue;
-            }
+        if (_frameRing.FrameCount() < _maxQueueFrames.load(memory_order_relaxed) &&
+            _frameRing.UsedBytes() < ByteLimit())
+            return true;
 
-            if (sent == -1)
-            {
-                if (errno == EPIPE)
-                {
-                    logger->debug("EPIPE error for {} [{}]", _hostName, _friendlyName);
-
-                    CloseSocket();
-                    if (!ConnectSocket()) 
-                        return nullopt;
-                    continue;
-                }
-                
-                if ((errno == EWOULDBLOCK || errno == EAGAIN) && ((steady_clock::now() - startTime) < kSendTimeout))
-                {
-                    this_thread::sleep_for(100ms);
-                    continue;
-                }
-                logger->warn("Socket timed out for {} [{}] errno={}", _hostName, _friendlyName, errno);
+        RequestOverflowHandling();
+        return _overflowPolicy.mode != OverflowPolicy::Mode::Reset;
+    }
 
-                CloseSocket();
-                return nullopt;
-            }
-        }
+    // RequestOverflowHandling
+    //
+    // Only the consumer may drop frames, so the policy is applied on the connection's strand; we
+    // just ask for it once
 
+    void RequestOverflowHandling()
+    {
+        if (_overflowPending.exchange(true))
+            return;
+
+        asio::post(_connection->Strand(), [self = shared_from_this()]()
         {
-            lock_guard lock(_mutex);
-            _isConnected = true;
-            _speedTracker.AddBytes(totalSent);
-        }
+            self->ApplyOverflowPolicy();
+            self->_overflowPending = false;
+        });
+    }
 
-        return _running ? ReadSocketResponse() : nullopt;
+    // DropNewFrame
+    //
+    // The frame we were given doesn't fit, so it counts as dropped by whatever policy is in force
+
+    bool DropNewFrame()
+    {
+        _droppedFrames[static_cast<size_t>(_overflowPolicy.mode)]++;
+        _queue->metrics.drops.Add();
+        RequestOverflowHandling();
+        return false;
     }
 
+    // ApplyOverflowPolicy
+    //
+    // Runs on the connection's strand when the queue has hit its limits, and drops frames as the
+    // policy says.  Frames that are being written right now can't be dropped, so we start after
+    // them.  A reset resets the connection too, but only while we're attached to it and nobody
+    // else is: other features' channels sharing it shouldn't lose their session over our queue, so
+    // then we just drop ours.
 
-    bool ConnectSocket()
+    void ApplyOverflowPolicy()
     {
-        logger->debug("Attempting to connect to {} [{}]", _hostName, _friendlyName);
+        using Mode = OverflowPolicy::Mode;
 
-        _lastConnectionAttempt = system_clock::now();
-        
-        int tempSocket = socket(AF_INET, SOCK_STREAM, 0);
-        if (tempSocket == -1)
-            return false;
+        bool writeInProgress = _queue->inFlightFrames > 0;
 
-        struct sockaddr_in serverAddr;
-        memset(&serverAddr, 0, sizeof(serverAddr));
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(_port);
+        if (_frameRing.UsedBytes() >= _budgetAccount->limit.load(memory_order_relaxed))
+            _budgetAccount->sheds++;
 
-        if (inet_pton(AF_INET, _hostName.c_str(), &serverAddr.sin_addr) <= 0)
+        if (_overflowPolicy.mode == Mode::Reset)
         {
-            logger->warn("Invalid address for {} [{}]", _hostName, _friendlyName);
-            close(tempSocket);
-            return false;
+            bool shared = _connection->ChannelCount() > 1;
+            logger->warn("Queue is full at {} [{}] dropping frames{}", _hostName, _friendlyName, shared ? "" : " and resetting socket");
+            size_t queued = _frameRing.FrameCount();
+            _droppedFrames[static_cast<size_t>(Mode::Reset)] += queued;
+            _queue->metrics.drops.Add(queued);
+            if (_running && !shared)
+                _connection->ResetConnection();
+            EmptyQueue();
+            return;
         }
 
-        // Set socket options (non-blocking, keepalive, send timeout)
-        if (!SetSocketOptions(tempSocket))
-        {
-            logger->warn("Could not set socket options for {} [{}]", _hostName, _friendlyName);
-            close(tempSocket);
-            return false;
-        }
+        uint64_t position = writeInProgress ? _queue->inFlightEnd : _frameRing.ReadPosition();
+        size_t dropped = 0;
 
-        // Non-blocking connect
-        int result = connect(tempSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
-        if (result == -1)
+        switch (_overflowPolicy.mode)
         {
-            if (errno != EINPROGRESS)
+            case Mode::DropOldest:
             {
-                logger->warn("Could not connect to {} [{}] errno={}", _hostName, _friendlyName, errno);
-                close(tempSocket);
-                return false;
+                size_t maxFrames = _maxQueueFrames * kDropOldestRatio;
+                size_t maxBytes = ByteLimit() * kDropOldestRatio;
+
+                dropped = _frameRing.DropIf(position, [&](size_t, const FrameRing::Frame&)
+                {
+                    return _frameRing.FrameCount() > maxFrames || _frameRing.QueuedBytes() > maxBytes;
+                });
+                break;
             }
 
-            // Wait for connection with timeout
-            pollfd pfd;
-            pfd.fd = tempSocket;
-            pfd.events = POLLOUT;
-            
-            if (poll(&pfd, 1, kConnectTimeout.count()) <= 0)
+            case Mode::KeepLatest:
             {
-                logger->warn("Connection timeout to {} [{}]", _hostName, _friendlyName);
-                close(tempSocket);
-                return false;
+                size_t inFlight = _queue->inFlightFrames;
+                size_t queued = _frameRing.FrameCount() - min(inFlight, _frameRing.FrameCount());
+                size_t toDrop = queued > _overflowPolicy.keepLatest ? queued - _overflowPolicy.keepLatest : 0;
+
+                dropped = _frameRing.DropIf(position, [&](size_t index, const FrameRing::Frame&)
+                {
+                    return index < toDrop;
+                });
+                break;
             }
 
-            // Check if connection was successful
-            int error = 0;
-            socklen_t len = sizeof(error);
-            if (getsockopt(tempSocket, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+            case Mode::Decimate:
             {
-                close(tempSocket);
-                return false;
+                dropped = _frameRing.DropIf(position, [](size_t index, const FrameRing::Frame&)
+                {
+                    return index % 2 == 1;
+                });
+                break;
             }
+
+            default:
+                break;
         }
 
-        _reconnectCount++;
-        logger->info("Connection number {} to {}:{} [{}]", _reconnectCount, _hostName, _port, _friendlyName);
-        _socketFd = tempSocket;
-        return true;
+        // With no write in flight, any frames we dropped at the front can be handed back now.
+        // Frames dropped further back only free their space once everything in front of them
+        // is gone, which never happens while the client is unreachable, so if the ring is still
+        // too full we fall back to dropping from the front.
+
+        if (!writeInProgress)
+        {
+            _frameRing.ReleaseTo(_frameRing.ReadPosition());
+
+            while (_frameRing.UsedBytes() > ByteLimit() * kDropOldestRatio)
+            {
+                uint64_t next = _frameRing.ReadPosition();
+                if (!_frameRing.Next(next))
+                    break;
+
+                _frameRing.ReleaseTo(next);
+                dropped++;
+            }
+        }
+
+        _droppedFrames[static_cast<size_t>(_overflowPolicy.mode)] += dropped;
+        _queue->metrics.drops.Add(dropped);
+        logger->debug("Queue overflow at {} [{}]: dropped {} frames, {} left", _hostName, _friendlyName, dropped, _frameRing.FrameCount());
     }
 
+    // EmptyQueue
+    //
+    // Consumer side only, so call this on the connection's strand.  Frames in the batch being
+    // written stay where they are until the connection is done with them.
+
     void EmptyQueue()
     {
         logger->debug("Emptying queue for {} [{}]", _hostName, _friendlyName);
-        scoped_lock lock(_mutex, _queueMutex);
-        while (!_frameQueue.empty()) {
-            _totalQueuedBytes -= _frameQueue.front().size();
-            _frameQueue.pop();
-        }
-        assert(_totalQueuedBytes == 0);
-    }
 
-    void CloseSocket()
-    {
-        logger->debug("Closing socket for {} [{}]", _hostName, _friendlyName);
-        lock_guard lock(_mutex);  // Add lock    
-        if (_socketFd != -1)
-        {
-            close(_socketFd);
-            _socketFd = -1;
-        }
-        _isConnected = false;
+        if (_queue->inFlightFrames)
+            _frameRing.DropIf(_queue->inFlightEnd, [](size_t, const FrameRing::Frame&) { return true; });
+        else
+            _frameRing.Clear();
     }
 };
 
@@ -775,11 +675,30 @@ inline void to_json(nlohmann::json &j, const ISocketChannel & socket)
         j["hostName"] = socket.HostName();
         j["friendlyName"] = socket.FriendlyName();
         j["isConnected"] = socket.IsConnected();
+        j["breakerOpen"] = !socket.AcceptsFrames();
         j["reconnectCount"] = socket.GetReconnectCount();
         j["queueDepth"] = socket.GetCurrentQueueDepth();
         j["queueMaxSize"] = socket.GetQueueMaxSize();
+        j["queuedBytes"] = socket.GetQueuedBytes();
+        j["queueBudgetBytes"] = socket.GetQueueBudget() == QueueBudget::kNoLimit ? nlohmann::json() : nlohmann::json(socket.GetQueueBudget());
+        j["queueResidentBytes"] = socket.GetQueueResidentBytes();
         j["bytesPerSecond"] = socket.GetLastBytesPerSecond();
+        j["wakeupsPerSecond"] = socket.GetWakeupsPerSecond();
+        j["metrics"] = socket.GetMetrics();
+        j["batch"] = socket.GetBatchLimits();
+        j["overflowPolicy"] = socket.GetOverflowPolicy();
+        j["transport"] = socket.GetTransport();
+        j["effectiveTransport"] = socket.GetEffectiveTransport();
+        j["droppedFrames"] = socket.GetDroppedFrames();
+        j["staleFrameGraceMs"] = socket.GetStaleFrameGrace().count();
+        j["send"] = socket.GetSendStats();
+        j["connect"] = socket.GetConnectStats();
+        j["connectionChannels"] = socket.GetConnectionChannelCount();
+        j["latency"] = socket.GetLatency();
+        j["responseCount"] = socket.GetResponseCount();
+        j["invalidResponseBytes"] = socket.GetInvalidResponseBytes();
         j["port"] = socket.Port();
+        j["protocol"] = socket.Protocol();
         j["id"] = socket.Id();
         
         // Note: featureId and canvasId can't be included here since they're not
@@ -813,6 +732,11 @@ inline void from_json(const nlohmann::json& j, shared_ptr<ISocketChannel>& socke
     socket = make_shared<SocketChannel>(
         j.at("hostName").get<string>(),
         j.at("friendlyName").get<string>(),
-        j.value("port", uint16_t(49152))
+        j.value("port", uint16_t(49152)),
+        j.value("clientBufferCount", uint32_t(8)),
+        j.value("overflowPolicy", OverflowPolicy()),
+        j.value("protocol", ChannelProtocol::Tcp),
+        milliseconds(j.value("staleFrameGraceMs", SocketChannel::kDefaultStaleFrameGrace.count())),
+        j.value("transport", TransportProfile())
     );
 }
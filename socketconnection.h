@@ -0,0 +1,1755 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+#include <iostream>
+#include <bit>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <array>
+#include <optional>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <cerrno>
+#include "json.hpp"
+#include "global.h"
+#include "utilities.h"
+#include "socketreactor.h"
+#include "framering.h"
+#include "batchpolicy.h"
+#include "datagram.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "transport.h"
+
+// How long to wait for a connection to be established.  How long a batch may take to be sent
+// is part of the TransportProfile.
+
+constexpr auto kConnectTimeout = 3000ms; 
+
+// SendStats
+//
+// How the channel's writes are going: how often a batch only partly fit in the kernel's send
+// buffer, how long we've spent waiting for that buffer to drain, and how many batches missed
+// their deadline altogether
+
+struct SendStats
+{
+    uint64_t partialSends = 0;
+    uint64_t blockedMicroseconds = 0;
+    double   blockedFraction = 0;       // Share of the last second spent waiting to be able to write
+    uint64_t sendTimeouts = 0;
+    uint64_t droppedDatagrams = 0;      // UDP only: frames the kernel refused, or sent to nobody listening
+    uint64_t uplinkDeferrals = 0;       // Batches the UplinkScheduler held back
+
+    friend void to_json(nlohmann::json& j, const SendStats& stats)
+    {
+        j = {
+            {"partialSends",    stats.partialSends},
+            {"blockedMs",       stats.blockedMicroseconds / 1000},
+            {"blockedFraction", stats.blockedFraction},
+            {"sendTimeouts",    stats.sendTimeouts},
+            {"droppedDatagrams", stats.droppedDatagrams},
+            {"uplinkDeferrals", stats.uplinkDeferrals}
+        };
+    }
+};
+
+// TcpInfo
+//
+// What the kernel knows about a TCP connection, sampled from TCP_INFO once a second on Linux.
+// Its smoothed RTT and retransmits tell a congested WiFi link apart from a slow client.
+
+struct TcpInfo
+{
+    uint32_t rttMicroseconds = 0;       // Smoothed round-trip time
+    uint32_t rttVarMicroseconds = 0;
+    uint32_t congestionWindow = 0;      // In segments
+    uint32_t mss = 0;
+    uint32_t unacked = 0;               // Segments sent and not yet acknowledged
+    uint32_t lost = 0;                  // Segments the kernel currently believes lost
+    uint32_t retransmits = 0;           // Segments retransmitted over the life of the connection
+
+    friend void to_json(nlohmann::json& j, const TcpInfo& info)
+    {
+        j = {
+            {"rttUs",       info.rttMicroseconds},
+            {"rttVarUs",    info.rttVarMicroseconds},
+            {"cwnd",        info.congestionWindow},
+            {"mss",         info.mss},
+            {"unacked",     info.unacked},
+            {"lost",        info.lost},
+            {"retransmits", info.retransmits}
+        };
+    }
+};
+
+// ChannelLatency
+//
+// Where the time goes between a frame being queued and the client telling us it has it:
+//
+//   queueWait    - From being queued to the batch it's in starting to go out, per frame
+//   sendDuration - From a batch starting to go out to the kernel having taken all of it, per batch
+//   roundTrip    - From a frame starting to go out to the client's response for it, per response
+//
+// all of them over the last few seconds (see LatencyHistogram), plus the kernel's view of the
+// connection if we have one.
+
+struct ChannelLatency
+{
+    HistogramSnapshot queueWait;
+    HistogramSnapshot sendDuration;
+    HistogramSnapshot roundTrip;
+    optional<TcpInfo> tcp;
+
+    // The full distributions, which are too much to send for every socket in a listing
+
+    nlohmann::json Buckets() const
+    {
+        return {
+            {"queueWaitUs",    queueWait.Buckets()},
+            {"sendDurationUs", sendDuration.Buckets()},
+            {"rttUs",          roundTrip.Buckets()}
+        };
+    }
+
+    friend void to_json(nlohmann::json& j, const ChannelLatency& latency)
+    {
+        j = {
+            {"queueWaitUs",    latency.queueWait},
+            {"sendDurationUs", latency.sendDuration},
+            {"rttUs",          latency.roundTrip}
+        };
+
+        if (latency.tcp)
+            j["tcpInfo"] = *latency.tcp;
+    }
+};
+
+// ClientResponse
+//
+// Response data sent back to server every time we receive a packet.
+// This struct is packed to match the exact network protocol format used by ESP32 clients.
+// The packed attribute is required to ensure correct network communication but may cause
+// alignment issues on some architectures.
+
+inline static double ByteSwapDouble(double value)
+{
+    // Helper function to swap bytes in a double
+    uint64_t temp;
+    memcpy(&temp, &value, sizeof(double)); // Copy bits of double to temp
+    temp = __builtin_bswap64(temp);        // Byte swap the 64-bit integer
+    memcpy(&value, &temp, sizeof(double)); // Copy bits back to double
+    return value;
+}
+
+struct OldClientResponse
+{
+    uint32_t size;         // 4
+    uint32_t flashVersion; // 4
+    double currentClock;   // 8
+    double oldestPacket;   // 8
+    double newestPacket;   // 8
+    double brightness;     // 8
+    double wifiSignal;     // 8
+    uint32_t bufferSize;   // 4
+    uint32_t bufferPos;    // 4
+    uint32_t fpsDrawing;   // 4
+    uint32_t watts;        // 4
+} __attribute__((packed)); // Packed attribute required for network protocol compatibility
+
+struct ClientResponse
+{
+    uint32_t size = sizeof(ClientResponse);         // 4
+    uint64_t sequence = 0;                          // 8
+    uint32_t flashVersion = 0;                      // 4
+    double currentClock = 0;                        // 8
+    double oldestPacket = 0;                        // 8
+    double newestPacket = 0;                        // 8
+    double brightness = 0;                          // 8
+    double wifiSignal = 0;                          // 8
+    uint32_t bufferSize = 0;                        // 4
+    uint32_t bufferPos = 0;                         // 4
+    uint32_t fpsDrawing = 0;                        // 4
+    uint32_t watts = 0;                             // 4
+
+    ClientResponse& operator=(const OldClientResponse& old)
+    {
+        size = sizeof(ClientResponse);;
+        sequence = 0;  // New field, initialize to 0
+        flashVersion = old.flashVersion;
+        currentClock = old.currentClock;
+        oldestPacket = old.oldestPacket;
+        newestPacket = old.newestPacket;
+        brightness = old.brightness;
+        wifiSignal = old.wifiSignal;
+        bufferSize = old.bufferSize;
+        bufferPos = old.bufferPos;
+        fpsDrawing = old.fpsDrawing;
+        watts = old.watts;
+        return *this;
+    }
+
+    // Member function to translate the structure from the ESP32 little endian
+    // to whatever the current running system is
+
+    void TranslateClientResponse()
+    {
+        // Check the system's endianness
+        if constexpr (endian::native == endian::little)
+            return; // No-op for little-endian systems
+
+        // Perform byte swaps for big-endian systems
+        size = __builtin_bswap32(size);
+        sequence = __builtin_bswap64(sequence); // Added missing sequence swap
+        flashVersion = __builtin_bswap32(flashVersion);
+        currentClock = ByteSwapDouble(currentClock);
+        oldestPacket = ByteSwapDouble(oldestPacket);
+        newestPacket = ByteSwapDouble(newestPacket);
+        brightness = ByteSwapDouble(brightness);
+        wifiSignal = ByteSwapDouble(wifiSignal);
+        bufferSize = __builtin_bswap32(bufferSize);
+        bufferPos = __builtin_bswap32(bufferPos);
+        fpsDrawing = __builtin_bswap32(fpsDrawing);
+        watts = __builtin_bswap32(watts);
+    }
+
+    friend void to_json(nlohmann::json &j, const ClientResponse &response)
+    {
+        j ={
+                {"responseSize", response.size},
+                {"sequenceNumber", response.sequence},
+                {"flashVersion", response.flashVersion},
+                {"currentClock", response.currentClock},
+                {"oldestPacket", response.oldestPacket},
+                {"newestPacket", response.newestPacket},
+                {"brightness", response.brightness},
+                {"wifiSignal", response.wifiSignal},
+                {"bufferSize", response.bufferSize},
+                {"bufferPos", response.bufferPos},
+                {"fpsDrawing", response.fpsDrawing},
+                {"watts", response.watts}
+        };
+    }
+
+    friend void from_json(const nlohmann::json& j, ClientResponse& response) 
+    {
+        response.size = j.at("responseSize").get<uint8_t>();
+        response.sequence = j.at("sequenceNumber").get<uint32_t>();
+        response.flashVersion = j.at("flashVersion").get<uint32_t>();
+        response.currentClock = j.at("currentClock").get<uint64_t>();
+        response.oldestPacket = j.at("oldestPacket").get<uint64_t>();
+        response.newestPacket = j.at("newestPacket").get<uint64_t>();
+        response.brightness = j.at("brightness").get<uint8_t>();
+        response.wifiSignal = j.at("wifiSignal").get<int8_t>();
+        response.bufferSize = j.at("bufferSize").get<uint32_t>();
+        response.bufferPos = j.at("bufferPos").get<uint32_t>();
+        response.fpsDrawing = j.at("fpsDrawing").get<float>();
+        response.watts = j.at("watts").get<float>();
+    }
+
+} __attribute__((packed)); // Packed attribute required for network protocol compatibility
+
+// ResponseStream
+//
+// Reassembles client responses from whatever the socket hands us.  Reads go straight into the
+// free space of a fixed ring, up to a few kilobytes at a time, and complete responses are parsed
+// out of it in place.  A response split across reads is simply finished by the next one, and
+// nothing is allocated per read or per response.  The first byte of each response is the low
+// byte of its size field, which tells us which version of the response struct the client is
+// sending.
+
+class ResponseStream
+{
+    static constexpr size_t kCapacity = 4096;
+
+    array<uint8_t, kCapacity> _buffer;
+    uint64_t _head = 0;         // Next byte to parse
+    uint64_t _tail = 0;         // Next byte to receive into
+
+    void CopyOut(uint64_t position, void * destination, size_t size) const
+    {
+        size_t offset = position % kCapacity;
+        size_t first = min(size, kCapacity - offset);
+        memcpy(destination, _buffer.data() + offset, first);
+        memcpy(static_cast<uint8_t *>(destination) + first, _buffer.data(), size - first);
+    }
+
+public:
+    // ReceiveBuffers
+    //
+    // All of the free space, as one or two buffers for a scatter read.  Parse never leaves more
+    // than a partial response behind, so there's always plenty.
+
+    array<asio::mutable_buffer, 2> ReceiveBuffers()
+    {
+        size_t offset = _tail % kCapacity;
+        size_t free = kCapacity - (_tail - _head);
+        size_t first = min(free, kCapacity - offset);
+
+        return { asio::buffer(_buffer.data() + offset, first), asio::buffer(_buffer.data(), free - first) };
+    }
+
+    void Commit(size_t bytesReceived)
+    {
+        _tail += bytesReceived;
+    }
+
+    // Parse
+    //
+    // Calls onResponse for every complete response received so far, oldest first, and keeps any
+    // partial one for next time.  Bytes that can't be the start of a response are skipped one at
+    // a time until we're back in step; returns how many were.
+
+    template <typename Handler>
+    size_t Parse(Handler onResponse)
+    {
+        size_t skipped = 0;
+
+        while (_head != _tail)
+        {
+            size_t available = _tail - _head;
+            uint8_t byteCount = _buffer[_head % kCapacity];
+
+            if (byteCount == static_cast<uint8_t>(sizeof(ClientResponse)))
+            {
+                if (available < sizeof(ClientResponse))
+                    break;
+
+                ClientResponse response;
+                CopyOut(_head, &response, sizeof(ClientResponse));
+                _head += sizeof(ClientResponse);
+
+                response.TranslateClientResponse();
+                onResponse(response);
+            }
+            else if (byteCount == static_cast<uint8_t>(sizeof(OldClientResponse)))
+            {
+                if (available < sizeof(OldClientResponse))
+                    break;
+
+                OldClientResponse oldResponse;
+                CopyOut(_head, &oldResponse, sizeof(OldClientResponse));
+                _head += sizeof(OldClientResponse);
+
+                ClientResponse response;
+                response = oldResponse;
+                response.TranslateClientResponse();
+                onResponse(response);
+            }
+            else
+            {
+                _head++;
+                skipped++;
+            }
+        }
+
+        return skipped;
+    }
+
+    // Clear
+    //
+    // Forgets anything unparsed, for a new connection or a datagram that's been dealt with
+
+    void Clear()
+    {
+        _head = _tail;
+    }
+};
+
+
+// ChannelQueue
+//
+// One channel's frames as its connection sees them: the channel's FrameRing, how much of it is in
+// the batch being written, and the per-channel stats that only the sender can keep.  Shared by
+// the channel and, while the channel is attached, its connection.  Apart from the ring's producer
+// side, the grace period, which never changes, and the dropped frame counts and metrics block,
+// which anyone may read or add to, everything here is only touched on the connection's strand.
+
+struct ChannelQueue
+{
+    static constexpr uint64_t kNoFence = numeric_limits<uint64_t>::max();
+
+    ChannelQueue(size_t capacity, milliseconds staleFrameGrace) : ring(capacity), staleFrameGrace(staleFrameGrace)
+    {
+    }
+
+    FrameRing        ring;
+    const milliseconds staleFrameGrace;     // How late a frame may be and still get sent
+    atomic<uint64_t> staleFrames{0};
+    atomic<uint64_t> replacedFrames{0};     // Released unsent because a re-prime superseded them
+    atomic<int64_t>  rePrimeRequested{0};   // steady_clock ticks of a reconnect not yet re-primed for, or zero
+    atomic<uint64_t> rePrimeFence{kNoFence};    // Where the pipeline's replay starts in the ring
+    TransportProfile transport;             // The channel's own profile; strand only
+    uint64_t         inFlightEnd = 0;       // Ring position just past this channel's last frame in the batch
+    size_t           inFlightFrames = 0;    // None means this channel has nothing in the batch
+    ChannelMetrics   metrics;
+    LatencyHistogram queueWait;
+};
+
+// SocketConnection
+//
+// One connection to a NightDriverStrip client, shared by every SocketChannel that sends to the
+// same host, port and protocol.  A controller driving four outputs used to get four connections
+// from us, with four keepalive streams and four sets of round trips over its WiFi; now its four
+// features each keep their own queue, but their frames are interleaved, oldest first, into
+// combined batches on the one connection.  The channel field in every frame's header tells the
+// client which output a frame is for, and every response the client sends back applies to all
+// of the channels.
+//
+// The connection has no thread of its own: connecting, writing and reading client responses are
+// asynchronous operations on the shared SocketReactor, and their completion handlers run on the
+// connection's strand, as does anything the channels do to their queues as consumers.  It
+// connects as soon as its first channel is attached, reconnects on its own if the connection is
+// lost, and closes once its last channel is detached.
+
+class SocketConnection : public enable_shared_from_this<SocketConnection>
+{
+    static constexpr size_t kRoundTripWindow = 512;                     // Frames we remember sending, to match responses against
+    static constexpr auto   kRePrimeTimeout = 1s;                       // How long a channel waits for the pipeline to re-prime it
+    static constexpr uint32_t kBreakerFailures = 2;                     // Failed attempts in a row that trip the breaker
+    static constexpr size_t kResponseHistory = 64;
+    static constexpr auto   kTcpInfoInterval = 1s;
+
+    string _hostName;
+    uint16_t _port;
+    const ChannelProtocol _protocol;
+
+    mutable mutex _responseMutex;
+    mutable mutex _connectMutex;
+    ConnectStats _connectStats;                 // Under _connectMutex
+    steady_clock::time_point _retryAt;          // Under _connectMutex
+    mutable mutex _tcpInfoMutex;
+    optional<TcpInfo> _tcpInfo;                 // Under _tcpInfoMutex; only while connected over TCP
+
+    atomic<bool> _isConnected;
+    atomic<bool> _breakerOpen;                  // See IsBreakerOpen
+    atomic<bool> _running;                      // At least one channel is attached
+    atomic<bool> _wakePending;                  // A TrySend has been posted and hasn't run yet
+    atomic<size_t> _channelCount;
+
+    // Everything below the strand is only touched by handlers running on the strand, or by
+    // the destructor once no handlers can be outstanding anymore
+
+    asio::strand<asio::io_context::executor_type> _strand;
+    asio::ip::tcp::socket _socket;
+    asio::ip::udp::socket _udpSocket;           // Used instead of _socket for ChannelProtocol::Udp
+    asio::steady_timer _deadlineTimer;          // Connect and write timeouts
+    asio::steady_timer _batchTimer;             // Sends a partial batch once the batch delay has passed
+    asio::steady_timer _reconnectTimer;         // Backoff delay and connect rate limiting
+    asio::steady_timer _tcpInfoTimer;
+
+    // A channel's queue in the batch being assembled or written, and how much of it is there
+
+    struct BatchMember
+    {
+        shared_ptr<ChannelQueue>        queue;  // Keeps the ring alive while the kernel may still be reading from it
+        uint64_t                        end = 0;        // Just past the last frame taken from this queue
+        uint64_t                        cursor = 0;     // Just past next
+        optional<FrameRing::Frame>      next;           // The queue's oldest frame that isn't in the batch yet
+        size_t                          frames = 0;
+        size_t                          bytes = 0;
+    };
+
+    vector<shared_ptr<ChannelQueue>> _queues;   // The attached channels
+    vector<BatchMember> _batchMembers;
+
+    uint64_t _connectionEpoch;                  // Bumped on every close so handlers of an old connection can tell
+    size_t _addressCount = 0;                   // How many addresses the host last resolved to
+    bool _writeInProgress;
+    bool _batchTimerArmed;
+    steady_clock::time_point _lastSendTime;
+    ReconnectBackoff _backoff;
+    vector<asio::const_buffer> _sendBuffers;    // Point straight into the channels' rings while a write is in flight
+    DatagramBatch _datagrams;                   // The same batch as datagrams, for ChannelProtocol::Udp
+    uint64_t _framesSent;                       // On this connection, which is also the last frame's sequence number
+    uint64_t _lastMatchedSequence;              // The newest frame we've had a response for
+    array<steady_clock::time_point, kRoundTripWindow> _frameSendTimes;  // Indexed by sequence number
+    size_t _sendIndex;                          // First buffer that hasn't been fully written yet
+    steady_clock::time_point _batchDeadline;    // The whole batch has to be written by then
+    ResponseStream _responseStream;
+
+    ClientResponse _lastClientResponse;                     // Under _responseMutex, as are the next three
+    system_clock::time_point _lastResponseTime;
+    array<ClientResponse, kResponseHistory> _responseHistory;
+    uint64_t _responseCount;
+    BatchPolicy _batchPolicy;
+    mutable mutex _transportMutex;
+    TransportProfile _transport;                // Merged from the channels' profiles; written on the strand under _transportMutex
+    uint64_t _uplinkFlow = 0;                   // Our flow in the UplinkScheduler
+    atomic<uint64_t> _uplinkDeferrals{0};
+    LatencyHistogram _sendDurationHistogram;
+    LatencyHistogram _roundTripHistogram;
+
+    atomic<uint32_t> _reconnectCount;
+    atomic<uint64_t> _partialSends;
+    atomic<uint64_t> _sendTimeouts;
+    atomic<uint64_t> _droppedDatagrams;
+    atomic<uint64_t> _invalidResponseBytes;
+    atomic<int64_t>  _blockedSince;             // When we started waiting for room in the send buffer, or 0 if we aren't
+
+public:
+    SocketConnection(const string& hostName,
+                     uint16_t port,
+                     ChannelProtocol protocol,
+                     uint32_t clientBufferCount)
+        : _hostName(hostName),
+          _port(port),
+          _protocol(protocol),
+          _isConnected(false),
+          _breakerOpen(false),
+          _running(false),
+          _wakePending(false),
+          _channelCount(0),
+          _strand(asio::make_strand(SocketReactor::Instance().Context())),
+          _socket(_strand),
+          _udpSocket(_strand),
+          _deadlineTimer(_strand),
+          _batchTimer(_strand),
+          _reconnectTimer(_strand),
+          _tcpInfoTimer(_strand),
+          _connectionEpoch(0),
+          _writeInProgress(false),
+          _batchTimerArmed(false),
+          _lastSendTime(steady_clock::now()),
+          _backoff(static_cast<uint32_t>(hash<string>{}(hostName) ^ port)),
+          _datagrams(BatchPolicy::kMaxBatchFrames),
+          _framesSent(0),
+          _lastMatchedSequence(0),
+          _sendIndex(0),
+          _lastClientResponse(),
+          _responseCount(0),
+          _batchPolicy(clientBufferCount),
+          _reconnectCount(0),
+          _partialSends(0),
+          _sendTimeouts(0),
+          _droppedDatagrams(0),
+          _invalidResponseBytes(0),
+          _blockedSince(0)
+    {
+        _sendBuffers.reserve(BatchPolicy::kMaxBatchFrames);
+    }
+
+    ~SocketConnection()
+    {
+        // Every pending handler holds a reference to us, so by the time we get here nothing
+        // else can be using the socket and it is safe to close it from this thread
+
+        _running = false;
+        CloseSocket();
+        SocketReactor::Instance().Uplink().Unregister(_uplinkFlow);
+    }
+
+    // Acquire
+    //
+    // The connection to hostName:port over protocol, shared with any channel that already has
+    // one, or a new one.  A connection lives as long as some channel holds on to it.  The first
+    // channel's client buffer count sizes the batches, since the client has one buffer however
+    // many outputs it drives.
+
+    static shared_ptr<SocketConnection> Acquire(const string& hostName, uint16_t port, ChannelProtocol protocol, uint32_t clientBufferCount)
+    {
+        static mutex registryMutex;
+        static map<tuple<string, uint16_t, ChannelProtocol>, weak_ptr<SocketConnection>> registry;
+
+        lock_guard lock(registryMutex);
+        erase_if(registry, [](const auto& entry) { return entry.second.expired(); });
+
+        auto& entry = registry[{ hostName, port, protocol }];
+        auto connection = entry.lock();
+        if (!connection)
+        {
+            connection = make_shared<SocketConnection>(hostName, port, protocol, clientBufferCount);
+            connection->_uplinkFlow = SocketReactor::Instance().Uplink().Register([weak = weak_ptr(connection)]()
+            {
+                if (auto connection = weak.lock())
+                    connection->Wake();
+            });
+            entry = connection;
+        }
+
+        return connection;
+    }
+
+    const asio::strand<asio::io_context::executor_type>& Strand() const
+    {
+        return _strand;
+    }
+
+    // Attach
+    //
+    // Starts sending a channel's frames with its transport profile, and connects if it's the first
+    // channel to attach
+
+    void Attach(shared_ptr<ChannelQueue> queue, const TransportProfile& transport)
+    {
+        asio::post(_strand, [self = shared_from_this(), queue, transport]()
+        {
+            queue->transport = transport;
+            self->_queues.push_back(queue);
+            self->_channelCount = self->_queues.size();
+            self->ApplyTransport();
+
+            if (!self->_running.exchange(true))
+                self->Connect();
+            else
+                self->TrySend();
+        });
+    }
+
+    // SetTransport
+    //
+    // Must be called on the strand.  Changes an attached channel's transport profile.
+
+    void SetTransport(const shared_ptr<ChannelQueue>& queue, const TransportProfile& transport)
+    {
+        queue->transport = transport;
+        if (ranges::find(_queues, queue) != _queues.end())
+            ApplyTransport();
+    }
+
+    // GetTransport
+    //
+    // The profile the connection uses, merged from those of all the channels attached to it
+
+    TransportProfile GetTransport() const
+    {
+        lock_guard lock(_transportMutex);
+        return _transport;
+    }
+
+    // ApplyTransport
+    //
+    // Must be called on the strand.  Switches the connection to its channels' transport profiles,
+    // merged by MergeTransports so the result doesn't depend on which channel came or changed last:
+    // the batch ceilings and send timeout apply from the next batch on, and the socket options
+    // are applied to the open socket right away.  Options that a profile leaves at zero to mean
+    // "the kernel's default" can't be taken back on an open socket, so turning them off only
+    // takes effect with the next connection.
+
+    void ApplyTransport()
+    {
+        if (_queues.empty())
+            return;
+
+        auto transport = _queues.front()->transport;
+        for (size_t i = 1; i < _queues.size(); i++)
+            transport = MergeTransports(transport, _queues[i]->transport);
+
+        if (transport == _transport)
+            return;
+
+        {
+            lock_guard lock(_transportMutex);
+            _transport = transport;
+        }
+        _batchPolicy.SetCeilings(transport.maxBatchFrames, transport.maxBatchBytes, transport.maxBatchDelay);
+        SocketReactor::Instance().Uplink().SetFlowLimits(_uplinkFlow, transport.maxBytesPerSecond, transport.weight);
+
+        if (_socket.is_open())
+            SetSocketOptions(_socket.native_handle());
+        else if (_udpSocket.is_open())
+            SetSendBufferSize(_udpSocket.native_handle());
+
+        logger->debug("Applied transport profile to {}:{}", _hostName, _port);
+    }
+
+    // Detach
+    //
+    // Must be called on the strand.  Stops sending a channel's frames, and closes the connection
+    // if no other channel is left on it.  Frames of the channel's that are in the batch being
+    // written still go out.
+
+    void Detach(const shared_ptr<ChannelQueue>& queue)
+    {
+        erase(_queues, queue);
+        _channelCount = _queues.size();
+        ApplyTransport();
+
+        if (!_queues.empty() || !_running.exchange(false))
+            return;
+
+        CloseSocket();
+        _reconnectTimer.cancel();
+        _batchTimer.cancel();
+        _batchTimerArmed = false;
+        SetConnectionState(ConnectionState::Stopped);
+    }
+
+    // Wake
+    //
+    // Called by a channel's producer when a new frame calls for a send (see SocketChannel::WakeSender)
+
+    void Wake()
+    {
+        if (_wakePending.exchange(true))
+            return;
+
+        asio::post(_strand, [self = shared_from_this()]()
+        {
+            // Clear the flag before looking at the queues, so a frame that arrives from here on
+            // either gets seen by this TrySend or posts a wake of its own
+
+            self->_wakePending = false;
+            self->TrySend();
+        });
+    }
+
+    // ResetConnection
+    //
+    // Must be called on the strand.  Drops the current connection (if any) and schedules a new
+    // attempt.
+
+    void ResetConnection()
+    {
+        CloseSocket();
+        ScheduleReconnect();
+    }
+
+    bool IsConnected() const
+    {
+        return _isConnected;
+    }
+
+    // IsBreakerOpen
+    //
+    // Whether the client is unreachable and has been for kBreakerFailures connection attempts, so
+    // that nobody should bother building frames for it.  Our reconnect attempts carry on in the
+    // background and are what closes the breaker again.  A connection that just dropped doesn't
+    // trip it, as the client may well be back before the frames queued meanwhile are due.
+
+    bool IsBreakerOpen() const
+    {
+        return _breakerOpen;
+    }
+
+    size_t ChannelCount() const
+    {
+        return _channelCount;
+    }
+
+    uint32_t GetReconnectCount() const
+    {
+        return _reconnectCount;
+    }
+
+    ConnectStats GetConnectStats() const
+    {
+        lock_guard lock(_connectMutex);
+        ConnectStats stats = _connectStats;
+        stats.retryInMs = max<int64_t>(0, duration_cast<milliseconds>(_retryAt - steady_clock::now()).count());
+        return stats;
+    }
+
+    BatchLimits GetBatchLimits() const
+    {
+        return _batchPolicy.Current();
+    }
+
+    // GetSendStats
+    //
+    // The connection's send stats as seen by one of its channels, whose metrics hold the time
+    // spent blocked
+
+    SendStats GetSendStats(const ChannelQueue& queue) const
+    {
+        SendStats stats;
+        stats.partialSends = _partialSends;
+        stats.blockedMicroseconds = queue.metrics.blockedMicroseconds.Total();
+        stats.blockedFraction = queue.metrics.blockedMicroseconds.PerSecond() / 1e6;
+
+        // A wait that's still going on counts too, or a connection that's stuck right now would look idle
+
+        if (int64_t blockedSince = _blockedSince.load(memory_order_relaxed))
+            stats.blockedFraction += duration<double>(steady_clock::duration(steady_clock::now().time_since_epoch().count() - blockedSince)) / 1s;
+
+        stats.blockedFraction = min(1.0, stats.blockedFraction);
+        stats.sendTimeouts = _sendTimeouts;
+        stats.droppedDatagrams = _droppedDatagrams;
+        stats.uplinkDeferrals = _uplinkDeferrals;
+        return stats;
+    }
+
+    // GetLatency
+    //
+    // Everything but the queue wait, which each channel keeps for itself
+
+    ChannelLatency GetLatency() const
+    {
+        ChannelLatency latency;
+        latency.sendDuration = _sendDurationHistogram.Snapshot();
+        latency.roundTrip = _roundTripHistogram.Snapshot();
+
+        lock_guard lock(_tcpInfoMutex);
+        latency.tcp = _tcpInfo;
+        return latency;
+    }
+
+    // LastClientResponse
+    //
+    // A copy of the last success/stats packet we got back from the client
+
+    ClientResponse LastClientResponse() const
+    {
+        constexpr auto kMaxResponseAge = 2s;
+
+        lock_guard lock(_responseMutex);
+        if (system_clock::now() - _lastResponseTime > kMaxResponseAge)
+            return ClientResponse {}; // Return empty response if too old
+
+        return _lastClientResponse;
+    }
+
+    // RecentClientResponses
+    //
+    // Up to the last kResponseHistory responses, oldest first, so the per-frame stats in each of
+    // them aren't lost just because another one came in right behind it
+
+    vector<ClientResponse> RecentClientResponses() const
+    {
+        lock_guard lock(_responseMutex);
+
+        size_t count = min<uint64_t>(_responseCount, kResponseHistory);
+        vector<ClientResponse> responses;
+        responses.reserve(count);
+
+        for (uint64_t i = _responseCount - count; i < _responseCount; i++)
+            responses.push_back(_responseHistory[i % kResponseHistory]);
+
+        return responses;
+    }
+
+    uint64_t GetResponseCount() const
+    {
+        lock_guard lock(_responseMutex);
+        return _responseCount;
+    }
+
+    uint64_t GetInvalidResponseBytes() const
+    {
+        return _invalidResponseBytes;
+    }
+
+private:
+
+    // Connect
+    //
+    // Starts one pass through the connect cycle: resolve the host name (usually straight from the
+    // cache), wait for a slot from the process-wide ConnectRateLimiter, then issue a non-blocking
+    // connect bounded by kConnectTimeout.  Every step checks the epoch, so closing the socket in
+    // the meantime cancels the rest of the cycle.  Any failure along the way backs off and starts
+    // over.
+
+    void Connect()
+    {
+        if (!_running || IsSocketOpen())
+            return;
+
+        SetConnectionState(ConnectionState::Resolving);
+
+        auto epoch = _connectionEpoch;
+        SocketReactor::Instance().Resolver().Resolve(_hostName,
+            [self = shared_from_this(), epoch](const asio::error_code& error, const HostResolver::Addresses& addresses)
+        {
+            asio::post(self->_strand, [self, epoch, error, addresses]()
+            {
+                if (epoch == self->_connectionEpoch && self->_running)
+                    self->OnResolved(error, addresses);
+            });
+        });
+    }
+
+    void OnResolved(const asio::error_code& error, const HostResolver::Addresses& addresses)
+    {
+        if (error)
+            return OnConnectFailed("could not resolve host: " + error.message());
+
+        // If a host has several addresses, each failure moves on to the next one
+
+        _addressCount = addresses.size();
+        auto address = addresses[_backoff.Failures() % addresses.size()];
+
+        auto now = steady_clock::now();
+        auto slot = SocketReactor::Instance().ConnectLimiter().Reserve(now);
+        if (slot <= now)
+            return StartConnect(address);
+
+        SetConnectionState(ConnectionState::WaitingForSlot, slot);
+
+        auto epoch = _connectionEpoch;
+        _reconnectTimer.expires_at(slot);
+        _reconnectTimer.async_wait([self = shared_from_this(), epoch, address](const asio::error_code& error)
+        {
+            if (!error && epoch == self->_connectionEpoch)
+                self->StartConnect(address);
+        });
+    }
+
+    void StartConnect(const asio::ip::address& address)
+    {
+        logger->debug("Attempting to connect to {}:{} at {}", _hostName, _port, address.to_string());
+        {
+            lock_guard lock(_connectMutex);
+            _connectStats.state = ConnectionState::Connecting;
+            _connectStats.address = address.to_string();
+            _connectStats.attempts++;
+        }
+
+        asio::error_code error;
+
+        // There's no handshake for UDP; connecting just fixes where our datagrams go and which
+        // ones we accept in return
+
+        if (_protocol == ChannelProtocol::Udp)
+        {
+            asio::ip::udp::endpoint endpoint(address, _port);
+            _udpSocket.open(endpoint.protocol(), error);
+            if (!error)
+            {
+                SetSendBufferSize(_udpSocket.native_handle());
+                _udpSocket.connect(endpoint, error);
+            }
+            if (error)
+                return OnConnectFailed(error.message());
+
+            return OnConnected();
+        }
+
+        // Set socket options (keepalive, buffer sizes, Nagle) before the connect is issued
+
+        asio::ip::tcp::endpoint endpoint(address, _port);
+        _socket.open(endpoint.protocol(), error);
+        if (error || !SetSocketOptions(_socket.native_handle()))
+            return OnConnectFailed("could not set socket options");
+
+        auto epoch = _connectionEpoch;
+
+        _deadlineTimer.expires_after(kConnectTimeout);
+        _deadlineTimer.async_wait([self = shared_from_this(), epoch](const asio::error_code& error)
+        {
+            if (error || epoch != self->_connectionEpoch)
+                return;
+
+            self->OnConnectFailed("connection timed out", true);
+        });
+
+        _socket.async_connect(endpoint, [self = shared_from_this(), epoch](const asio::error_code& error)
+        {
+            if (epoch != self->_connectionEpoch)
+                return;
+
+            if (error)
+                return self->OnConnectFailed(error.message(), true);
+
+            self->OnConnected();
+        });
+    }
+
+    // OnConnectFailed
+    //
+    // Backs off and starts over.  unreachable means we got as far as a TCP connect to an address
+    // the host resolved to, and it failed or timed out.  Once that has happened to every one of the
+    // host's addresses in turn, they may all be stale, so the host is looked up again next time.
+    // A failed lookup stays cached for the resolver's kFailureTtl.
+
+    void OnConnectFailed(const string& reason, bool unreachable = false)
+    {
+        logger->warn("Could not connect to {}:{}: {}", _hostName, _port, reason);
+        {
+            lock_guard lock(_connectMutex);
+            _connectStats.lastError = reason;
+        }
+
+        if (unreachable && _addressCount && (_backoff.Failures() + 1) % _addressCount == 0)
+            SocketReactor::Instance().Resolver().Forget(_hostName);
+        ResetConnection();
+    }
+
+    void OnConnected()
+    {
+        _deadlineTimer.cancel();
+        _batchPolicy.Reset();
+        _framesSent = 0;
+        _lastMatchedSequence = 0;
+
+        // Writes are issued directly and must never block an I/O thread
+
+        asio::error_code error;
+        if (_protocol == ChannelProtocol::Udp)
+            _udpSocket.non_blocking(true, error);
+        else
+            _socket.non_blocking(true, error);
+
+        if (error)
+        {
+            logger->warn("Could not make socket non-blocking for {}:{}: {}", _hostName, _port, error.message());
+            ResetConnection();
+            return;
+        }
+
+        // The client may well have lost what it had buffered, so after a reconnect each channel
+        // asks its canvas pipeline to re-prime it (see HoldForRePrime)
+
+        _isConnected = true;
+        if (_reconnectCount++ > 0)
+        {
+            auto now = steady_clock::now().time_since_epoch().count();
+            for (const auto& queue : _queues)
+            {
+                queue->metrics.reconnects.Add();
+                queue->rePrimeRequested.store(now, memory_order_relaxed);
+            }
+        }
+        _backoff.Reset();
+        SetConnectionState(ConnectionState::Connected);
+        logger->info("Connection number {} to {}:{} for {} channel(s)", _reconnectCount.load(), _hostName, _port, _queues.size());
+
+        StartRead();
+        SampleTcpInfo();
+        TrySend();
+    }
+
+    // ScheduleReconnect
+    //
+    // Waits out the backoff delay, which grows with every consecutive failure, and then tries again
+
+    void ScheduleReconnect()
+    {
+        if (!_running)
+            return;
+
+        auto delay = _backoff.NextDelay();
+        SetConnectionState(ConnectionState::BackingOff, steady_clock::now() + delay);
+
+        _reconnectTimer.expires_after(delay);
+        _reconnectTimer.async_wait([self = shared_from_this()](const asio::error_code& error)
+        {
+            if (!error)
+                self->Connect();
+        });
+    }
+
+    // SetConnectionState
+    //
+    // Records where we are in the connect cycle for GetConnectStats
+
+    void SetConnectionState(ConnectionState state, steady_clock::time_point retryAt = {})
+    {
+        lock_guard lock(_connectMutex);
+        _connectStats.state = state;
+        _connectStats.consecutiveFailures = _backoff.Failures();
+        _retryAt = retryAt;
+
+        bool breakerOpen = state != ConnectionState::Connected && _backoff.Failures() >= kBreakerFailures;
+        if (_breakerOpen.exchange(breakerOpen) != breakerOpen)
+            logger->info("Circuit breaker for {}:{} is now {}", _hostName, _port, breakerOpen ? "open" : "closed");
+    }
+
+    // TrySend
+    //
+    // Called on the strand whenever a frame is queued, a write completes, a client response comes
+    // in or the batch timer fires.  The BatchPolicy says how many frames or bytes make a batch and
+    // how long a partial batch may wait, and how many frames the client has room for; a batch goes
+    // out when any of the first three limits is reached, as long as there are credits left.  Only
+    // one batch is ever in flight per connection, and it has the profile's sendTimeout from the moment it
+    // starts to get written in full.
+    //
+    // A batch takes frames from all of the attached channels' queues, always the oldest one next,
+    // so a busy channel can't starve a quiet one.  It is written as a gather list with one buffer
+    // per frame, each pointing at the frame where it sits in its ring, so frames are never copied
+    // on the way out.  Each write is a single non-blocking sendmsg() with an iovec array; after a
+    // short write we pick up part way through a buffer once the socket is writable again.  The
+    // frames stay in the rings until the whole batch is written and are only released then.
+
+    void TrySend()
+    {
+        for (const auto& queue : _queues)
+            queue->metrics.wakeups.Add();
+
+        if (!_isConnected || _writeInProgress)
+            return;
+
+        auto now = steady_clock::now();
+        bool holding = false;
+        for (const auto& queue : _queues)
+            holding |= HoldForRePrime(*queue, now);
+
+        DropStaleFrames();
+
+        size_t queuedFrames = 0;
+        size_t queuedBytes = 0;
+        for (const auto& queue : _queues)
+        {
+            if (queue->rePrimeRequested.load(memory_order_relaxed))
+                continue;
+
+            queuedFrames += queue->ring.FrameCount();
+            queuedBytes += queue->ring.QueuedBytes();
+        }
+
+        if (queuedFrames == 0)
+        {
+            if (holding)
+                ArmBatchTimer(now + kRePrimeTimeout);
+            return;
+        }
+
+        BatchLimits limits = _batchPolicy.Update(now);
+
+        // Out of credits: the client's buffer is as full as we dare make it.  Its next response
+        // will get us going again, and if it never comes the policy stops trusting the old one.
+
+        if (limits.credits == 0)
+        {
+            ArmBatchTimer(_batchPolicy.ResponseDeadline());
+            return;
+        }
+
+        bool batchIsDue = queuedFrames >= limits.maxFrames ||
+                          queuedBytes >= limits.maxBytes ||
+                          now - _lastSendTime >= limits.maxDelay;
+
+        if (!batchIsDue)
+        {
+            ArmBatchTimer(_lastSendTime + limits.maxDelay);
+            return;
+        }
+
+        // Our share of the uplink.  If we're over our own rate we know when to try again;
+        // otherwise the scheduler wakes us when it's our turn.
+
+        auto admission = SocketReactor::Instance().Uplink().Admit(_uplinkFlow, _batchPolicy.Lead(now), now);
+        if (!admission.granted)
+        {
+            _uplinkDeferrals++;
+            if (admission.retryAt != steady_clock::time_point::max())
+                ArmBatchTimer(admission.retryAt);
+            return;
+        }
+
+        limits.maxBytes = min(limits.maxBytes, admission.maxBytes);
+
+        _batchMembers.clear();
+        for (const auto& queue : _queues)
+        {
+            if (queue->rePrimeRequested.load(memory_order_relaxed))
+                continue;
+
+            BatchMember member;
+            member.queue = queue;
+            member.end = member.cursor = queue->ring.ReadPosition();
+            member.next = queue->ring.Next(member.cursor);
+            if (member.next)
+                _batchMembers.push_back(std::move(member));
+        }
+
+        size_t batchBytes = 0;
+        size_t maxFrames = min(limits.maxFrames, limits.credits);
+        _sendBuffers.clear();
+
+        while (_sendBuffers.size() < maxFrames)
+        {
+            auto oldest = _batchMembers.end();
+            for (auto member = _batchMembers.begin(); member != _batchMembers.end(); member++)
+                if (member->next && (oldest == _batchMembers.end() || member->next->enqueued < oldest->next->enqueued))
+                    oldest = member;
+
+            if (oldest == _batchMembers.end())
+                break;
+
+            auto& frame = *oldest->next;
+
+            // Always send at least one frame, however big it is
+
+            if (!_sendBuffers.empty() && batchBytes + frame.data.size() > limits.maxBytes)
+                break;
+
+            _sendBuffers.emplace_back(frame.data.data(), frame.data.size());
+            batchBytes += frame.data.size();
+            oldest->frames++;
+            oldest->bytes += frame.data.size();
+            oldest->queue->queueWait.Record(duration_cast<microseconds>(now - frame.enqueued));
+
+            oldest->end = oldest->cursor;
+            oldest->next = oldest->queue->ring.Next(oldest->cursor);
+        }
+
+        size_t packetCount = _sendBuffers.size();
+        if (packetCount == 0)
+            return;
+
+        // Only the channels that got frames into the batch are part of it
+
+        erase_if(_batchMembers, [](const BatchMember& member) { return member.frames == 0; });
+        for (auto& member : _batchMembers)
+        {
+            member.next.reset();
+            member.queue->inFlightEnd = member.end;
+            member.queue->inFlightFrames = member.frames;
+        }
+
+        _batchPolicy.OnFramesSent(packetCount);
+        SocketReactor::Instance().Uplink().Charge(_uplinkFlow, batchBytes, now);
+
+        // Frames are numbered from 1 on each connection, and the client echoes the number of the
+        // latest one it has received in its responses, which is how we time the round trip
+
+        if (_protocol == ChannelProtocol::Udp)
+            _datagrams.Assign(_sendBuffers, static_cast<uint32_t>(_framesSent + 1));
+
+        for (size_t i = 0; i < packetCount; i++)
+            _frameSendTimes[++_framesSent % kRoundTripWindow] = now;
+
+        logger->debug("Sending {} packets from {} channel(s) to {}:{}", packetCount, _batchMembers.size(), _hostName, _port);
+
+        _lastSendTime = now;
+        _writeInProgress = true;
+        _sendIndex = 0;
+
+        // One deadline for the whole batch, however many writes it takes
+
+        auto epoch = _connectionEpoch;
+
+        _batchDeadline = now + _transport.sendTimeout;
+        _deadlineTimer.expires_at(_batchDeadline);
+        _deadlineTimer.async_wait([self = shared_from_this(), epoch](const asio::error_code& error)
+        {
+            if (error || epoch != self->_connectionEpoch || !self->_writeInProgress)
+                return;
+
+            logger->warn("Socket timed out for {}:{}", self->_hostName, self->_port);
+            self->_sendTimeouts++;
+            self->ResetConnection();
+        });
+
+        ContinueSend();
+    }
+
+    // HoldForRePrime
+    //
+    // Whether a channel's frames have to wait because its client reconnected and the canvas
+    // pipeline hasn't re-primed it yet.  The pipeline's replay starts further back than what was
+    // queued, so once it has been queued, everything in front of it is released rather than sent.
+    // A pipeline that hasn't come round within kRePrimeTimeout isn't running, and the channel
+    // carries on with what it has.  Like DropStaleFrames, this runs with no batch in flight.
+
+    bool HoldForRePrime(ChannelQueue& queue, steady_clock::time_point now)
+    {
+        int64_t requested = queue.rePrimeRequested.load(memory_order_acquire);
+        if (requested && now.time_since_epoch().count() - requested < nanoseconds(kRePrimeTimeout).count())
+            return true;
+
+        if (requested && queue.rePrimeRequested.compare_exchange_strong(requested, 0, memory_order_acquire))
+            logger->warn("Nothing re-primed the channel on {}:{} after it reconnected", _hostName, _port);
+
+        uint64_t fence = queue.rePrimeFence.exchange(ChannelQueue::kNoFence, memory_order_relaxed);
+        if (fence != ChannelQueue::kNoFence)
+        {
+            size_t replaced = queue.ring.ReleaseTo(fence);
+            queue.replacedFrames += replaced;
+            queue.metrics.drops.Add(replaced);
+        }
+
+        return false;
+    }
+
+    // DropStaleFrames
+    //
+    // Releases the frames at the front of each queue whose presentation time is further in the past
+    // than the channel's grace period allows.  The client would only throw them away, after we had
+    // spent the bandwidth on them, and sending them would just hold up the fresh frames behind them.
+    // A queue is in presentation order, so its stale frames are always at the front, and since no
+    // batch is in flight when this runs they can go straight away.  Frames without a presentation
+    // time are never stale.
+
+    void DropStaleFrames()
+    {
+        auto now = system_clock::now();
+
+        for (const auto& queue : _queues)
+        {
+            uint64_t position = queue->ring.ReadPosition();
+            uint64_t staleEnd = position;
+            size_t stale = 0;
+
+            while (auto frame = queue->ring.Next(position))
+            {
+                if (frame->presentAt == system_clock::time_point() || frame->presentAt + queue->staleFrameGrace >= now)
+                    break;
+
+                staleEnd = position;
+                stale++;
+            }
+
+            if (stale == 0)
+                continue;
+
+            queue->ring.ReleaseTo(staleEnd);
+            queue->staleFrames += stale;
+            queue->metrics.drops.Add(stale);
+            logger->debug("Skipped {} stale frame(s) for {}:{}", stale, _hostName, _port);
+        }
+    }
+
+    // ContinueSend
+    //
+    // Writes as much of the current batch as the kernel will take right now.  Whatever doesn't
+    // fit waits until the socket is writable again, and the time spent waiting is counted as
+    // time blocked on the send buffer.
+    //
+    // asio gathers at most 64 buffers into one write, one per frame, so a write that ends right at
+    // the end of a frame may only have been cut short by that.  We go straight on with the rest
+    // then, and only count a partial send once the kernel itself stops taking bytes.
+
+    void ContinueSend()
+    {
+        if (_protocol == ChannelProtocol::Udp)
+            return ContinueSendDatagrams();
+
+        bool wroteSome = false;
+        for (;;)
+        {
+            asio::error_code error;
+            span<const asio::const_buffer> remaining(_sendBuffers.data() + _sendIndex, _sendBuffers.size() - _sendIndex);
+            size_t bytesSent = _socket.write_some(remaining, error);
+
+            if (error == asio::error::would_block || error == asio::error::try_again)
+            {
+                if (wroteSome)
+                    _partialSends++;
+                return WaitUntilWritable();
+            }
+
+            if (error)
+                return FinishBatch(error);
+
+            // Step past everything that went out, trimming the front of a buffer that only partly did
+
+            while (_sendIndex < _sendBuffers.size() && bytesSent >= _sendBuffers[_sendIndex].size())
+                bytesSent -= _sendBuffers[_sendIndex++].size();
+
+            if (_sendIndex == _sendBuffers.size())
+                return FinishBatch(error);
+
+            wroteSome = true;
+            if (bytesSent == 0)
+                continue;
+
+            _sendBuffers[_sendIndex] += bytesSent;
+            _partialSends++;
+            return WaitUntilWritable();
+        }
+    }
+
+    // ContinueSendDatagrams
+    //
+    // ContinueSend for UDP.  Datagrams either go out whole or not at all, so there's no resuming
+    // part way through a frame; a datagram the kernel refuses outright, because it's too big or
+    // because the client isn't listening, is dropped rather than holding up the batch.
+
+    void ContinueSendDatagrams()
+    {
+        while (_datagrams.Remaining() > 0)
+        {
+            size_t bytesSent = 0;
+            int sent = _datagrams.Send(_udpSocket.native_handle(), bytesSent);
+
+            // A short count can mean the send buffer filled up or that an error is waiting for
+            // the next call, so try again and let that tell us which
+
+            if (sent >= 0)
+            {
+                if (_datagrams.Remaining() > 0)
+                    _partialSends++;
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return WaitUntilWritable();
+
+            if (errno != EMSGSIZE && errno != ECONNREFUSED)
+                return FinishBatch(asio::error_code(errno, asio::error::get_system_category()));
+
+            _droppedDatagrams++;
+            _datagrams.Skip();
+        }
+
+        FinishBatch({});
+    }
+
+    // WaitUntilWritable
+    //
+    // Parks the batch until the kernel has room in the socket's send buffer
+
+    void WaitUntilWritable()
+    {
+        auto epoch = _connectionEpoch;
+        _blockedSince.store(steady_clock::now().time_since_epoch().count(), memory_order_relaxed);
+
+        auto onWritable = [self = shared_from_this(), epoch](const asio::error_code& error)
+        {
+            if (epoch != self->_connectionEpoch)
+                return;
+
+            self->StopWaitingForWritable();
+
+            if (error)
+                return self->FinishBatch(error);
+
+            self->ContinueSend();
+        };
+
+        if (_protocol == ChannelProtocol::Udp)
+            _udpSocket.async_wait(asio::ip::udp::socket::wait_write, std::move(onWritable));
+        else
+            _socket.async_wait(asio::ip::tcp::socket::wait_write, std::move(onWritable));
+    }
+
+    // StopWaitingForWritable
+    //
+    // Counts the time since WaitUntilWritable as blocked, whether the wait ended with the socket
+    // becoming writable or with the connection being closed underneath it
+
+    void StopWaitingForWritable()
+    {
+        int64_t blockedSince = _blockedSince.exchange(0, memory_order_relaxed);
+        if (!blockedSince)
+            return;
+
+        auto blocked = steady_clock::now().time_since_epoch() - steady_clock::duration(blockedSince);
+        for (const auto& queue : _queues)
+            queue->metrics.blockedMicroseconds.Add(duration_cast<microseconds>(blocked).count());
+    }
+
+    // ReleaseBatch
+    //
+    // Hands the frames of the current batch back to their rings
+
+    void ReleaseBatch()
+    {
+        for (auto& member : _batchMembers)
+        {
+            member.queue->ring.ReleaseTo(member.end);
+            member.queue->inFlightFrames = 0;
+        }
+    }
+
+    // FinishBatch
+    //
+    // Whether it went out or not, this batch is done with; a failed batch is dropped just like it
+    // was before we kept frames in the ring while sending
+
+    void FinishBatch(const asio::error_code& error)
+    {
+        ReleaseBatch();
+        _writeInProgress = false;
+        _deadlineTimer.cancel();
+
+        if (error)
+        {
+            _batchMembers.clear();
+            logger->warn("Error sending to {}:{}: {}", _hostName, _port, error.message());
+            ResetConnection();
+            return;
+        }
+
+        _sendDurationHistogram.Record(duration_cast<microseconds>(steady_clock::now() - _lastSendTime));
+
+        for (auto& member : _batchMembers)
+        {
+            member.queue->metrics.bytes.Add(member.bytes);
+            member.queue->metrics.frames.Add(member.frames);
+            member.queue->metrics.batches.Add();
+        }
+        _batchMembers.clear();
+
+        TrySend();
+    }
+
+    // ArmBatchTimer
+    //
+    // Makes sure TrySend runs again no later than deadline
+
+    void ArmBatchTimer(steady_clock::time_point deadline)
+    {
+        if (_batchTimerArmed && _batchTimer.expiry() <= deadline)
+            return;
+
+        // Re-arming cancels the earlier wait, whose handler then sees the error and leaves
+        // _batchTimerArmed alone
+
+        _batchTimerArmed = true;
+        _batchTimer.expires_at(deadline);
+        _batchTimer.async_wait([self = shared_from_this()](const asio::error_code& error)
+        {
+            if (error)
+                return;
+
+            self->_batchTimerArmed = false;
+            self->TrySend();
+        });
+    }
+
+    // StartRead
+    //
+    // Keeps one read outstanding on the socket at all times so client responses are picked up
+    // as soon as they arrive, rather than only after we've sent something.  Each read drains as
+    // much as the kernel has for us, straight into the response stream.
+
+    void StartRead()
+    {
+        if (_protocol == ChannelProtocol::Udp)
+            return StartReceive();
+
+        _socket.async_read_some(_responseStream.ReceiveBuffers(),
+                                [self = shared_from_this(), epoch = _connectionEpoch](const asio::error_code& error, size_t bytesRead)
+        {
+            if (epoch != self->_connectionEpoch)
+                return;
+
+            if (error)
+            {
+                logger->warn("Error reading response from {}:{}: {}", self->_hostName, self->_port, error.message());
+                self->ResetConnection();
+                return;
+            }
+
+            self->_responseStream.Commit(bytesRead);
+            self->ProcessResponses();
+            self->StartRead();
+        });
+    }
+
+    // StartReceive
+    //
+    // StartRead for UDP.  Every datagram holds exactly one response, so anything left over after
+    // parsing one is junk and is thrown away rather than glued to the next datagram.  A refused
+    // connection only means an earlier datagram found nobody listening, so we keep on reading.
+
+    void StartReceive()
+    {
+        _udpSocket.async_receive(_responseStream.ReceiveBuffers(),
+                                 [self = shared_from_this(), epoch = _connectionEpoch](const asio::error_code& error, size_t bytesRead)
+        {
+            if (epoch != self->_connectionEpoch)
+                return;
+
+            if (error && error != asio::error::connection_refused)
+            {
+                logger->warn("Error reading response from {}:{}: {}", self->_hostName, self->_port, error.message());
+                self->ResetConnection();
+                return;
+            }
+
+            if (!error)
+            {
+                self->_responseStream.Commit(bytesRead);
+                self->ProcessResponses();
+                self->_responseStream.Clear();
+            }
+
+            self->StartReceive();
+        });
+    }
+
+    // ProcessResponses
+    //
+    // Handles every complete response received so far, in order
+
+    void ProcessResponses()
+    {
+        size_t responses = 0;
+        size_t skipped = _responseStream.Parse([&](const ClientResponse& response)
+        {
+            OnClientResponse(response);
+            responses++;
+        });
+
+        if (skipped)
+        {
+            logger->warn("Skipped {} invalid bytes reading responses from {}:{}", skipped, _hostName, _port);
+            _invalidResponseBytes += skipped;
+        }
+
+        // The client has told us how full its buffer is, which may free up credits or change
+        // how we batch
+
+        if (responses)
+            TrySend();
+    }
+
+    // OnClientResponse
+    //
+    // Records one response and passes what it says about the client's buffer on to the batch
+    // policy.  The first response to name a frame we still remember sending gives us a round trip
+    // time; later ones for the same frame, or for one we never sent, are just stats.
+
+    void OnClientResponse(const ClientResponse& response)
+    {
+        auto now = steady_clock::now();
+        {
+            lock_guard lock(_responseMutex);
+            _lastClientResponse = response;
+            _lastResponseTime = system_clock::now();
+            _responseHistory[_responseCount++ % kResponseHistory] = response;
+        }
+
+        uint64_t sequence = response.sequence;
+        if (sequence > _lastMatchedSequence && sequence <= _framesSent && _framesSent - sequence < kRoundTripWindow)
+        {
+            _roundTripHistogram.Record(duration_cast<microseconds>(now - _frameSendTimes[sequence % kRoundTripWindow]));
+            _lastMatchedSequence = sequence;
+        }
+
+        _batchPolicy.OnResponse(response.bufferPos, response.bufferSize, response.fpsDrawing, sequence, _framesSent, now);
+    }
+
+    // SampleTcpInfo
+    //
+    // Reads TCP_INFO for the current connection now and every kTcpInfoInterval after that, until
+    // the connection goes away.  Only Linux has it in this form, so elsewhere there's no tcpInfo.
+
+    void SampleTcpInfo()
+    {
+#ifdef __linux__
+        if (_protocol != ChannelProtocol::Tcp || !_socket.is_open())
+            return;
+
+        tcp_info kernelInfo {};
+        socklen_t length = sizeof(kernelInfo);
+        if (getsockopt(_socket.native_handle(), IPPROTO_TCP, TCP_INFO, &kernelInfo, &length) == 0)
+        {
+            TcpInfo info;
+            info.rttMicroseconds = kernelInfo.tcpi_rtt;
+            info.rttVarMicroseconds = kernelInfo.tcpi_rttvar;
+            info.congestionWindow = kernelInfo.tcpi_snd_cwnd;
+            info.mss = kernelInfo.tcpi_snd_mss;
+            info.unacked = kernelInfo.tcpi_unacked;
+            info.lost = kernelInfo.tcpi_lost;
+            info.retransmits = kernelInfo.tcpi_total_retrans;
+
+            lock_guard lock(_tcpInfoMutex);
+            _tcpInfo = info;
+        }
+
+        auto epoch = _connectionEpoch;
+        _tcpInfoTimer.expires_after(kTcpInfoInterval);
+        _tcpInfoTimer.async_wait([self = shared_from_this(), epoch](const asio::error_code& error)
+        {
+            if (!error && epoch == self->_connectionEpoch)
+                self->SampleTcpInfo();
+        });
+#endif
+    }
+
+    // SetSocketOptions
+    //
+    // Applies the transport profile to a TCP socket.  asio takes care of non-blocking mode, and
+    // sends are bounded by our own per-batch deadline rather than SO_SNDTIMEO.
+
+    bool SetSocketOptions(int socketFd)
+    {
+        int keepalive = 1;
+        int keepcnt = static_cast<int>(_transport.keepAliveCount);                // Number of keepalive probes before declaring dead
+        int keepidle = static_cast<int>(_transport.keepAliveIdle.count());        // Time in seconds before sending keepalive probes
+        int keepintvl = static_cast<int>(_transport.keepAliveInterval.count());   // Time in seconds between keepalive probes
+        int noDelay = _transport.noDelay ? 1 : 0;
+
+        // On macOS, TCP_KEEPIDLE is called TCP_KEEPALIVE
+        #ifdef __APPLE__
+            #define TCP_KEEPIDLE TCP_KEEPALIVE
+        #endif
+
+        if (setsockopt(socketFd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive)) < 0 ||
+            setsockopt(socketFd, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt)) < 0 ||
+            setsockopt(socketFd, IPPROTO_TCP, TCP_KEEPIDLE, &keepidle, sizeof(keepidle)) < 0 ||
+            setsockopt(socketFd, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl)) < 0)
+        {
+            logger->warn("Could not set keepalive options for {}:{}", _hostName, _port);
+            return false;
+        }
+
+        if (setsockopt(socketFd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) < 0)
+        {
+            logger->warn("Could not set TCP_NODELAY for {}:{}", _hostName, _port);
+            return false;
+        }
+
+#ifdef TCP_NOTSENT_LOWAT
+        int notSentLowat = static_cast<int>(_transport.notSentLowatBytes);
+        if (notSentLowat > 0 && setsockopt(socketFd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notSentLowat, sizeof(notSentLowat)) < 0)
+        {
+            logger->warn("Could not set TCP_NOTSENT_LOWAT for {}:{}", _hostName, _port);
+            return false;
+        }
+#endif
+
+        return SetSendBufferSize(socketFd);
+    }
+
+    bool SetSendBufferSize(int socketFd)
+    {
+        int sendBuffer = static_cast<int>(_transport.sendBufferBytes);
+        if (sendBuffer > 0 && setsockopt(socketFd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer)) < 0)
+        {
+            logger->warn("Could not set SO_SNDBUF for {}:{}", _hostName, _port);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool IsSocketOpen() const
+    {
+        return _socket.is_open() || _udpSocket.is_open();
+    }
+
+    // CloseSocket
+    //
+    // Must be called on the strand (or from the destructor).  Cancels anything outstanding on the
+    // current connection; those handlers see that the epoch has moved on and do nothing.
+
+    void CloseSocket()
+    {
+        logger->debug("Closing socket for {}:{}", _hostName, _port);
+
+        asio::error_code error;
+        if (_socket.is_open())
+        {
+            _socket.shutdown(asio::ip::tcp::socket::shutdown_both, error);
+            _socket.close(error);
+        }
+
+        if (_udpSocket.is_open())
+            _udpSocket.close(error);
+
+        // Once the socket is closed asio won't touch the batch buffers anymore, so the frames
+        // of an interrupted write can be released here; its handler will ignore the old epoch
+
+        if (_writeInProgress)
+            ReleaseBatch();
+        _batchMembers.clear();
+
+        StopWaitingForWritable();
+        _connectionEpoch++;
+        _deadlineTimer.cancel();
+        _tcpInfoTimer.cancel();
+        _writeInProgress = false;
+        _responseStream.Clear();
+        _isConnected = false;
+
+        lock_guard lock(_tcpInfoMutex);
+        _tcpInfo.reset();
+    }
+};
@@ -0,0 +1,106 @@
+#pragma once
+using namespace std;
+
+// SocketReactor
+//
+// A single asio io_context shared by every SocketChannel in the process, serviced by a small
+// fixed pool of I/O threads.  Channels no longer own a thread each; instead they issue
+// non-blocking connects, writes and reads against this context and are woken by completion
+// handlers.  Each channel serializes its own handlers on a strand, so a channel's state is only
+// ever touched by one I/O thread at a time even though the pool is shared.
+//
+// The reactor also owns what the channels share when (re)connecting: the HostResolver and its
+// cache, and the ConnectRateLimiter; what they share when sending, the UplinkScheduler; and the
+// QueueBudget their queues share.  All of them go away only after the I/O threads have stopped.
+
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include <asio.hpp>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "global.h"
+#include "reconnect.h"
+#include "uplink.h"
+#include "queuebudget.h"
+
+class SocketReactor
+{
+    static constexpr unsigned kMaxIoThreads = 4;
+
+    asio::io_context _ioContext;
+    asio::executor_work_guard<asio::io_context::executor_type> _workGuard;
+    HostResolver _resolver;
+    ConnectRateLimiter _connectLimiter;
+    UplinkScheduler _uplink;
+    QueueBudget _queueBudget;
+    vector<thread> _ioThreads;
+
+    SocketReactor() : _workGuard(asio::make_work_guard(_ioContext)), _resolver(_ioContext), _uplink(_ioContext), _queueBudget(_ioContext)
+    {
+        // Socket work is almost entirely waiting on the kernel, so a handful of threads
+        // is plenty no matter how many channels there are
+
+        unsigned threadCount = clamp(thread::hardware_concurrency(), 1u, kMaxIoThreads);
+        for (unsigned i = 0; i < threadCount; i++)
+            _ioThreads.emplace_back([this]() { _ioContext.run(); });
+
+        logger->debug("Socket reactor started with {} I/O threads", threadCount);
+    }
+
+public:
+    SocketReactor(const SocketReactor&) = delete;
+    SocketReactor& operator=(const SocketReactor&) = delete;
+
+    ~SocketReactor()
+    {
+        _workGuard.reset();
+        _ioContext.stop();
+
+        for (auto& ioThread : _ioThreads)
+            if (ioThread.joinable())
+                ioThread.join();
+    }
+
+    // Instance
+    //
+    // The reactor is created on first use, which is when the first channel is constructed
+
+    static SocketReactor& Instance()
+    {
+        static SocketReactor reactor;
+        return reactor;
+    }
+
+    asio::io_context& Context()
+    {
+        return _ioContext;
+    }
+
+    size_t ThreadCount() const
+    {
+        return _ioThreads.size();
+    }
+
+    HostResolver& Resolver()
+    {
+        return _resolver;
+    }
+
+    ConnectRateLimiter& ConnectLimiter()
+    {
+        return _connectLimiter;
+    }
+
+    UplinkScheduler& Uplink()
+    {
+        return _uplink;
+    }
+
+    QueueBudget& Budget()
+    {
+        return _queueBudget;
+    }
+};
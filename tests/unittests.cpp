@@ -0,0 +1,661 @@
+// Unit tests
+//
+// Tests that exercise the server's headers directly, without a running server: the transports,
+// sinks and DMX ingest effect are checked against receivers and senders on loopback.  tests.cpp
+// has the API tests.
+
+#include <gtest/gtest.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "global.h"
+#include "socketchannel.h"
+#include "ledfeature.h"
+#include "lightingsink.h"
+#include "canvas.h"
+
+atomic<uint32_t> Canvas::_nextId{0};
+atomic<uint32_t> LEDFeature::_nextId{0};
+atomic<uint32_t> SocketChannel::_nextId{0};
+atomic<uint32_t> LocalFrameSink::_nextId{0};
+
+shared_ptr<spdlog::logger> logger = spdlog::stdout_color_mt("console");
+
+// UdpReceiver
+//
+// A UDP socket bound to an ephemeral loopback port, standing in for whatever is on the other end
+
+class UdpReceiver
+{
+    int         _fd;
+    uint16_t    _port;
+    sockaddr_in _lastSender {};
+
+public:
+    UdpReceiver()
+    {
+        _fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+        sockaddr_in address {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        bind(_fd, reinterpret_cast<sockaddr *>(&address), length);
+        getsockname(_fd, reinterpret_cast<sockaddr *>(&address), &length);
+        _port = ntohs(address.sin_port);
+    }
+
+    ~UdpReceiver()
+    {
+        close(_fd);
+    }
+
+    uint16_t Port() const
+    {
+        return _port;
+    }
+
+    // Waits up to timeout for a datagram; an empty result means none came
+
+    vector<uint8_t> Receive(milliseconds timeout = 3000ms)
+    {
+        pollfd poller { _fd, POLLIN, 0 };
+        if (poll(&poller, 1, static_cast<int>(timeout.count())) <= 0)
+            return {};
+
+        vector<uint8_t> datagram(65536);
+        socklen_t length = sizeof(_lastSender);
+        ssize_t received = recvfrom(_fd, datagram.data(), datagram.size(), 0, reinterpret_cast<sockaddr *>(&_lastSender), &length);
+        datagram.resize(max<ssize_t>(received, 0));
+        return datagram;
+    }
+
+    // Answers whoever sent the last datagram
+
+    void Reply(const void * data, size_t size)
+    {
+        sendto(_fd, data, size, 0, reinterpret_cast<sockaddr *>(&_lastSender), sizeof(_lastSender));
+    }
+};
+
+// A plain pixel data frame for channel 0, to be shown a second from now
+
+vector<uint8_t> MakeDataFrame(uint32_t pixels, uint8_t fill)
+{
+    auto epoch = duration_cast<microseconds>((system_clock::now() + 1s).time_since_epoch()).count();
+
+    return Utilities::CombineByteArrays(Utilities::WORDToBytes(3),
+                                        Utilities::WORDToBytes(0),
+                                        Utilities::DWORDToBytes(pixels),
+                                        Utilities::ULONGToBytes(epoch / 1'000'000),
+                                        Utilities::ULONGToBytes(epoch % 1'000'000),
+                                        vector<uint8_t>(pixels * 3, fill));
+}
+
+// A data frame whose pixel bytes count up, so every slice of it is different
+
+vector<uint8_t> MakePatternFrame(uint32_t pixels)
+{
+    auto frame = MakeDataFrame(pixels, 0);
+    for (size_t i = 0; i < pixels * 3; i++)
+        frame[Utilities::kDataFrameHeaderSize + i] = static_cast<uint8_t>(i % 251);
+    return frame;
+}
+
+uint32_t ReadDWord(const uint8_t * source)
+{
+    return source[0] | (source[1] << 8) | (source[2] << 16) | (static_cast<uint32_t>(source[3]) << 24);
+}
+
+// Frames that don't fit before the end of the ring start over at the front.  Whatever space the
+// last frame leaves behind has to hold the wrap marker, however little of it there is.
+
+TEST(FrameRing, WrapsFromAnyTailPosition)
+{
+    for (size_t capacity : { 128, 160, 224, 256 })
+    {
+        for (size_t first = 0; first <= 72; first += 4)
+        {
+            FrameRing ring(capacity);
+            vector<uint8_t> filler(first, 0xEE);
+            if (!ring.Push(filler))
+                continue;
+            ring.Push({});
+            ring.Clear();
+
+            // The ring is empty now, so frames up to a quarter of it have to go in, wrapping as
+            // needed, and come back out intact
+
+            for (uint8_t i = 1; i <= 20; i++)
+            {
+                vector<uint8_t> frame(i % 9, i);
+                ASSERT_TRUE(ring.Push(frame)) << capacity << "/" << first << "/" << int(i);
+
+                uint64_t position = ring.ReadPosition();
+                auto next = ring.Next(position);
+                ASSERT_TRUE(next);
+                EXPECT_TRUE(ranges::equal(next->data, frame));
+                EXPECT_FALSE(ring.Next(position));
+
+                ring.ReleaseTo(position);
+                EXPECT_EQ(ring.FrameCount(), 0u);
+                EXPECT_EQ(ring.UsedBytes(), 0u);
+            }
+        }
+    }
+}
+
+TEST(FrameRing, SurvivesASmallRing)
+{
+    FrameRing ring(64);
+    vector<uint8_t> frame(8, 1);
+
+    ring.Push(frame);
+    ring.Push({});
+    ring.Clear();
+    ASSERT_TRUE(ring.Push(frame));
+
+    uint64_t position = ring.ReadPosition();
+    auto next = ring.Next(position);
+    ASSERT_TRUE(next);
+    EXPECT_TRUE(ranges::equal(next->data, frame));
+}
+
+TEST(FrameRing, DropsAcrossTheWrap)
+{
+    FrameRing ring(320);
+
+    // Three frames fill all but the end of the ring, and once the first is gone, the fourth wraps
+
+    for (uint8_t i = 0; i <= 2; i++)
+        ASSERT_TRUE(ring.Push(vector<uint8_t>(40, i)));
+
+    uint64_t position = ring.ReadPosition();
+    ring.Next(position);
+    ring.ReleaseTo(position);
+
+    ASSERT_TRUE(ring.Push(vector<uint8_t>(40, 3)));
+    EXPECT_EQ(ring.FrameCount(), 3u);
+
+    EXPECT_EQ(ring.DropIf(ring.ReadPosition(), [](size_t index, const FrameRing::Frame&) { return index == 1; }), 1u);
+    EXPECT_EQ(ring.FrameCount(), 2u);
+    EXPECT_EQ(ring.QueuedBytes(), 80u);
+
+    position = ring.ReadPosition();
+    EXPECT_EQ(ring.Next(position)->data[0], 1);
+    EXPECT_EQ(ring.Next(position)->data[0], 3);
+    EXPECT_FALSE(ring.Next(position));
+
+    ring.ReleaseTo(position);
+    EXPECT_EQ(ring.FrameCount(), 0u);
+    EXPECT_EQ(ring.UsedBytes(), 0u);
+}
+
+// A ring only takes up memory in line with how long its queue gets, however often the producer
+// goes round it, and never more than its wrap limit.  Whatever it stops needing goes back to the
+// system as the producer wraps.
+
+TEST(FrameRing, KeepsResidentMemoryInLineWithTheQueue)
+{
+    constexpr size_t kCapacity = 8 * 1024 * 1024;
+    constexpr size_t kFrameSize = 40000;
+    constexpr size_t kSlack = 2 * kFrameSize + 64 * 1024;
+    vector<uint8_t> frame(kFrameSize, 1);
+
+    FrameRing ring(kCapacity);
+    EXPECT_LT(ring.ResidentBytes(), kSlack);
+
+    auto releaseOldest = [&]()
+    {
+        uint64_t position = ring.ReadPosition();
+        ring.Next(position);
+        ring.ReleaseTo(position);
+    };
+
+    // Queues up to length frames and then keeps it there, until bytes have gone through.  Until
+    // the frames from before the producer's last wrap are gone, there may not be room for that
+    // many, as with a consumer that's busy sending them.
+
+    auto cycle = [&](size_t length, size_t bytes)
+    {
+        for (size_t written = 0; written < bytes; written += frame.size())
+        {
+            while (!ring.Push(frame))
+            {
+                ASSERT_GT(ring.FrameCount(), 0u);
+                releaseOldest();
+            }
+            while (ring.FrameCount() > length)
+                releaseOldest();
+        }
+    };
+
+    // A short queue only ever uses the front of the buffer...
+
+    cycle(4, 2 * kCapacity);
+    EXPECT_LE(ring.ResidentBytes(), 2 * 5 * kFrameSize + kSlack);
+
+    // ...a long one grows into it...
+
+    cycle(100, 2 * kCapacity);
+    EXPECT_GE(ring.ResidentBytes(), 100 * kFrameSize);
+
+    // ...and once it's short again, the rest goes back
+
+    cycle(4, 2 * kCapacity);
+    EXPECT_LE(ring.ResidentBytes(), 2 * 5 * kFrameSize + kSlack);
+
+    // The wrap limit caps it whatever the queue's length, without counting the rest of the buffer
+    // that gets skipped at every wrap as used
+
+    ring.SetWrapLimit(8 * kFrameSize);
+    cycle(100, 2 * kCapacity);
+    EXPECT_LE(ring.ResidentBytes(), 8 * kFrameSize + kSlack);
+    EXPECT_LE(ring.UsedBytes(), 8 * kFrameSize + kSlack);
+    EXPECT_LE(ring.QueuedBytes(), ring.UsedBytes());
+
+    // A frame bigger than the limit still fits
+
+    ring.Clear();
+    ASSERT_TRUE(ring.Push(vector<uint8_t>(16 * kFrameSize, 2)));
+    ring.Clear();
+    EXPECT_EQ(ring.UsedBytes(), 0u);
+}
+
+// Features sharing a connection get the profile that suits them all, whichever came first: the
+// larger buffer, the shorter timeout and batches, Nagle off if either wants it, the lower rate
+// limit and both their weights.  The queue limits stay each channel's own.
+
+TEST(TransportProfile, MergesWhicheverComesFirst)
+{
+    TransportProfile wired;
+    wired.sendBufferBytes = 256 * 1024;
+    wired.noDelay = true;
+    wired.maxBatchFrames = 64;
+    wired.maxBatchDelay = 5ms;
+
+    TransportProfile wifi;
+    wifi.sendBufferBytes = 32 * 1024;
+    wifi.sendTimeout = 5000ms;
+    wifi.maxBatchFrames = 8;
+    wifi.maxBytesPerSecond = 1000000;
+    wifi.weight = 2;
+    wifi.maxQueueFrames = 50;
+
+    auto merged = MergeTransports(wired, wifi);
+    auto reversed = MergeTransports(wifi, wired);
+    reversed.maxQueueFrames = merged.maxQueueFrames;
+    EXPECT_EQ(reversed, merged);
+    EXPECT_EQ(merged.sendBufferBytes, 256u * 1024);
+    EXPECT_TRUE(merged.noDelay);
+    EXPECT_EQ(merged.sendTimeout, 2000ms);
+    EXPECT_EQ(merged.maxBatchFrames, 8u);
+    EXPECT_EQ(merged.maxBatchDelay, 5ms);
+    EXPECT_EQ(merged.maxBytesPerSecond, 1000000u);
+    EXPECT_EQ(merged.weight, 3);
+    EXPECT_EQ(merged.maxQueueFrames, TransportProfile::kDefaultMaxQueueFrames);
+    EXPECT_EQ(MergeTransports(wifi, wired).maxQueueFrames, 50u);
+}
+
+// The UDP transport sends every frame as its own datagram, behind an "NDSU" tag and a sequence
+// number that counts up from 1 on each connection, and stops sending when the responses coming
+// back say the client's buffer is full.
+
+TEST(UdpTransport, SendsNumberedDatagramsAndHonorsCredits)
+{
+    constexpr uint32_t kBufferSize = 8;
+
+    UdpReceiver receiver;
+    auto channel = make_shared<SocketChannel>("127.0.0.1", "UDP test", receiver.Port(), kBufferSize, OverflowPolicy {}, ChannelProtocol::Udp);
+    channel->Start();
+
+    for (int tries = 0; !channel->IsConnected() && tries < 100; tries++)
+        this_thread::sleep_for(20ms);
+    ASSERT_TRUE(channel->IsConnected());
+
+    uint32_t sequence = 0;
+    auto expectFrames = [&](size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            auto datagram = receiver.Receive();
+            ASSERT_EQ(datagram.size(), 8 + Utilities::kDataFrameHeaderSize + 10 * 3);
+            EXPECT_EQ(ReadDWord(datagram.data()), 0x4E445355u);        // "NDSU"
+            EXPECT_EQ(ReadDWord(datagram.data() + 4), ++sequence);
+            EXPECT_EQ(datagram.back(), static_cast<uint8_t>(sequence));
+        }
+    };
+
+    auto respond = [&](uint32_t bufferPos)
+    {
+        ClientResponse response;
+        response.sequence = sequence;
+        response.bufferSize = kBufferSize;
+        response.bufferPos = bufferPos;
+        response.fpsDrawing = 30;
+        receiver.Reply(&response, sizeof(response));
+    };
+
+    // Before the client has said anything, frames just go out
+
+    for (uint8_t i = 1; i <= 5; i++)
+        ASSERT_TRUE(channel->EnqueueFrame(MakeDataFrame(10, i), system_clock::now() + 1s));
+    expectFrames(5);
+
+    // A full buffer leaves no credits, so the next frames wait...
+
+    respond(kBufferSize);
+    for (int tries = 0; channel->GetResponseCount() == 0 && tries < 100; tries++)
+        this_thread::sleep_for(10ms);
+    ASSERT_EQ(channel->GetResponseCount(), 1u);
+
+    for (uint8_t i = 6; i <= 8; i++)
+        ASSERT_TRUE(channel->EnqueueFrame(MakeDataFrame(10, i), system_clock::now() + 1s));
+    EXPECT_TRUE(receiver.Receive(300ms).empty());
+
+    auto limits = channel->GetBatchLimits();
+    EXPECT_TRUE(limits.flowControlled);
+    EXPECT_EQ(limits.credits, 0u);
+
+    // ...until the client reports room again
+
+    respond(0);
+    expectFrames(3);
+
+    channel->Stop();
+}
+
+// LightingProtocolSink
+//
+// Each test starts a sink aimed at a receiver on loopback, sends it two frames that are due right
+// away and checks the packets they come out as
+
+class LightingSinkTest : public ::testing::Test
+{
+protected:
+    UdpReceiver receiver;
+
+    shared_ptr<LightingProtocolSink> MakeSink(FrameSinkType type, uint16_t universe = 1, uint32_t pixelsPerUniverse = FrameSinkConfig::kMaxPixelsPerUniverse)
+    {
+        FrameSinkConfig config;
+        config.type = type;
+        config.host = "127.0.0.1";
+        config.port = receiver.Port();
+        config.universe = universe;
+        config.pixelsPerUniverse = pixelsPerUniverse;
+
+        auto sink = make_shared<LightingProtocolSink>(config, "Lighting test");
+        sink->Start();
+        return sink;
+    }
+
+    // Sends a frame of the given size and returns its packets, which should number count
+
+    vector<vector<uint8_t>> SendFrame(LightingProtocolSink& sink, uint32_t pixels, size_t count)
+    {
+        EXPECT_TRUE(sink.EnqueueFrame(MakePatternFrame(pixels), system_clock::now()));
+
+        vector<vector<uint8_t>> packets;
+        for (size_t i = 0; i < count; i++)
+        {
+            auto packet = receiver.Receive();
+            if (packet.empty())
+                break;
+            packets.push_back(std::move(packet));
+        }
+        EXPECT_EQ(packets.size(), count);
+        EXPECT_TRUE(receiver.Receive(100ms).empty());
+        return packets;
+    }
+
+    static uint16_t ReadBigEndianWord(const uint8_t * source)
+    {
+        return static_cast<uint16_t>((source[0] << 8) | source[1]);
+    }
+
+    // Whether payload is the slice of a pattern frame's pixel bytes that starts at offset
+
+    static bool IsPatternSlice(span<const uint8_t> payload, size_t offset)
+    {
+        for (size_t i = 0; i < payload.size(); i++)
+            if (payload[i] != static_cast<uint8_t>((offset + i) % 251))
+                return false;
+        return true;
+    }
+};
+
+// 400 pixels fill two universes of 170 and leave 60 for a third
+
+TEST_F(LightingSinkTest, SacnSplitsUniversesAndCountsSequences)
+{
+    constexpr size_t kHeaderSize = 126;
+    const size_t expected[] = { 510, 510, 180 };
+
+    auto sink = MakeSink(FrameSinkType::Sacn);
+
+    for (uint8_t frame = 0; frame < 2; frame++)
+    {
+        auto packets = SendFrame(*sink, 400, 3);
+        ASSERT_EQ(packets.size(), 3u);
+
+        for (size_t i = 0; i < packets.size(); i++)
+        {
+            const auto& packet = packets[i];
+            ASSERT_EQ(packet.size(), kHeaderSize + expected[i]);
+            EXPECT_EQ(memcmp(packet.data() + 4, "ASC-E1.17", 9), 0);
+            EXPECT_EQ(packet[111], frame);                                  // Sequence
+            EXPECT_EQ(ReadBigEndianWord(packet.data() + 113), 1 + i);       // Universe
+            EXPECT_EQ(ReadBigEndianWord(packet.data() + 123), expected[i] + 1);
+            EXPECT_EQ(packet[125], 0);                                      // Start code
+            EXPECT_TRUE(IsPatternSlice(span(packet).subspan(kHeaderSize), i * 510));
+        }
+    }
+
+    sink->Stop();
+}
+
+// Starting at universe 5 and with an odd number of channels in the last one, which Art-Net wants
+// padded to an even length
+
+TEST_F(LightingSinkTest, ArtNetSplitsUniversesAndCountsSequences)
+{
+    constexpr size_t kHeaderSize = 18;
+    const size_t expected[] = { 510, 510, 3 };
+
+    auto sink = MakeSink(FrameSinkType::ArtNet, 5);
+
+    for (uint8_t frame = 0; frame < 2; frame++)
+    {
+        auto packets = SendFrame(*sink, 341, 3);
+        ASSERT_EQ(packets.size(), 3u);
+
+        for (size_t i = 0; i < packets.size(); i++)
+        {
+            const auto& packet = packets[i];
+            size_t length = expected[i] + expected[i] % 2;
+            ASSERT_EQ(packet.size(), kHeaderSize + length);
+            EXPECT_EQ(memcmp(packet.data(), "Art-Net", 8), 0);
+            EXPECT_EQ(packet[12], frame + 1);                               // Sequence
+            EXPECT_EQ(packet[14] | (packet[15] << 8), 5 + i);              // Universe
+            EXPECT_EQ(ReadBigEndianWord(packet.data() + 16), length);
+            EXPECT_TRUE(IsPatternSlice(span(packet).subspan(kHeaderSize, expected[i]), i * 510));
+        }
+        EXPECT_EQ(packets.back().back(), 0);                                // Padding
+    }
+
+    sink->Stop();
+}
+
+// A smaller universe size splits the same way
+
+TEST_F(LightingSinkTest, SacnHonorsPixelsPerUniverse)
+{
+    auto sink = MakeSink(FrameSinkType::Sacn, 10, 100);
+
+    auto packets = SendFrame(*sink, 250, 3);
+    ASSERT_EQ(packets.size(), 3u);
+    EXPECT_EQ(packets[0].size(), 126u + 300);
+    EXPECT_EQ(packets[2].size(), 126u + 150);
+    EXPECT_EQ(ReadBigEndianWord(packets[2].data() + 113), 12);
+
+    sink->Stop();
+}
+
+// DDP carries 480 pixels a packet, at increasing offsets, and pushes with the last one
+
+TEST_F(LightingSinkTest, DdpSplitsAndPushes)
+{
+    constexpr size_t kHeaderSize = 10;
+    const size_t expected[] = { 1440, 1440, 120 };
+
+    auto sink = MakeSink(FrameSinkType::Ddp);
+
+    for (uint8_t frame = 0; frame < 2; frame++)
+    {
+        auto packets = SendFrame(*sink, 1000, 3);
+        ASSERT_EQ(packets.size(), 3u);
+
+        for (size_t i = 0; i < packets.size(); i++)
+        {
+            const auto& packet = packets[i];
+            ASSERT_EQ(packet.size(), kHeaderSize + expected[i]);
+            EXPECT_EQ(packet[0], i == 2 ? 0x41 : 0x40);                     // Push on the last packet
+            EXPECT_EQ(packet[1], frame + 1);                                // Sequence
+            EXPECT_EQ((ReadBigEndianWord(packet.data() + 4) << 16) | ReadBigEndianWord(packet.data() + 6), i * 1440);
+            EXPECT_EQ(ReadBigEndianWord(packet.data() + 8), expected[i]);   // Length
+            EXPECT_TRUE(IsPatternSlice(span(packet).subspan(kHeaderSize), i * 1440));
+        }
+    }
+
+    sink->Stop();
+}
+
+// DmxIngestEffect
+//
+// A lighting protocol sink stands in for the show control software, sending pattern frames to an
+// effect listening on loopback.  The canvas is 16 pixels wide and universes are 50 pixels long,
+// so they start and end part way through rows, and the last of the canvas's three universes only
+// has 28 of its pixels on it.
+
+class DmxIngestTest : public ::testing::Test
+{
+protected:
+    static constexpr uint32_t kWidth = 16;
+    static constexpr uint32_t kHeight = 8;
+    static constexpr uint32_t kPixelsPerUniverse = 50;
+
+    Canvas canvas { "Ingest test", kWidth, kHeight };
+
+    // A port nothing is listening on right now
+
+    static uint16_t FreePort()
+    {
+        UdpReceiver probe;
+        return probe.Port();
+    }
+
+    // Sends a pattern frame of the given size and updates the canvas until it shows it, returning
+    // whether it did in time
+
+    bool SendAndShow(IngestProtocol protocol, uint16_t universe, uint32_t pixels)
+    {
+        uint16_t port = FreePort();
+        auto effect = make_shared<DmxIngestEffect>("Ingest", protocol, port, universe, kPixelsPerUniverse);
+        effect->Start(canvas);
+
+        FrameSinkConfig config;
+        config.type = protocol == IngestProtocol::Sacn ? FrameSinkType::Sacn : FrameSinkType::ArtNet;
+        config.host = "127.0.0.1";
+        config.port = port;
+        config.universe = universe;
+        config.pixelsPerUniverse = kPixelsPerUniverse;
+
+        auto sink = make_shared<LightingProtocolSink>(config, "Ingest test");
+        sink->Start();
+        EXPECT_TRUE(sink->EnqueueFrame(MakePatternFrame(pixels), system_clock::now()));
+
+        bool shown = false;
+        for (int tries = 0; !shown && tries < 100; tries++)
+        {
+            this_thread::sleep_for(20ms);
+            effect->Update(canvas, 20ms);
+            shown = canvas.Graphics().GetPixel(kWidth - 1, kHeight - 1) == ExpectedPixel(kWidth * kHeight - 1);
+        }
+
+        sink->Stop();
+        return shown;
+    }
+
+    static CRGB ExpectedPixel(size_t index)
+    {
+        return CRGB((3 * index) % 251, (3 * index + 1) % 251, (3 * index + 2) % 251);
+    }
+
+    void ExpectPattern()
+    {
+        for (uint32_t y = 0; y < kHeight; y++)
+            for (uint32_t x = 0; x < kWidth; x++)
+                EXPECT_EQ(canvas.Graphics().GetPixel(x, y), ExpectedPixel(y * kWidth + x)) << x << "," << y;
+    }
+};
+
+TEST_F(DmxIngestTest, FillsRowsFromSacn)
+{
+    ASSERT_TRUE(SendAndShow(IngestProtocol::Sacn, 7, kWidth * kHeight));
+    ExpectPattern();
+}
+
+// Art-Net, with a universe that needs the Net field, and pixels beyond the canvas that have to be
+// left out
+
+TEST_F(DmxIngestTest, FillsRowsFromArtNet)
+{
+    ASSERT_TRUE(SendAndShow(IngestProtocol::ArtNet, 300, 3 * kPixelsPerUniverse));
+    ExpectPattern();
+}
+
+// Channels whose client is offline keep queueing until their overflow policy kicks in.  With a
+// queue budget, each of them may only take up memory in line with its share, however large its
+// ring's capacity.
+
+TEST(QueueBudget, BoundsTheMemoryOfOfflineChannels)
+{
+    constexpr size_t kBudget = 1024 * 1024;
+    constexpr size_t kChannels = 4;
+
+    auto& budget = SocketReactor::Instance().Budget();
+    budget.SetBudget(kBudget);
+
+    vector<shared_ptr<SocketChannel>> channels;
+    for (size_t i = 0; i < kChannels; i++)
+        channels.push_back(make_shared<SocketChannel>("127.0.0.1", "Budget test", 9, 8));
+
+    auto frame = MakeDataFrame(30000, 1);
+    for (int round = 0; round < 10; round++)
+    {
+        for (int i = 0; i < 40; i++)
+            for (auto& channel : channels)
+                channel->EnqueueFrame(frame, system_clock::now() + 1s);
+        this_thread::sleep_for(2 * QueueBudget::kRebalanceInterval);
+    }
+
+    size_t resident = 0;
+    for (auto& channel : channels)
+    {
+        EXPECT_LT(channel->GetQueueBudget(), QueueBudget::kNoLimit);
+        EXPECT_LE(channel->GetQueueResidentBytes(), channel->GetQueueBudget() / 3 * 4 + 2 * frame.size());
+        resident += channel->GetQueueResidentBytes();
+    }
+
+    // Without the budget, that would be their whole capacity, 40MB.  With it, it's in line with
+    // the budget, allowing for a third of headroom on every share, and for the shares adding up to
+    // more than the budget while it isn't used up.
+
+    EXPECT_LE(resident, 3 * kBudget);
+    EXPECT_GT(resident, 0u);
+
+    budget.SetBudget(0);
+}
@@ -0,0 +1,130 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// TransportProfile
+//
+// How a feature's frames get onto the wire: socket options, the send deadline, how big a batch
+// may grow, how fast and with what share of the uplink it may send (see UplinkScheduler) and how
+// much a channel may queue.  Configured per feature as an optional "transport" object, any field
+// of which may be left out to keep its default.  The defaults are what the server has always
+// used, which suits a controller on a decent network; a wired controller can take bigger batches
+// and no Nagle delay, and a weak WiFi one a small send buffer and a longer send timeout.
+//
+// Everything but the queue limits belongs to the connection, so features that share one (see
+// SocketConnection) should agree on those.  If they don't, the connection uses their profiles
+// merged by MergeTransports, whichever order they were attached or changed in.  A profile can be
+// changed while the feature runs, and takes effect right away.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include "json.hpp"
+#include "batchpolicy.h"
+
+struct TransportProfile
+{
+    static constexpr size_t kDefaultMaxQueueFrames = 500;
+    static constexpr size_t kDefaultMaxQueueBytes  = 1024 * 1024 * 10;  // 10MB memory limit
+    static constexpr size_t kMaxBatchFramesLimit   = 256;               // A batch this big takes ContinueSend several writes
+
+    uint32_t     sendBufferBytes   = 0;         // SO_SNDBUF; 0 leaves the kernel's default
+    bool         noDelay           = false;     // TCP_NODELAY
+    uint32_t     notSentLowatBytes = 0;         // TCP_NOTSENT_LOWAT; 0 leaves it unset
+    seconds      keepAliveIdle     = 1s;
+    seconds      keepAliveInterval = 1s;
+    uint32_t     keepAliveCount    = 3;         // Unanswered probes before the connection is dead
+    milliseconds sendTimeout       = 2000ms;    // For a whole batch to be written
+    size_t       maxBatchFrames    = BatchPolicy::kMaxBatchFrames;
+    size_t       maxBatchBytes     = BatchPolicy::kMaxBatchBytes;
+    milliseconds maxBatchDelay     = BatchPolicy::kMaxBatchDelay;
+    uint64_t     maxBytesPerSecond = 0;         // 0 means no limit of its own
+    double       weight            = 1;         // Share of a busy uplink, relative to other connections
+    size_t       maxQueueFrames    = kDefaultMaxQueueFrames;
+    size_t       maxQueueBytes     = kDefaultMaxQueueBytes;
+
+    bool operator==(const TransportProfile&) const = default;
+};
+
+// MergeTransports
+//
+// The profile a connection shared by two features' channels uses, so that it suits both: the
+// larger buffers, the smaller batches, the shorter delays and timeouts, Nagle off if either wants
+// it off, and the lower rate limit.  The connection carries both features' traffic, so it gets
+// both their weights.  The queue limits are each channel's own, and are left as they are in the
+// first profile.
+
+inline TransportProfile MergeTransports(TransportProfile merged, const TransportProfile& other)
+{
+    merged.sendBufferBytes   = max(merged.sendBufferBytes, other.sendBufferBytes);
+    merged.noDelay           = merged.noDelay || other.noDelay;
+    merged.notSentLowatBytes = (merged.notSentLowatBytes && other.notSentLowatBytes) ? max(merged.notSentLowatBytes, other.notSentLowatBytes) : 0;
+    merged.keepAliveIdle     = min(merged.keepAliveIdle, other.keepAliveIdle);
+    merged.keepAliveInterval = min(merged.keepAliveInterval, other.keepAliveInterval);
+    merged.keepAliveCount    = min(merged.keepAliveCount, other.keepAliveCount);
+    merged.sendTimeout       = min(merged.sendTimeout, other.sendTimeout);
+    merged.maxBatchFrames    = min(merged.maxBatchFrames, other.maxBatchFrames);
+    merged.maxBatchBytes     = min(merged.maxBatchBytes, other.maxBatchBytes);
+    merged.maxBatchDelay     = min(merged.maxBatchDelay, other.maxBatchDelay);
+    merged.weight           += other.weight;
+
+    if (!merged.maxBytesPerSecond || (other.maxBytesPerSecond && other.maxBytesPerSecond < merged.maxBytesPerSecond))
+        merged.maxBytesPerSecond = other.maxBytesPerSecond;
+
+    return merged;
+}
+
+inline void to_json(nlohmann::json& j, const TransportProfile& transport)
+{
+    j = {
+        {"sendBufferBytes",      transport.sendBufferBytes},
+        {"noDelay",              transport.noDelay},
+        {"notSentLowatBytes",    transport.notSentLowatBytes},
+        {"keepAliveIdleSec",     transport.keepAliveIdle.count()},
+        {"keepAliveIntervalSec", transport.keepAliveInterval.count()},
+        {"keepAliveCount",       transport.keepAliveCount},
+        {"sendTimeoutMs",        transport.sendTimeout.count()},
+        {"maxBatchFrames",       transport.maxBatchFrames},
+        {"maxBatchBytes",        transport.maxBatchBytes},
+        {"maxBatchDelayMs",      transport.maxBatchDelay.count()},
+        {"maxBytesPerSecond",    transport.maxBytesPerSecond},
+        {"weight",               transport.weight},
+        {"maxQueueFrames",       transport.maxQueueFrames},
+        {"maxQueueBytes",        transport.maxQueueBytes}
+    };
+}
+
+inline void from_json(const nlohmann::json& j, TransportProfile& transport)
+{
+    TransportProfile defaults;
+    transport.sendBufferBytes   = j.value("sendBufferBytes", defaults.sendBufferBytes);
+    transport.noDelay           = j.value("noDelay", defaults.noDelay);
+    transport.notSentLowatBytes = j.value("notSentLowatBytes", defaults.notSentLowatBytes);
+    transport.keepAliveIdle     = seconds(j.value("keepAliveIdleSec", defaults.keepAliveIdle.count()));
+    transport.keepAliveInterval = seconds(j.value("keepAliveIntervalSec", defaults.keepAliveInterval.count()));
+    transport.keepAliveCount    = j.value("keepAliveCount", defaults.keepAliveCount);
+    transport.sendTimeout       = milliseconds(j.value("sendTimeoutMs", defaults.sendTimeout.count()));
+    transport.maxBatchFrames    = j.value("maxBatchFrames", defaults.maxBatchFrames);
+    transport.maxBatchBytes     = j.value("maxBatchBytes", defaults.maxBatchBytes);
+    transport.maxBatchDelay     = milliseconds(j.value("maxBatchDelayMs", defaults.maxBatchDelay.count()));
+    transport.maxBytesPerSecond = j.value("maxBytesPerSecond", defaults.maxBytesPerSecond);
+    transport.weight            = j.value("weight", defaults.weight);
+    transport.maxQueueFrames    = j.value("maxQueueFrames", defaults.maxQueueFrames);
+    transport.maxQueueBytes     = j.value("maxQueueBytes", defaults.maxQueueBytes);
+
+    if (transport.keepAliveIdle <= 0s || transport.keepAliveInterval <= 0s || transport.keepAliveCount == 0)
+        throw invalid_argument("Keepalive timings and count must be positive");
+
+    if (transport.sendTimeout <= 0ms || transport.maxBatchDelay < 0ms)
+        throw invalid_argument("Send timeout must be positive and batch delay can't be negative");
+
+    if (transport.maxBatchFrames == 0 || transport.maxBatchFrames > TransportProfile::kMaxBatchFramesLimit)
+        throw invalid_argument("maxBatchFrames must be between 1 and " + to_string(TransportProfile::kMaxBatchFramesLimit));
+
+    if (!(transport.weight > 0))
+        throw invalid_argument("Weight must be positive");
+
+    if (transport.maxBatchBytes == 0 || transport.maxQueueFrames == 0 || transport.maxQueueBytes == 0)
+        throw invalid_argument("Batch and queue limits must be positive");
+}
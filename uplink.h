@@ -0,0 +1,373 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// UplinkScheduler
+//
+// Paces what every connection in the process sends, so that they share the server's uplink
+// instead of all bursting into it at once.  Each SocketConnection is a flow here, and asks to be
+// admitted before it sends a batch.  It is turned away if
+//
+//   - its own token bucket, filled at its transport profile's maxBytesPerSecond, is empty, in
+//     which case it is told when to try again, or
+//   - the uplink's bucket is empty, or another flow waiting for the uplink comes first, in
+//     which case it waits until the scheduler wakes it.
+//
+// Flows waiting for the uplink are served by priority: first those whose client is close to
+// running out of frames, least lead first, then everyone else in weighted fair order, by the
+// bytes they have sent divided by their weight (start-time fair queueing).  An admitted flow is
+// told how many bytes its buckets hold, and keeps its batch to that, so one big flow can't take
+// a whole second of uplink in one go.  Buckets may still go into debt, as a batch always gets at
+// least one frame however big; the debt just holds back the next one.  With no uplink limit
+// configured, which is the default, only the per-flow buckets apply.
+//
+// Connections call in once per batch, from their strands, so a mutex is cheap enough here.
+
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include <asio.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include "json.hpp"
+
+// UplinkLimits
+//
+// The uplink's share of the config: how many bytes per second all the connections together may
+// send, and how far ahead of that they may burst
+
+struct UplinkLimits
+{
+    uint64_t maxBytesPerSecond = 0;     // 0 means no limit
+    uint64_t burstBytes = 0;            // 0 means a quarter of a second's worth
+
+    bool operator==(const UplinkLimits&) const = default;
+};
+
+inline void to_json(nlohmann::json& j, const UplinkLimits& limits)
+{
+    j = {
+        {"maxBytesPerSecond", limits.maxBytesPerSecond},
+        {"burstBytes",        limits.burstBytes}
+    };
+}
+
+inline void from_json(const nlohmann::json& j, UplinkLimits& limits)
+{
+    UplinkLimits defaults;
+    limits.maxBytesPerSecond = j.value("maxBytesPerSecond", defaults.maxBytesPerSecond);
+    limits.burstBytes = j.value("burstBytes", defaults.burstBytes);
+}
+
+class UplinkScheduler
+{
+public:
+    static constexpr double      kUrgentLead  = 0.25;   // Clients holding less than this fraction of their target lead go first
+    static constexpr nanoseconds kBurstWindow = 250ms;  // Default burst, as time at the bucket's rate
+    static constexpr nanoseconds kWakeGrace   = 20ms;   // How long a woken flow has to come back before the next one gets its turn
+
+    struct Admission
+    {
+        bool                     granted;
+        steady_clock::time_point retryAt;   // If not granted: when to try again, or time_point::max() to wait to be woken
+        size_t                   maxBytes;  // If granted: how much the batch should hold at most
+    };
+
+private:
+    // Bucket
+    //
+    // Bytes that may be sent right now, filled at rate up to burst.  A rate of zero means no limit.
+
+    struct Bucket
+    {
+        double                   rate = 0;
+        double                   burst = 0;
+        double                   tokens = 0;
+        steady_clock::time_point refilled = steady_clock::now();
+
+        void Configure(double newRate, double newBurst)
+        {
+            rate = newRate;
+            burst = newBurst > 0 ? newBurst : rate * duration<double>(kBurstWindow).count();
+            tokens = min(tokens, burst);
+        }
+
+        void Refill(steady_clock::time_point now)
+        {
+            if (rate > 0)
+                tokens = min(burst, tokens + rate * duration<double>(now - refilled).count());
+            refilled = now;
+        }
+
+        bool IsEmpty() const
+        {
+            return rate > 0 && tokens < 0;
+        }
+
+        size_t Available() const
+        {
+            return rate > 0 ? static_cast<size_t>(max(tokens, 0.0)) : numeric_limits<size_t>::max();
+        }
+
+        // When the debt will have been paid off
+
+        steady_clock::time_point PaidOffAt() const
+        {
+            return refilled + duration_cast<steady_clock::duration>(duration<double>(-tokens / rate));
+        }
+    };
+
+    struct Flow
+    {
+        function<void()>         wake;
+        Bucket                   bucket;
+        double                   weight = 1;
+        double                   lead = 1;          // Share of its target lead the client holds
+        double                   virtualTime = 0;   // Bytes sent over weight, the fair queueing tag
+        bool                     waiting = false;
+        bool                     woken = false;
+        steady_clock::time_point wokenAt;
+    };
+
+    mutex              _mutex;
+    asio::steady_timer _timer;
+    bool               _timerArmed = false;
+    steady_clock::time_point _timerExpiry;
+    Bucket             _uplink;
+    map<uint64_t, Flow> _flows;
+    uint64_t           _nextFlowId = 1;
+    double             _virtualClock = 0;
+
+    // Whether a should be served before b
+
+    static bool Before(const Flow& a, const Flow& b)
+    {
+        bool aUrgent = a.lead < kUrgentLead;
+        bool bUrgent = b.lead < kUrgentLead;
+
+        if (aUrgent != bUrgent)
+            return aUrgent;
+        if (aUrgent)
+            return a.lead < b.lead;
+        return a.virtualTime < b.virtualTime;
+    }
+
+    // A woken flow that hasn't come back within kWakeGrace had nothing to send after all
+
+    void ExpireWakes(steady_clock::time_point now)
+    {
+        for (auto& [id, flow] : _flows)
+            if (flow.woken && now - flow.wokenAt > kWakeGrace)
+                flow.waiting = flow.woken = false;
+    }
+
+    // WakeNext
+    //
+    // Called with the lock held once the uplink has tokens: picks the waiting flow that comes
+    // first and returns its wake function, unless a flow that was woken earlier is still due back.
+    // Arms the timer to carry on with the others.
+
+    function<void()> WakeNext(steady_clock::time_point now)
+    {
+        Flow * next = nullptr;
+        bool pending = false;
+
+        for (auto& [id, flow] : _flows)
+        {
+            if (!flow.waiting)
+                continue;
+
+            if (flow.woken)
+                pending = true;
+            else if (!next || Before(flow, *next))
+                next = &flow;
+        }
+
+        if (pending || !next)
+        {
+            if (pending || next)
+                ArmTimer(now + kWakeGrace);
+            return nullptr;
+        }
+
+        next->woken = true;
+        next->wokenAt = now;
+        ArmTimer(now + kWakeGrace);
+        return next->wake;
+    }
+
+    void ArmTimer(steady_clock::time_point expiry)
+    {
+        if (_timerArmed && _timerExpiry <= expiry)
+            return;
+
+        _timerArmed = true;
+        _timerExpiry = expiry;
+        _timer.expires_at(expiry);
+        _timer.async_wait([this](const asio::error_code& error)
+        {
+            if (!error)
+                OnTimer();
+        });
+    }
+
+    void OnTimer()
+    {
+        function<void()> wake;
+        {
+            lock_guard lock(_mutex);
+            _timerArmed = false;
+
+            auto now = steady_clock::now();
+            _uplink.Refill(now);
+            ExpireWakes(now);
+
+            if (_uplink.IsEmpty())
+            {
+                if (ranges::any_of(_flows, [](const auto& entry) { return entry.second.waiting; }))
+                    ArmTimer(_uplink.PaidOffAt());
+            }
+            else
+            {
+                wake = WakeNext(now);
+            }
+        }
+
+        if (wake)
+            wake();
+    }
+
+public:
+    explicit UplinkScheduler(asio::io_context& context) : _timer(context)
+    {
+    }
+
+    // Register
+    //
+    // Adds a flow.  wake is called, from any thread and without the scheduler's lock held, when a
+    // flow that was told to wait should ask again.
+
+    uint64_t Register(function<void()> wake)
+    {
+        lock_guard lock(_mutex);
+        uint64_t id = _nextFlowId++;
+        _flows[id].wake = std::move(wake);
+        _flows[id].virtualTime = _virtualClock;
+        return id;
+    }
+
+    void Unregister(uint64_t id)
+    {
+        lock_guard lock(_mutex);
+        _flows.erase(id);
+    }
+
+    void SetFlowLimits(uint64_t id, uint64_t maxBytesPerSecond, double weight)
+    {
+        lock_guard lock(_mutex);
+        auto flow = _flows.find(id);
+        if (flow == _flows.end())
+            return;
+
+        flow->second.bucket.Refill(steady_clock::now());
+        flow->second.bucket.Configure(static_cast<double>(maxBytesPerSecond), 0);
+        flow->second.weight = max(weight, 0.01);
+    }
+
+    void SetLimits(const UplinkLimits& limits)
+    {
+        lock_guard lock(_mutex);
+        _uplink.Refill(steady_clock::now());
+        _uplink.Configure(static_cast<double>(limits.maxBytesPerSecond), static_cast<double>(limits.burstBytes));
+    }
+
+    // Admit
+    //
+    // Whether flow id may send a batch now.  lead is how much of its target lead the flow's client
+    // holds, from 0 (about to run dry) to 1 (full, or unknown).  A flow that is admitted must
+    // Charge for what it sends.
+
+    Admission Admit(uint64_t id, double lead, steady_clock::time_point now)
+    {
+        lock_guard lock(_mutex);
+        auto entry = _flows.find(id);
+        if (entry == _flows.end())
+            return { true, {}, numeric_limits<size_t>::max() };
+
+        auto& flow = entry->second;
+        flow.lead = lead;
+        flow.bucket.Refill(now);
+
+        if (flow.bucket.IsEmpty())
+            return { false, flow.bucket.PaidOffAt(), 0 };
+
+        if (_uplink.rate == 0)
+            return { true, {}, flow.bucket.Available() };
+
+        _uplink.Refill(now);
+        ExpireWakes(now);
+
+        // A flow that has been idle starts over at the current virtual time, so it can't save up
+        // a claim to the uplink while it isn't using it
+
+        if (!flow.waiting)
+            flow.virtualTime = max(flow.virtualTime, _virtualClock);
+
+        bool first = ranges::none_of(_flows, [&](const auto& other)
+        {
+            return &other.second != &flow && other.second.waiting && Before(other.second, flow);
+        });
+
+        if (first && !_uplink.IsEmpty())
+        {
+            flow.waiting = flow.woken = false;
+            return { true, {}, min(flow.bucket.Available(), _uplink.Available()) };
+        }
+
+        flow.waiting = true;
+        flow.woken = false;
+        ArmTimer(_uplink.IsEmpty() ? _uplink.PaidOffAt() : now);
+        return { false, steady_clock::time_point::max(), 0 };
+    }
+
+    // Charge
+    //
+    // Takes what an admitted flow has sent out of its bucket and the uplink's, and passes the
+    // uplink on to the next waiting flow if there is still room
+
+    void Charge(uint64_t id, size_t bytes, steady_clock::time_point now)
+    {
+        function<void()> wake;
+        {
+            lock_guard lock(_mutex);
+            auto entry = _flows.find(id);
+            if (entry == _flows.end())
+                return;
+
+            auto& flow = entry->second;
+            if (flow.bucket.rate > 0)
+                flow.bucket.tokens -= bytes;
+
+            if (_uplink.rate == 0)
+                return;
+
+            _uplink.tokens -= bytes;
+            _virtualClock = flow.virtualTime;
+            flow.virtualTime += bytes / flow.weight;
+
+            if (!_uplink.IsEmpty())
+                wake = WakeNext(now);
+            else if (ranges::any_of(_flows, [](const auto& other) { return other.second.waiting; }))
+                ArmTimer(_uplink.PaidOffAt());
+        }
+
+        if (wake)
+            wake();
+    }
+};
@@ -1,5 +1,6 @@
 #pragma once
 using namespace std;
+using namespace std::chrono;
 
 // Utilities
 //
@@ -10,11 +11,14 @@ using namespace std;
 
 #include <vector>
 #include <array>
+#include <chrono>
+#include <span>
 #include <random>
 #include <cmath>
 #include <cstdint>
 #include <cstring>
 #include <initializer_list>
+#include <algorithm>
 #include <zlib.h>
 #include "pixeltypes.h"
 
@@ -183,6 +187,38 @@ public:
         }
     }
 
+    // Reads back a uint64_t written by ULONGToBytes
+    static uint64_t BytesToULONG(span<const uint8_t, 8> bytes)
+    {
+        uint64_t value = 0;
+        for (size_t i = 0; i < bytes.size(); i++)
+            value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+        return value;
+    }
+
+    // The command, channel, length, seconds and microseconds in front of a data frame's pixels
+
+    static constexpr size_t kDataFrameHeaderSize = 2 * sizeof(uint16_t) + sizeof(uint32_t) + 2 * sizeof(uint64_t);
+
+    // DataFramePresentationTime
+    //
+    // The time at which the client is meant to show an uncompressed pixel data frame, as
+    // LEDFeature::GetDataFrame stamps it: seconds and microseconds since the epoch, after the
+    // command, channel and length fields.  Anything too short to be a data frame gets the epoch,
+    // which stands for "no presentation time".
+
+    static system_clock::time_point DataFramePresentationTime(span<const uint8_t> dataFrame)
+    {
+        constexpr size_t kSecondsOffset = 2 * sizeof(uint16_t) + sizeof(uint32_t);
+
+        if (dataFrame.size() < kDataFrameHeaderSize)
+            return {};
+
+        auto wholeSeconds = BytesToULONG(dataFrame.subspan<kSecondsOffset, sizeof(uint64_t)>());
+        auto micros = BytesToULONG(dataFrame.subspan<kSecondsOffset + sizeof(uint64_t), sizeof(uint64_t)>());
+        return system_clock::time_point(duration_cast<system_clock::duration>(seconds(wholeSeconds) + microseconds(micros)));
+    }
+
     // Combines multiple byte arrays into one.  My masterpiece for the day :-)
 
     template <typename... Arrays>
@@ -254,5 +290,74 @@ public:
 
         return compressedData;
     }
+
+    // CompressBound
+    //
+    // The most space CompressInto can need for size bytes of input
+
+    static size_t CompressBound(size_t size)
+    {
+        return compressBound(static_cast<uLong>(size));
+    }
+
+    // CompressInto
+    //
+    // Same output as Compress, but written straight into a caller-supplied buffer of at least
+    // CompressBound(data.size()) bytes.  Returns the number of compressed bytes written.
+
+    static size_t CompressInto(const vector<uint8_t> &data, uint8_t *destination, size_t capacity)
+    {
+        uLongf compressedSize = static_cast<uLongf>(capacity);
+        if (compress2(destination, &compressedSize, data.data(), static_cast<uLong>(data.size()), Z_BEST_SPEED) != Z_OK)
+            throw runtime_error("Error during zlib compression");
+
+        return compressedSize;
+    }
+
+    // Compressed frames
+    //
+    // A compressed frame starts with a header of a magic number, the compressed and original
+    // sizes, and a custom tag, which is followed by the zlib-compressed data frame
+
+    static constexpr size_t   kCompressedHeaderSize = 4 * sizeof(uint32_t);
+    static constexpr uint32_t kCompressedHeaderTag  = 0x44415645;    // Magic "DAVE" tag
+
+    static void WriteCompressedHeader(uint8_t * destination, size_t compressedSize, size_t originalSize)
+    {
+        constexpr uint32_t CUSTOM_TAG = 0x12345678;
+
+        auto header = CombineByteArrays(
+            DWORDToBytes(kCompressedHeaderTag),
+            DWORDToBytes(static_cast<uint32_t>(compressedSize)),
+            DWORDToBytes(static_cast<uint32_t>(originalSize)),
+            DWORDToBytes(CUSTOM_TAG)
+        );
+        memcpy(destination, header.data(), kCompressedHeaderSize);
+    }
+
+    // Takes a frame of binary data, compresses it, and puts the header in front of it
+
+    static vector<uint8_t> CompressFrame(const vector<uint8_t> &data)
+    {
+        auto compressedData = Compress(data);
+
+        vector<uint8_t> frame(kCompressedHeaderSize);
+        WriteCompressedHeader(frame.data(), compressedData.size(), data.size());
+        frame.insert(frame.end(), compressedData.begin(), compressedData.end());
+        return frame;
+    }
+
+    // The original size of a frame that starts with a compressed frame header, or just the size
+    // of any other frame
+
+    static size_t UncompressedSize(span<const uint8_t> frame)
+    {
+        constexpr array<uint8_t, 4> kTag = DWORDToBytes(kCompressedHeaderTag);
+
+        if (frame.size() < kCompressedHeaderSize || !equal(kTag.begin(), kTag.end(), frame.begin()))
+            return frame.size();
+
+        return frame[8] | (frame[9] << 8) | (frame[10] << 16) | (static_cast<uint32_t>(frame[11]) << 24);
+    }
 };
 
@@ -114,6 +114,44 @@ public:
             });
 
 
+        // How much of the queue budget the sockets are using, and the budget itself, which can
+        // be changed on the fly
+
+        CROW_ROUTE(_crowApp, "/api/budget")
+            .methods(crow::HTTPMethod::GET)([&]() -> crow::response
+            {
+                try
+                {
+                    shared_lock readLock(_apiMutex);
+                    return nlohmann::json{{"budget", _controller.GetQueueBudgetUsage()}}.dump();
+                }
+                catch(const std::exception& e)
+                {
+                    logger->error("Error in /api/budget: {}", e.what());
+                    return {crow::BAD_REQUEST, string("Error: ") + e.what()};
+                }
+            });
+
+        CROW_ROUTE(_crowApp, "/api/budget")
+            .methods(crow::HTTPMethod::POST)([&](const crow::request& req) -> crow::response
+            {
+                try
+                {
+                    auto reqJson = nlohmann::json::parse(req.body);
+
+                    unique_lock writeLock(_apiMutex);
+                    _controller.SetQueueBudget(reqJson.at("budgetBytes").get<size_t>());
+                    PersistController(req);
+
+                    return nlohmann::json{{"budget", _controller.GetQueueBudgetUsage()}}.dump();
+                }
+                catch(const std::exception& e)
+                {
+                    logger->error("Error in /api/budget POST: {}", e.what());
+                    return {crow::BAD_REQUEST, string("Error: ") + e.what()};
+                }
+            });
+
         // Detail a single socket
 
         CROW_ROUTE(_crowApp, "/api/sockets/<int>") 
@@ -122,7 +160,15 @@ public:
                 try
                 {
                     shared_lock readLock(_apiMutex);
-                    return nlohmann::json{{"socket", _controller.GetSocketById(socketId)}}.dump();
+                    auto socket = _controller.GetSocketById(socketId);
+
+                    // The full response history and latency distributions are only worth sending
+                    // when asking about one socket
+
+                    nlohmann::json socketJson = socket;
+                    socketJson["recentResponses"] = socket->RecentClientResponses();
+                    socketJson["latencyBuckets"] = socket->GetLatency().Buckets();
+                    return nlohmann::json{{"socket", socketJson}}.dump();
                 }
                 catch(const std::exception& e)
                 {
@@ -254,6 +300,38 @@ public:
                 });
 
 
+            // Change a feature's transport profile while it runs.  Fields left out of the request
+            // keep their current values.
+            CROW_ROUTE(_crowApp, "/api/canvases/<int>/features/<int>/transport")
+                .methods(crow::HTTPMethod::POST)([&](const crow::request& req, int canvasId, int featureId) -> crow::response
+                {
+                    try
+                    {
+                        auto reqJson = nlohmann::json::parse(req.body);
+
+                        unique_lock writeLock(_apiMutex);
+                        auto features = _controller.GetCanvasById(canvasId)->Features();
+                        auto feature = ranges::find_if(features, [&](const auto& f) { return f->Id() == static_cast<uint32_t>(featureId); });
+                        if (feature == features.end())
+                            throw runtime_error("Feature not found: " + to_string(featureId));
+                        if (!(*feature)->Socket())
+                            throw runtime_error("Feature has no transport: " + to_string(featureId));
+
+                        nlohmann::json transportJson = (*feature)->Socket()->GetTransport();
+                        transportJson.update(reqJson);
+                        (*feature)->Socket()->SetTransport(transportJson.get<TransportProfile>());
+                        PersistController(req);
+                        writeLock.unlock();
+
+                        return nlohmann::json{{"transport", transportJson}}.dump();
+                    }
+                    catch (const exception& e)
+                    {
+                        logger->error("Error in /api/canvases/{}/features/{}/transport POST: {}", canvasId, featureId, e.what());
+                        return {crow::BAD_REQUEST, string("Error: ") + e.what()};
+                    }
+                });
+
             // Delete feature from canvas
             CROW_ROUTE(_crowApp, "/api/canvases/<int>/features/<int>")
                 .methods(crow::HTTPMethod::DELETE)([&](const crow::request& req, int canvasId, int featureId)